@@ -26,12 +26,604 @@
 *    source distribution.
 */
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "ungod/visual/Light.h"
 #include "ungod/physics/Physics.h"
+#include <SFML/OpenGL.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <set>
+#include <thread>
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNGOD_LIGHT_SSE2
+#endif
 
 namespace ungod
 {
-    BaseLight::BaseLight() : mActive(true) {}
+    namespace
+    {
+        //set by LightSystem::initSoftware, lights that are created afterwards load no textures
+        std::atomic<bool> softwareOnly(false);
+
+        sf::Vertex lerpVertex(const sf::Vertex& a, const sf::Vertex& b, float t)
+        {
+            sf::Vertex v;
+            v.position = a.position + (b.position - a.position) * t;
+            v.texCoords = a.texCoords + (b.texCoords - a.texCoords) * t;
+            v.color.r = (sf::Uint8)(a.color.r + (b.color.r - a.color.r) * t);
+            v.color.g = (sf::Uint8)(a.color.g + (b.color.g - a.color.g) * t);
+            v.color.b = (sf::Uint8)(a.color.b + (b.color.b - a.color.b) * t);
+            v.color.a = (sf::Uint8)(a.color.a + (b.color.a - a.color.a) * t);
+            return v;
+        }
+
+        /** \brief Draws a black mask polygon, clipped to the given rect. */
+        void drawMask(sf::RenderTarget& target, const std::vector<sf::Vector2f>& points, const sf::FloatRect& clipRect)
+        {
+            std::vector<sf::Vertex> polygon;
+            polygon.reserve(points.size() + 4);
+            for (const auto& p : points)
+                polygon.emplace_back(p, sf::Color::Black);
+            clipPolygon(polygon, clipRect);
+            if (polygon.size() >= 3)
+                target.draw(polygon.data(), polygon.size(), sf::TriangleFan);
+        }
+
+        /** \brief Clips a black mask polygon to the given rect and appends it as triangles. */
+        void appendMask(std::vector<sf::Vertex>& triangles, const std::vector<sf::Vector2f>& points, const sf::FloatRect& clipRect)
+        {
+            std::vector<sf::Vertex> polygon;
+            polygon.reserve(points.size() + 4);
+            for (const auto& p : points)
+                polygon.emplace_back(p, sf::Color::Black);
+            clipPolygon(polygon, clipRect);
+            for (std::size_t i = 2; i < polygon.size(); ++i)
+            {
+                triangles.push_back(polygon[0]);
+                triangles.push_back(polygon[i - 1]);
+                triangles.push_back(polygon[i]);
+            }
+        }
+
+        float cross(const sf::Vector2f& a, const sf::Vector2f& b)
+        {
+            return a.x * b.y - a.y * b.x;
+        }
+
+        /** \brief Returns the distance from center along dir to the line through a and b. */
+        float rayLineDistance(const sf::Vector2f& center, const sf::Vector2f& dir, const sf::Vector2f& a, const sf::Vector2f& b)
+        {
+            sf::Vector2f ab = b - a;
+            float denom = cross(dir, ab);
+            if (std::abs(denom) < 1e-6f)
+                return std::min(std::hypot(a.x - center.x, a.y - center.y), std::hypot(b.x - center.x, b.y - center.y));
+            return cross(a - center, ab) / denom;
+        }
+
+        const float PI = 3.14159265f;
+
+        float signedAngle(const sf::Vector2f& a, const sf::Vector2f& b)
+        {
+            return std::atan2(cross(a, b), a.x * b.x + a.y * b.y);
+        }
+
+        /** \brief Returns the distance from p to the segment between a and b. */
+        float segmentDistance(const sf::Vector2f& p, const sf::Vector2f& a, const sf::Vector2f& b)
+        {
+            sf::Vector2f ab = b - a;
+            float lengthSq = ab.x * ab.x + ab.y * ab.y;
+            float t = (lengthSq > 0.0f) ? std::max(0.0f, std::min(1.0f, ((p.x - a.x) * ab.x + (p.y - a.y) * ab.y) / lengthSq)) : 0.0f;
+            sf::Vector2f closest = a + ab * t;
+            return std::hypot(p.x - closest.x, p.y - closest.y);
+        }
+
+        /** \brief Returns the distance from p to the outline of a polygon. */
+        float polygonDistance(const sf::Vector2f& p, const sf::Vector2f* points, std::size_t count)
+        {
+            float distance = std::numeric_limits<float>::max();
+            for (std::size_t i = 0; i < count; ++i)
+                distance = std::min(distance, segmentDistance(p, points[i], points[(i + 1) % count]));
+            return distance;
+        }
+
+        /** \brief Returns true if p lies inside of the convex polygon. */
+        bool insideConvexPolygon(const sf::Vector2f& p, const sf::Vector2f* points, std::size_t count)
+        {
+            bool positive = false;
+            bool negative = false;
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                float side = cross(points[(i + 1) % count] - points[i], p - points[i]);
+                positive = positive || side > 0.0f;
+                negative = negative || side < 0.0f;
+                if (positive && negative)
+                    return false;
+            }
+            return count >= 3;
+        }
+
+        /** \brief Angular coverage of the full umbras around a light source. Every entry is an angular
+        * interval together with a range of distances from the source in which the interval is
+        * completely inside of a single umbra. */
+        class UmbraCoverage
+        {
+        public:
+            UmbraCoverage(const sf::Vector2f& center) : mCenter(center) {}
+
+            /** \brief Adds the umbra between the inner boundary rays (as, ad) and (bs, bd). The rays must not intersect. */
+            void add(sf::Vector2f as, sf::Vector2f ad, sf::Vector2f bs, sf::Vector2f bd, float extension)
+            {
+                sf::Vector2f ra = as - mCenter;
+                sf::Vector2f rb = bs - mCenter;
+                if (cross(ra, rb) < 0.0f)
+                {
+                    std::swap(as, bs);
+                    std::swap(ad, bd);
+                    std::swap(ra, rb);
+                }
+                sf::Vector2f fa = as + normalizeVector(ad) * extension;
+                sf::Vector2f fb = bs + normalizeVector(bd) * extension;
+
+                //inside of the angles covered by both the near and the far edge, rays from the source
+                //enter the umbra through the near edge and leave it through the far edge
+                float begin = std::max(0.0f, signedAngle(ra, fa - mCenter));
+                float end = std::min(signedAngle(ra, rb), signedAngle(ra, fb - mCenter));
+                if (end <= begin)
+                    return;
+
+                Interval interval;
+                interval.begin = std::atan2(ra.y, ra.x) + begin;
+                interval.span = end - begin;
+                interval.nearDistance = std::max(std::hypot(ra.x, ra.y), std::hypot(rb.x, rb.y));
+                interval.farDistance = segmentDistance(mCenter, fa, fb);
+                if (interval.farDistance > interval.nearDistance)
+                    mIntervals.push_back(interval);
+            }
+
+            /** \brief Returns true if the convex polygon is completely inside of the covered area. */
+            bool covers(const sf::Vector2f* points, std::size_t count) const
+            {
+                if (mIntervals.empty() || count == 0)
+                    return false;
+
+                sf::Vector2f ref = points[0] - mCenter;
+                float low = 0.0f;
+                float high = 0.0f;
+                float maxDistance = 0.0f;
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    sf::Vector2f v = points[i] - mCenter;
+                    float angle = signedAngle(ref, v);
+                    low = std::min(low, angle);
+                    high = std::max(high, angle);
+                    maxDistance = std::max(maxDistance, std::hypot(v.x, v.y));
+                }
+                if (high - low >= PI) //the polygon surrounds the source
+                    return false;
+                float minDistance = polygonDistance(mCenter, points, count);
+
+                //the polygon lies in the polar box [low, high] x [minDistance, maxDistance],
+                //check if the intervals that contain that distance range cover the angles
+                float refAngle = std::atan2(ref.y, ref.x);
+                std::vector< std::pair<float, float> > candidates;
+                for (const auto& interval : mIntervals)
+                {
+                    if (interval.nearDistance > minDistance || interval.farDistance < maxDistance)
+                        continue;
+                    float begin = std::remainder(interval.begin - refAngle, 2.0f * PI);
+                    candidates.emplace_back(begin, begin + interval.span);
+                    candidates.emplace_back(begin - 2.0f * PI, begin - 2.0f * PI + interval.span);
+                }
+                std::sort(candidates.begin(), candidates.end());
+
+                float reach = low;
+                for (const auto& c : candidates)
+                {
+                    if (c.first > reach)
+                        break;
+                    reach = std::max(reach, c.second);
+                    if (reach >= high)
+                        return true;
+                }
+                return false;
+            }
+
+        private:
+            struct Interval
+            {
+                float begin;
+                float span;
+                float nearDistance;
+                float farDistance;
+            };
+
+            sf::Vector2f mCenter;
+            std::vector<Interval> mIntervals;
+        };
+
+        /** \brief An edge that blocks light, used by the visibility polygon sweep. */
+        struct Segment
+        {
+            sf::Vector2f a, b;
+        };
+
+        /** \brief Splits the segments at their mutual intersections, so that no two segments cross in their interiors.
+        * Segments are sorted by their left end, only pairs whose x ranges overlap are tested. That keeps the split
+        * near O(n log n) for scattered colliders, it is quadratic only if most of the segments overlap in x. */
+        void splitIntersections(const std::vector<Segment>& segments, std::vector<Segment>& result)
+        {
+            const float EPSILON = 1e-4f;
+            std::vector<std::size_t> order(segments.size());
+            std::iota(order.begin(), order.end(), 0);
+            auto minX = [&segments] (std::size_t i) { return std::min(segments[i].a.x, segments[i].b.x); };
+            auto maxX = [&segments] (std::size_t i) { return std::max(segments[i].a.x, segments[i].b.x); };
+            std::sort(order.begin(), order.end(), [&minX] (std::size_t i, std::size_t j) { return minX(i) < minX(j); });
+
+            std::vector< std::vector<float> > cuts(segments.size());
+            for (std::size_t oi = 0; oi < order.size(); ++oi)
+            {
+                std::size_t i = order[oi];
+                sf::Vector2f di = segments[i].b - segments[i].a;
+                float rightI = maxX(i);
+                float topI = std::min(segments[i].a.y, segments[i].b.y);
+                float bottomI = std::max(segments[i].a.y, segments[i].b.y);
+                for (std::size_t oj = oi + 1; oj < order.size() && minX(order[oj]) <= rightI; ++oj)
+                {
+                    std::size_t j = order[oj];
+                    if (std::max(segments[j].a.y, segments[j].b.y) < topI || std::min(segments[j].a.y, segments[j].b.y) > bottomI)
+                        continue;
+                    sf::Vector2f dj = segments[j].b - segments[j].a;
+                    float denom = cross(di, dj);
+                    if (std::abs(denom) < EPSILON) //parallel segments do not cross
+                        continue;
+                    sf::Vector2f offset = segments[j].a - segments[i].a;
+                    float t = cross(offset, dj) / denom;
+                    float u = cross(offset, di) / denom;
+                    if (t < 0.0f || t > 1.0f || u < 0.0f || u > 1.0f)
+                        continue;
+                    //touching end points need no cut
+                    if (t > EPSILON && t < 1.0f - EPSILON)
+                        cuts[i].push_back(t);
+                    if (u > EPSILON && u < 1.0f - EPSILON)
+                        cuts[j].push_back(u);
+                }
+            }
+
+            result.clear();
+            for (std::size_t i = 0; i < segments.size(); ++i)
+            {
+                std::sort(cuts[i].begin(), cuts[i].end());
+                sf::Vector2f d = segments[i].b - segments[i].a;
+                sf::Vector2f start = segments[i].a;
+                for (float t : cuts[i])
+                {
+                    sf::Vector2f end = segments[i].a + d * t;
+                    result.push_back({ start, end });
+                    start = end;
+                }
+                result.push_back({ start, segments[i].b });
+            }
+        }
+
+        /** \brief Computes the visibility polygon around center in a single angular sweep over the segments.
+        * The segments have to enclose the center (e.g. by including the light bounds). The polygon is returned
+        * as a sequence of points in angular order. Discontinuities, where the closest segment changes
+        * at a vertex that is a silhouette of an occluder, are reported as penumbras on the lit side of the edge.
+        * The sweep keeps the open segments ordered by distance and runs in O(n log n) after the split. */
+        void computeVisibilityPolygon(const sf::Vector2f& center, float sourceRadius, const std::vector<Segment>& input,
+                                      std::vector<sf::Vector2f>& polygon, std::vector<Penumbra>& penumbras)
+        {
+            //colliders may overlap, after the split open segments never cross and keep their order while open
+            std::vector<Segment> segments;
+            splitIntersections(input, segments);
+
+            struct Event
+            {
+                float angle;
+                std::size_t segment;
+                bool begin;
+            };
+
+            std::vector<Event> events;
+            events.reserve(segments.size() * 2);
+            for (std::size_t i = 0; i < segments.size(); ++i)
+            {
+                float angleA = std::atan2(segments[i].a.y - center.y, segments[i].a.x - center.x);
+                float angleB = std::atan2(segments[i].b.y - center.y, segments[i].b.x - center.x);
+                float delta = std::remainder(angleB - angleA, 2.0f * PI);
+                if (delta == 0.0f) //collinear with the source, blocks nothing
+                    continue;
+                events.push_back({ angleA, i, delta > 0.0f });
+                events.push_back({ angleB, i, delta < 0.0f });
+            }
+            //ends before begins, so that segments sharing a vertex are never open at the same angle
+            std::sort(events.begin(), events.end(), [] (const Event& a, const Event& b)
+                      { return a.angle < b.angle || (a.angle == b.angle && !a.begin && b.begin); });
+
+            const std::size_t NONE = std::numeric_limits<std::size_t>::max();
+
+            //segments are inserted at the middle between two event angles, where every open segment is hit by the
+            //ray and no end point lies, so the distances along that ray order them
+            float compareAngle = 0.0f;
+            auto closer = [&center, &segments, &compareAngle] (std::size_t i, std::size_t j)
+            {
+                sf::Vector2f dir(std::cos(compareAngle), std::sin(compareAngle));
+                float di = rayLineDistance(center, dir, segments[i].a, segments[i].b);
+                float dj = rayLineDistance(center, dir, segments[j].a, segments[j].b);
+                return di < dj || (di == dj && i < j);
+            };
+            std::set<std::size_t, decltype(closer)> open(closer);
+            std::vector<std::set<std::size_t, decltype(closer)>::iterator> openIt(segments.size(), open.end());
+            auto closest = [&open, NONE] () { return open.empty() ? NONE : *open.begin(); };
+
+            auto pointAt = [&center, &segments] (std::size_t segment, float angle)
+            {
+                sf::Vector2f dir(std::cos(angle), std::sin(angle));
+                return center + dir * rayLineDistance(center, dir, segments[segment].a, segments[segment].b);
+            };
+
+            float beginAngle = 0.0f;
+            std::size_t front = NONE;
+
+            //the first pass only opens the segments that wrap around at -pi/pi, the second emits the polygon
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                for (std::size_t i = 0; i < events.size(); ++i)
+                {
+                    const Event& event = events[i];
+                    std::size_t frontBefore = front;
+
+                    std::size_t next = i + 1;
+                    while (next < events.size() && events[next].angle == event.angle)
+                        ++next;
+                    compareAngle = 0.5f * (event.angle + ((next < events.size()) ? events[next].angle : PI));
+
+                    if (event.begin && openIt[event.segment] == open.end())
+                        openIt[event.segment] = open.insert(event.segment).first;
+                    else if (!event.begin && openIt[event.segment] != open.end())
+                    {
+                        open.erase(openIt[event.segment]);
+                        openIt[event.segment] = open.end();
+                    }
+
+                    std::size_t frontAfter = closest();
+                    front = frontAfter;
+                    if (frontBefore == frontAfter)
+                        continue;
+
+                    if (pass == 1 && frontBefore != NONE)
+                    {
+                        polygon.push_back(pointAt(frontBefore, beginAngle));
+                        sf::Vector2f end = pointAt(frontBefore, event.angle);
+                        polygon.push_back(end);
+
+                        if (frontAfter != NONE)
+                        {
+                            //the closer of both points is the silhouette vertex, the light is on the far side
+                            sf::Vector2f start = pointAt(frontAfter, event.angle);
+                            sf::Vector2f toEnd = end - center;
+                            sf::Vector2f toStart = start - center;
+                            float endDistance = toEnd.x * toEnd.x + toEnd.y * toEnd.y;
+                            float startDistance = toStart.x * toStart.x + toStart.y * toStart.y;
+                            if (std::abs(endDistance - startDistance) > 1.0f)
+                            {
+                                bool litAfter = endDistance < startDistance;
+                                Penumbra penumbra;
+                                penumbra.source = litAfter ? end : start;
+                                sf::Vector2f radial = penumbra.source - center;
+                                sf::Vector2f offset = normalizeVector({ -radial.y, radial.x }) * sourceRadius;
+                                //the ray through the silhouette from the edge of the source that is rotated towards the occluder
+                                penumbra.darkEdge = radial;
+                                penumbra.lightEdge = litAfter ? penumbra.source - (center - offset) : penumbra.source - (center + offset);
+                                penumbra.lightBrightness = 1.0f;
+                                penumbra.darkBrightness = 0.0f;
+                                penumbra.distance = std::sqrt(std::min(endDistance, startDistance));
+                                penumbras.push_back(penumbra);
+                            }
+                        }
+                    }
+                    beginAngle = event.angle;
+                }
+            }
+        }
+
+        /** \brief The full (not antumbra) shadow of a single collider: the segment as-bs extruded along ad and bd. */
+        struct Umbra
+        {
+            sf::Vector2f as, bs, ad, bd;
+        };
+
+        /** \brief Appends the radial wedge of an umbra between the angles begin and end. */
+        void appendUmbraWedge(std::vector<sf::Vertex>& triangles, const sf::Vector2f& center, const Umbra& umbra,
+                              float begin, float end, float shadowExtension, const sf::FloatRect& clipRect)
+        {
+            //split wide wedges, so that the chord between the far points stays outside of the light
+            int steps = std::max(1, (int)std::ceil((end - begin) / (PI / 4.0f)));
+            float step = (end - begin) / steps;
+            float farScale = 1.0f / std::cos(step / 2.0f);
+            for (int s = 0; s < steps; ++s)
+            {
+                float a0 = begin + s * step;
+                float a1 = a0 + step;
+                sf::Vector2f d0(std::cos(a0), std::sin(a0));
+                sf::Vector2f d1(std::cos(a1), std::sin(a1));
+                float t0 = rayLineDistance(center, d0, umbra.as, umbra.bs);
+                float t1 = rayLineDistance(center, d1, umbra.as, umbra.bs);
+                float far = (std::max(t0, t1) + shadowExtension) * farScale;
+                appendMask(triangles, { center + d0 * t0, center + d1 * t1, center + d1 * far, center + d0 * far }, clipRect);
+            }
+        }
+
+        /** \brief Draws the union of the given umbras as a set of non overlapping polygons.
+        * Umbras are converted into angular intervals around the light source. An angular sweep
+        * finds for every sector the umbra that is closest to the source, which hides all others
+        * in that sector. Only the closest umbra is emitted there. The thin regions between the
+        * radial rays and the outer boundary rays are emitted seperately. */
+        void drawMergedUmbras(sf::RenderTarget& target, const std::vector<Umbra>& umbras, const sf::Vector2f& center,
+                              float shadowExtension, const sf::FloatRect& clipRect)
+        {
+            struct Event
+            {
+                float angle;
+                std::size_t umbra;
+                bool begin;
+            };
+
+            std::vector<Event> events;
+            events.reserve(umbras.size() * 2);
+            std::vector<Umbra> wedges;
+            wedges.reserve(umbras.size());
+            std::vector<sf::Vertex> triangles;
+
+            for (Umbra u : umbras)
+            {
+                sf::Vector2f ra = u.as - center;
+                sf::Vector2f rb = u.bs - center;
+                if (cross(ra, rb) < 0.0f)
+                {
+                    std::swap(u.as, u.bs);
+                    std::swap(u.ad, u.bd);
+                    std::swap(ra, rb);
+                }
+                //the radial wedge is only contained in the umbra if the outer rays diverge from the radial rays
+                if (cross(ra, rb) <= 0.0f || cross(ra, u.ad) > 0.0f || cross(rb, u.bd) < 0.0f)
+                {
+                    appendMask(triangles, { u.as, u.bs, u.bs + normalizeVector(u.bd) * shadowExtension,
+                                            u.as + normalizeVector(u.ad) * shadowExtension }, clipRect);
+                    continue;
+                }
+
+                std::size_t index = wedges.size();
+                wedges.push_back(u);
+                float begin = std::atan2(ra.y, ra.x);
+                float end = std::atan2(rb.y, rb.x);
+                if (end < begin) //wraps around at -pi/pi
+                {
+                    events.push_back({ begin, index, true });
+                    events.push_back({ PI, index, false });
+                    events.push_back({ -PI, index, true });
+                    events.push_back({ end, index, false });
+                }
+                else
+                {
+                    events.push_back({ begin, index, true });
+                    events.push_back({ end, index, false });
+                }
+
+                appendMask(triangles, { u.as, u.as + normalizeVector(ra) * shadowExtension, u.as + normalizeVector(u.ad) * shadowExtension }, clipRect);
+                appendMask(triangles, { u.bs, u.bs + normalizeVector(u.bd) * shadowExtension, u.bs + normalizeVector(rb) * shadowExtension }, clipRect);
+            }
+
+            //a degenerate umbra begins and ends at the same angle, its begin has to be seen first
+            std::sort(events.begin(), events.end(), [] (const Event& a, const Event& b)
+                      { return a.angle < b.angle || (a.angle == b.angle && a.begin && !b.begin); });
+
+            const std::size_t NONE = std::numeric_limits<std::size_t>::max();
+            std::vector<std::size_t> active;
+            std::size_t runUmbra = NONE;
+            float runBegin = 0.0f;
+            float runEnd = 0.0f;
+
+            for (std::size_t i = 0; i < events.size(); ++i)
+            {
+                if (events[i].begin)
+                    active.push_back(events[i].umbra);
+                else
+                {
+                    auto it = std::find(active.begin(), active.end(), events[i].umbra);
+                    if (it != active.end())
+                        active.erase(it);
+                }
+
+                float a0 = events[i].angle;
+                float a1 = (i + 1 < events.size()) ? events[i + 1].angle : a0;
+                if (a1 - a0 < 1e-5f)
+                    continue;
+
+                //find the umbra closest to the light in this sector
+                sf::Vector2f mid(std::cos(0.5f * (a0 + a1)), std::sin(0.5f * (a0 + a1)));
+                std::size_t nearest = NONE;
+                float nearestDistance = std::numeric_limits<float>::max();
+                for (std::size_t w : active)
+                {
+                    float d = rayLineDistance(center, mid, wedges[w].as, wedges[w].bs);
+                    if (d < nearestDistance)
+                    {
+                        nearestDistance = d;
+                        nearest = w;
+                    }
+                }
+
+                if (nearest != runUmbra)
+                {
+                    if (runUmbra != NONE)
+                        appendUmbraWedge(triangles, center, wedges[runUmbra], runBegin, runEnd, shadowExtension, clipRect);
+                    runUmbra = nearest;
+                    runBegin = a0;
+                }
+                runEnd = a1;
+            }
+            if (runUmbra != NONE)
+                appendUmbraWedge(triangles, center, wedges[runUmbra], runBegin, runEnd, shadowExtension, clipRect);
+
+            if (!triangles.empty())
+                target.draw(triangles.data(), triangles.size(), sf::Triangles);
+        }
+    }
+
+    void clipPolygon(std::vector<sf::Vertex>& polygon, const sf::FloatRect& rect)
+    {
+        //left, right, top and bottom boundary, each with the sign that points inside
+        const float boundaries[4] = { rect.left, rect.left + rect.width, rect.top, rect.top + rect.height };
+        const float signs[4] = { 1.0f, -1.0f, 1.0f, -1.0f };
+
+        std::vector<sf::Vertex> input;
+        for (unsigned b = 0; b < 4 && !polygon.empty(); ++b)
+        {
+            input.swap(polygon);
+            polygon.clear();
+            auto signedDistance = [&boundaries, &signs, b] (const sf::Vertex& v)
+            {
+                return signs[b] * (((b < 2) ? v.position.x : v.position.y) - boundaries[b]);
+            };
+            for (std::size_t i = 0; i < input.size(); ++i)
+            {
+                const sf::Vertex& current = input[i];
+                const sf::Vertex& next = input[(i + 1) % input.size()];
+                float currentDist = signedDistance(current);
+                float nextDist = signedDistance(next);
+                if (currentDist >= 0.0f)
+                    polygon.push_back(current);
+                if ((currentDist >= 0.0f) != (nextDist >= 0.0f))
+                    polygon.push_back(lerpVertex(current, next, currentDist / (currentDist - nextDist)));
+            }
+        }
+    }
+
+    BaseLight::BaseLight() : mActive(true), mStatic(false) {}
 
     void BaseLight::setActive(bool active)
     {
@@ -48,29 +640,41 @@ namespace ungod
         mActive = !mActive;
     }
 
+    void BaseLight::setStatic(bool isStatic)
+    {
+        mStatic = isStatic;
+    }
+
+    bool BaseLight::isStatic() const
+    {
+        return mStatic;
+    }
+
     void BaseLight::unmaskWithPenumbras(sf::RenderTexture& renderTexture,
                                         sf::RenderStates states,
                                         sf::Shader& unshadowShader,
                                         const std::vector<Penumbra>& penumbras,
-                                        float shadowExtension) const
+                                        float shadowExtension,
+                                        const sf::FloatRect& clipRect) const
     {
-        sf::VertexArray vertexArray;
-        vertexArray.setPrimitiveType(sf::PrimitiveType::Triangles);
-        vertexArray.resize(3);
+        std::vector<sf::Vertex> polygon;
+        polygon.reserve(7);
 
         states.shader = &unshadowShader;
 
         for (std::size_t i = 0; i < penumbras.size(); ++i)
         {
+            polygon.resize(3);
+            polygon[0] = sf::Vertex(penumbras[i].source, sf::Vector2f(0.0f, 1.0f));
+            polygon[1] = sf::Vertex(penumbras[i].source + normalizeVector(penumbras[i].lightEdge) * shadowExtension, sf::Vector2f(1.0f, 0.0f));
+            polygon[2] = sf::Vertex(penumbras[i].source + normalizeVector(penumbras[i].darkEdge) * shadowExtension, sf::Vector2f(0.0f, 0.0f));
+            //the texture coordinates are affine over the triangle, so clipping preserves the penumbra gradient
+            clipPolygon(polygon, clipRect);
+            if (polygon.size() < 3)
+                continue;
             unshadowShader.setUniform("lightBrightness", penumbras[i].lightBrightness);
             unshadowShader.setUniform("darkBrightness", penumbras[i].darkBrightness);
-            vertexArray[0].position = penumbras[i].source;
-            vertexArray[1].position = penumbras[i].source + normalizeVector(penumbras[i].lightEdge) * shadowExtension;
-            vertexArray[2].position = penumbras[i].source + normalizeVector(penumbras[i].darkEdge) * shadowExtension;
-            vertexArray[0].texCoords = sf::Vector2f(0.0f, 1.0f);
-            vertexArray[1].texCoords = sf::Vector2f(1.0f, 0.0f);
-            vertexArray[2].texCoords = sf::Vector2f(0.0f, 0.0f);
-            renderTexture.draw(vertexArray, states);
+            renderTexture.draw(polygon.data(), polygon.size(), sf::TriangleFan, states);
         }
     }
 
@@ -131,6 +735,19 @@ namespace ungod
         target.draw(mShape, states);
     }
 
+    void LightCollider::render(sf::RenderTarget& target, sf::RenderStates states, const sf::Color& color) const
+    {
+        //draw the points as a fan, so that the fill color of the shape stays untouched
+        std::size_t numPoints = mShape.getPointCount();
+        if (numPoints < 3)
+            return;
+        std::vector<sf::Vertex> fan(numPoints);
+        for (std::size_t i = 0; i < numPoints; ++i)
+            fan[i] = sf::Vertex(mShape.getPoint(i), color);
+        states.transform *= mShape.getTransform();
+        target.draw(fan.data(), fan.size(), sf::TriangleFan, states);
+    }
+
     void LightCollider::setColor(const sf::Color& color)
     {
         mShape.setFillColor(color);
@@ -155,188 +772,479 @@ namespace ungod
                 const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
                 sf::Shader& unshadowShader,
                 sf::Shader& lightOverShapeShader,
-                const Transform& transf) const
+                const Transform& transf,
+                bool mergeUmbras) const
+    {
+        std::vector<ShadowGeometry> shadows;
+        std::vector<bool> hidden;
+        computeShadowGeometry(colliders, transf, shadows, hidden);
+        renderShadows(view, lightTexture, emissionTexture, antumbraTexture, colliders, shadows, hidden,
+                      unshadowShader, lightOverShapeShader, transf, mergeUmbras);
+    }
+
+    void PointLight::renderShadows(const sf::View& view,
+                                   sf::RenderTexture& lightTexture,
+                                   sf::RenderTexture& emissionTexture,
+                                   sf::RenderTexture& antumbraTexture,
+                                   const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                   const std::vector<ShadowGeometry>& shadows,
+                                   const std::vector<bool>& hidden,
+                                   sf::Shader& unshadowShader,
+                                   sf::Shader& lightOverShapeShader,
+                                   const Transform& transf,
+                                   bool mergeUmbras) const
     {
         sf::RenderStates states;
         states.transform = transf.getTransform();
 
         //Init
-        float shadowExtension = mShadowOverExtendMultiplier * (getBoundingBox().width + getBoundingBox().height);
+        float shadowExtension = getShadowExtension();
 
-        struct OuterEdges
+        //shadow geometry is extruded far beyond the light, clip it to the part of the light that is on screen
+        sf::FloatRect clipRect = transf.getTransform().transformRect(getBoundingBox());
+        if (view.getRotation() == 0.0f)
         {
-            std::vector<int> outerBoundaryIndices;
-            std::vector<sf::Vector2f> outerBoundaryVectors;
-        };
+            sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+            if (!clipRect.intersects(viewRect, clipRect))
+                clipRect = sf::FloatRect();
+        }
 
-        std::vector<OuterEdges> outerEdges(colliders.size());
+        //a light that does not reach the view leaves the texture black
+        lightTexture.clear(sf::Color::Black);
+        lightTexture.setView(view);
+        if (clipRect.width <= 0.0f || clipRect.height <= 0.0f)
+        {
+            lightTexture.display();
+            return;
+        }
 
-        std::vector<int> innerBoundaryIndices;
-        std::vector<sf::Vector2f> innerBoundaryVectors;
-        std::vector<Penumbra> penumbras;
+        //pixel region of the clip rect, used to restrict the antumbra composition. All corners are mapped,
+        //since the view may be rotated
+        sf::IntRect antumbraRect;
+        {
+            sf::Vector2f corners[4] = { { clipRect.left, clipRect.top }, { clipRect.left + clipRect.width, clipRect.top },
+                                        { clipRect.left, clipRect.top + clipRect.height },
+                                        { clipRect.left + clipRect.width, clipRect.top + clipRect.height } };
+            sf::Vector2i minPixel = lightTexture.mapCoordsToPixel(corners[0], view);
+            sf::Vector2i maxPixel = minPixel;
+            for (unsigned i = 1; i < 4; ++i)
+            {
+                sf::Vector2i pixel = lightTexture.mapCoordsToPixel(corners[i], view);
+                minPixel.x = std::min(minPixel.x, pixel.x);
+                minPixel.y = std::min(minPixel.y, pixel.y);
+                maxPixel.x = std::max(maxPixel.x, pixel.x);
+                maxPixel.y = std::max(maxPixel.y, pixel.y);
+            }
+            sf::Vector2i size = sf::Vector2i(lightTexture.getSize());
+            antumbraRect.left = std::max(0, minPixel.x - 1);
+            antumbraRect.top = std::max(0, minPixel.y - 1);
+            antumbraRect.width = std::max(0, std::min(size.x, maxPixel.x + 1) - antumbraRect.left);
+            antumbraRect.height = std::max(0, std::min(size.y, maxPixel.y + 1) - antumbraRect.top);
+        }
+        bool antumbraVisible = antumbraRect.width > 0 && antumbraRect.height > 0;
+
+        std::vector<Umbra> umbras;
 
         //draw light emission
-        lightTexture.clear(sf::Color::Black);
-        lightTexture.setView(view);
         lightTexture.draw(mSprite, states);
 
         //render shapes
         // Mask off light shape (over-masking - mask too much, reveal penumbra/antumbra afterwards)
-        for (std::size_t i = 0; i < colliders.size(); ++i)
+        for (const auto& shadow : shadows)
         {
-            LightCollider* lc = colliders[i].first;
-            Transform* colliderTransf = colliders[i].second;
-            sf::Transform colliderFinalTransf = colliderTransf->getTransform();
-            colliderFinalTransf *= lc->getTransform();
-            if (lc->isActive())
-            {
-                // Get boundaries
-                innerBoundaryIndices.clear();
-                innerBoundaryVectors.clear();
-                penumbras.clear();
-                getPenumbrasPoint(penumbras, innerBoundaryIndices, innerBoundaryVectors, outerEdges[i].outerBoundaryIndices,
-                                  outerEdges[i].outerBoundaryVectors, *lc, *colliderTransf, transf);
+            const LightCollider* lc = colliders[shadow.collider].first;
+            sf::RenderStates colliderStates;
+            colliderStates.transform = colliders[shadow.collider].second->getTransform();
+            if (!lc->getLightOverShape())
+                lc->render(lightTexture, colliderStates, sf::Color::Black);
 
-                if (innerBoundaryIndices.size() != 2 || outerEdges[i].outerBoundaryIndices.size() != 2)
-                {
+            // Handle antumbras as a seperate case, they can only darken the pixels of the antumbra rect
+            if (shadow.antumbra)
+            {
+                if (!antumbraVisible)
                     continue;
-                }
-
-                sf::RenderStates colliderStates;
-                colliderStates.transform = colliderTransf->getTransform();
-                lc->setColor(sf::Color::Black);
-                if (!lc->getLightOverShape())
-                    lc->render(lightTexture, colliderStates);
-
-                sf::Vector2f as = colliderFinalTransf.transformPoint(lc->getPoint(outerEdges[i].outerBoundaryIndices[0]));
-                sf::Vector2f bs = colliderFinalTransf.transformPoint(lc->getPoint(outerEdges[i].outerBoundaryIndices[1]));
-                sf::Vector2f ad = outerEdges[i].outerBoundaryVectors[0];
-                sf::Vector2f bd = outerEdges[i].outerBoundaryVectors[1];
-
-                sf::Vector2f intersectionOuter;
 
-                // Handle antumbras as a seperate case
-                if (rayIntersect(as, ad, bs, bd, intersectionOuter))
-                {
-                    sf::Vector2f asi = colliderFinalTransf.transformPoint(lc->getPoint(innerBoundaryIndices[0]));
-                    sf::Vector2f bsi = colliderFinalTransf.transformPoint(lc->getPoint(innerBoundaryIndices[1]));
-                    sf::Vector2f adi = innerBoundaryVectors[0];
-                    sf::Vector2f bdi = innerBoundaryVectors[1];
-
-                    antumbraTexture.clear(sf::Color::White);
-                    antumbraTexture.setView(view);
+                antumbraTexture.clear(sf::Color::White);
+                antumbraTexture.setView(view);
 
-                    sf::Vector2f intersectionInner;
-
-                    if (rayIntersect(asi, adi, bsi, bdi, intersectionInner))
-                    {
-                        sf::ConvexShape maskShape;
-                        maskShape.setPointCount(3);
-                        maskShape.setPoint(0, asi);
-                        maskShape.setPoint(1, bsi);
-                        maskShape.setPoint(2, intersectionInner);
-                        maskShape.setFillColor(sf::Color::Black);
-                        antumbraTexture.draw(maskShape);
-                    }
-                    else
-                    {
-                        sf::ConvexShape maskShape;
-                        maskShape.setPointCount(4);
-                        maskShape.setPoint(0, asi);
-                        maskShape.setPoint(1, bsi);
-                        maskShape.setPoint(2, bsi + normalizeVector(bdi) * shadowExtension);
-                        maskShape.setPoint(3, asi + normalizeVector(adi) * shadowExtension);
-                        maskShape.setFillColor(sf::Color::Black);
-                        antumbraTexture.draw(maskShape);
-                    }
+                drawMask(antumbraTexture, shadow.mask, clipRect);
 
-                    sf::RenderStates penumbrasStates;
-                    penumbrasStates.blendMode = sf::BlendAdd;
-                    unmaskWithPenumbras(antumbraTexture, penumbrasStates, unshadowShader, penumbras, shadowExtension);
+                sf::RenderStates penumbrasStates;
+                penumbrasStates.blendMode = sf::BlendAdd;
+                unmaskWithPenumbras(antumbraTexture, penumbrasStates, unshadowShader, shadow.penumbras, shadowExtension, clipRect);
 
-                    antumbraTexture.display();
+                antumbraTexture.display();
 
-                    lightTexture.setView(lightTexture.getDefaultView());
-                    lightTexture.draw(sf::Sprite(antumbraTexture.getTexture()), sf::BlendMultiply);
-                    lightTexture.setView(view);
-                }
+                //only the clipped region of the antumbra texture can differ from white
+                sf::Sprite antumbraSprite(antumbraTexture.getTexture(), antumbraRect);
+                antumbraSprite.setPosition((float)antumbraRect.left, (float)antumbraRect.top);
+                lightTexture.setView(lightTexture.getDefaultView());
+                lightTexture.draw(antumbraSprite, sf::BlendMultiply);
+                lightTexture.setView(view);
+            }
+            else
+            {
+                //masks are opaque black and penumbras multiply, so the umbras may be deferred and merged
+                if (mergeUmbras)
+                    umbras.push_back({ shadow.as, shadow.bs, shadow.ad, shadow.bd });
                 else
-                {
-                    sf::ConvexShape maskShape;
-                    maskShape.setPointCount(4);
-                    maskShape.setPoint(0, as);
-                    maskShape.setPoint(1, bs);
-                    maskShape.setPoint(2, bs + normalizeVector(bd) * shadowExtension);
-                    maskShape.setPoint(3, as + normalizeVector(ad) * shadowExtension);
-                    maskShape.setFillColor(sf::Color::Black);
-                    lightTexture.draw(maskShape);
-
-                    sf::RenderStates penumbrasStates;
-                    penumbrasStates.blendMode = sf::BlendMultiply;
-                    unmaskWithPenumbras(lightTexture, penumbrasStates, unshadowShader, penumbras, shadowExtension);
-                }
+                    drawMask(lightTexture, shadow.mask, clipRect);
+
+                sf::RenderStates penumbrasStates;
+                penumbrasStates.blendMode = sf::BlendMultiply;
+                unmaskWithPenumbras(lightTexture, penumbrasStates, unshadowShader, shadow.penumbras, shadowExtension, clipRect);
             }
         }
 
+        if (!umbras.empty())
+            drawMergedUmbras(lightTexture, umbras, transf.getTransform().transformPoint(getCastCenter()), shadowExtension, clipRect);
+
         for (std::size_t i = 0; i < colliders.size(); ++i)
         {
-            LightCollider* collider = colliders[i].first;
-            Transform* colliderTransf = colliders[i].second;
+            if (hidden[i])
+                continue;
+            const LightCollider* collider = colliders[i].first;
+            const Transform* colliderTransf = colliders[i].second;
             sf::RenderStates colliderStates;
             colliderStates.shader = &lightOverShapeShader;
             colliderStates.transform = colliderTransf->getTransform();
-            if (collider->getLightOverShape())
-            {
-                collider->setColor(sf::Color::White);
-                collider->render(lightTexture, colliderStates);
-            }
-            else
-            {
-                collider->setColor(sf::Color::Black);
-                collider->render(lightTexture, colliderStates);
-            }
+            collider->render(lightTexture, colliderStates, collider->getLightOverShape() ? sf::Color::White : sf::Color::Black);
         }
 
         lightTexture.display();
     }
 
-    void PointLight::loadTexture(const std::string& path)
+    float PointLight::getShadowExtension() const
     {
-        mTexture.load(path);
-        if (mTexture.isLoaded())
-        {
-            mTexture.get()->setSmooth(true);
-            mSprite.setTexture(*mTexture.get(), true);
-        }
-        mSprite.setOrigin({ mSprite.getTextureRect().width*0.5f, mSprite.getTextureRect().height*0.5f });
+        return mShadowOverExtendMultiplier * (getBoundingBox().width + getBoundingBox().height);
     }
 
-    sf::Color PointLight::getColor() const
+    void PointLight::computeShadowGeometry(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                           const Transform& transf,
+                                           std::vector<ShadowGeometry>& shadows,
+                                           std::vector<bool>& hidden) const
     {
-        return mSprite.getColor();
-    }
+        float shadowExtension = getShadowExtension();
 
-    void PointLight::setColor(const sf::Color& color)
-    {
-        mSprite.setColor(color);
-    }
+        std::vector<int> innerBoundaryIndices;
+        std::vector<sf::Vector2f> innerBoundaryVectors;
+        std::vector<int> outerBoundaryIndices;
+        std::vector<sf::Vector2f> outerBoundaryVectors;
+
+        //world space outlines of the colliders
+        sf::Vector2f sourceCenter = transf.getTransform().transformPoint(getCastCenter());
+        std::vector<sf::Vector2f> colliderPoints;
+        std::vector<std::size_t> colliderOffsets(colliders.size() + 1, 0);
+        std::vector<float> colliderDistances(colliders.size());
+        for (std::size_t i = 0; i < colliders.size(); ++i)
+        {
+            sf::Transform colliderFinalTransf = colliders[i].second->getTransform();
+            colliderFinalTransf *= colliders[i].first->getTransform();
+            for (std::size_t j = 0; j < colliders[i].first->getPointCount(); ++j)
+                colliderPoints.push_back(colliderFinalTransf.transformPoint(colliders[i].first->getPoint(j)));
+            colliderOffsets[i + 1] = colliderPoints.size();
+            colliderDistances[i] = polygonDistance(sourceCenter, colliderPoints.data() + colliderOffsets[i], colliderOffsets[i + 1] - colliderOffsets[i]);
+        }
 
-    sf::Vector2f PointLight::getScale() const
-    {
-        return mSprite.getScale();
-    }
+        //visit colliders front to back, colliders that are completely inside of the umbras of closer ones are skipped
+        std::vector<std::size_t> order(colliders.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&colliderDistances] (std::size_t a, std::size_t b) { return colliderDistances[a] < colliderDistances[b]; });
+        hidden.assign(colliders.size(), false);
+        shadows.clear();
+        UmbraCoverage coverage(sourceCenter);
 
-    sf::Vector2f PointLight::getPosition() const
-    {
-        return mSprite.getPosition();
-    }
+        for (std::size_t i : order)
+        {
+            LightCollider* lc = colliders[i].first;
+            Transform* colliderTransf = colliders[i].second;
+            if (!lc->isActive())
+                continue;
 
-    void PointLight::setSourcePoint(const sf::Vector2f& source)
-    {
-        mSourcePoint = source;
-    }
+            //light over shape colliders are drawn with the light later, so they are never skipped
+            if (!lc->getLightOverShape() &&
+                coverage.covers(colliderPoints.data() + colliderOffsets[i], colliderOffsets[i + 1] - colliderOffsets[i]))
+            {
+                hidden[i] = true;
+                continue;
+            }
 
-    sf::Vector2f PointLight::getSourcePoint() const
+            // Get boundaries
+            ShadowGeometry shadow;
+            shadow.collider = i;
+            innerBoundaryIndices.clear();
+            innerBoundaryVectors.clear();
+            outerBoundaryIndices.clear();
+            outerBoundaryVectors.clear();
+            getPenumbrasPoint(shadow.penumbras, innerBoundaryIndices, innerBoundaryVectors, outerBoundaryIndices,
+                              outerBoundaryVectors, *lc, *colliderTransf, transf);
+
+            if (innerBoundaryIndices.size() != 2 || outerBoundaryIndices.size() != 2)
+            {
+                continue;
+            }
+
+            sf::Transform colliderFinalTransf = colliderTransf->getTransform();
+            colliderFinalTransf *= lc->getTransform();
+
+            shadow.as = colliderFinalTransf.transformPoint(lc->getPoint(outerBoundaryIndices[0]));
+            shadow.bs = colliderFinalTransf.transformPoint(lc->getPoint(outerBoundaryIndices[1]));
+            shadow.ad = outerBoundaryVectors[0];
+            shadow.bd = outerBoundaryVectors[1];
+
+            sf::Vector2f asi = colliderFinalTransf.transformPoint(lc->getPoint(innerBoundaryIndices[0]));
+            sf::Vector2f bsi = colliderFinalTransf.transformPoint(lc->getPoint(innerBoundaryIndices[1]));
+            sf::Vector2f adi = innerBoundaryVectors[0];
+            sf::Vector2f bdi = innerBoundaryVectors[1];
+
+            sf::Vector2f intersectionOuter;
+            sf::Vector2f intersectionInner;
+            bool innerIntersects = rayIntersect(asi, adi, bsi, bdi, intersectionInner);
+            if (!innerIntersects)
+                coverage.add(asi, adi, bsi, bdi, shadowExtension);
+
+            shadow.antumbra = rayIntersect(shadow.as, shadow.ad, shadow.bs, shadow.bd, intersectionOuter);
+            if (!shadow.antumbra)
+                shadow.mask = { shadow.as, shadow.bs, shadow.bs + normalizeVector(shadow.bd) * shadowExtension,
+                                shadow.as + normalizeVector(shadow.ad) * shadowExtension };
+            else if (innerIntersects)
+                shadow.mask = { asi, bsi, intersectionInner };
+            else
+                shadow.mask = { asi, bsi, bsi + normalizeVector(bdi) * shadowExtension,
+                                asi + normalizeVector(adi) * shadowExtension };
+
+            shadows.push_back(std::move(shadow));
+        }
+    }
+
+    void PointLight::renderVisibility(const sf::View& view,
+                                      sf::RenderTexture& lightTexture,
+                                      const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                      sf::Shader& unshadowShader,
+                                      sf::Shader& lightOverShapeShader,
+                                      const Transform& transf) const
+    {
+        sf::Transform lightTransform = transf.getTransform() * mSprite.getTransform();
+        sf::Vector2f sourceCenter = transf.getTransform().transformPoint(getCastCenter());
+        sf::FloatRect bounds = transf.getTransform().transformRect(getBoundingBox());
+        float shadowExtension = mShadowOverExtendMultiplier * (bounds.width + bounds.height);
+
+        //collect all edges that block the light, the light bounds enclose the polygon
+        std::vector<Segment> segments;
+        sf::Vector2f corners[4] = { { bounds.left, bounds.top }, { bounds.left + bounds.width, bounds.top },
+                                    { bounds.left + bounds.width, bounds.top + bounds.height }, { bounds.left, bounds.top + bounds.height } };
+        for (unsigned i = 0; i < 4; ++i)
+            segments.push_back({ corners[i], corners[(i + 1) % 4] });
+        for (const auto& collider : colliders)
+        {
+            const LightCollider* lc = collider.first;
+            if (!lc->isActive())
+                continue;
+            sf::Transform colliderFinalTransf = collider.second->getTransform();
+            colliderFinalTransf *= lc->getTransform();
+            std::size_t numPoints = lc->getPointCount();
+            for (std::size_t i = 0; i < numPoints; ++i)
+                segments.push_back({ colliderFinalTransf.transformPoint(lc->getPoint(i)),
+                                     colliderFinalTransf.transformPoint(lc->getPoint((i + 1) % numPoints)) });
+        }
+
+        std::vector<sf::Vector2f> polygon;
+        std::vector<Penumbra> penumbras;
+        computeVisibilityPolygon(sourceCenter, mRadius, segments, polygon, penumbras);
+
+        lightTexture.clear(sf::Color::Black);
+        lightTexture.setView(view);
+
+        //draw the light texture as a single triangle fan around the source
+        if (polygon.size() >= 2 && mSprite.getTexture())
+        {
+            sf::Transform inverse = lightTransform.getInverse();
+            sf::Vector2f textureOffset((float)mSprite.getTextureRect().left, (float)mSprite.getTextureRect().top);
+            std::vector<sf::Vertex> fan;
+            fan.reserve(polygon.size() + 2);
+            fan.emplace_back(sourceCenter, mSprite.getColor(), inverse.transformPoint(sourceCenter) + textureOffset);
+            for (const auto& p : polygon)
+                fan.emplace_back(p, mSprite.getColor(), inverse.transformPoint(p) + textureOffset);
+            fan.push_back(fan[1]);
+            sf::RenderStates states;
+            states.texture = mSprite.getTexture();
+            lightTexture.draw(fan.data(), fan.size(), sf::TriangleFan, states);
+        }
+
+        //soften the edges at the silhouette vertices
+        sf::RenderStates penumbrasStates;
+        penumbrasStates.blendMode = sf::BlendMultiply;
+        unmaskWithPenumbras(lightTexture, penumbrasStates, unshadowShader, penumbras, shadowExtension, bounds);
+
+        //the polygon ends at the colliders, only light over shape colliders have to be drawn
+        for (const auto& collider : colliders)
+        {
+            if (!collider.first->isActive() || !collider.first->getLightOverShape())
+                continue;
+            sf::RenderStates colliderStates;
+            colliderStates.shader = &lightOverShapeShader;
+            colliderStates.transform = collider.second->getTransform();
+            collider.first->render(lightTexture, colliderStates, sf::Color::White);
+        }
+
+        lightTexture.display();
+    }
+
+    float PointLight::computeShadowMap(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                       const Transform& transf,
+                                       sf::Uint8* row,
+                                       unsigned resolution) const
+    {
+        sf::Vector2f sourceCenter = transf.getTransform().transformPoint(getCastCenter());
+        sf::FloatRect bounds = transf.getTransform().transformRect(getBoundingBox());
+
+        //distances are normalized by the distance to the farthest corner of the light
+        float radius = 1.0f;
+        radius = std::max(radius, std::hypot(bounds.left - sourceCenter.x, bounds.top - sourceCenter.y));
+        radius = std::max(radius, std::hypot(bounds.left + bounds.width - sourceCenter.x, bounds.top - sourceCenter.y));
+        radius = std::max(radius, std::hypot(bounds.left - sourceCenter.x, bounds.top + bounds.height - sourceCenter.y));
+        radius = std::max(radius, std::hypot(bounds.left + bounds.width - sourceCenter.x, bounds.top + bounds.height - sourceCenter.y));
+
+        //rasterize every collider edge into the bins whose center angle it covers
+        std::vector<float> distances(resolution, 1.0f);
+        const float binAngle = 2.0f * PI / resolution;
+        for (const auto& collider : colliders)
+        {
+            const LightCollider* lc = collider.first;
+            if (!lc->isActive())
+                continue;
+            sf::Transform colliderFinalTransf = collider.second->getTransform();
+            colliderFinalTransf *= lc->getTransform();
+            std::size_t numPoints = lc->getPointCount();
+            for (std::size_t i = 0; i < numPoints; ++i)
+            {
+                sf::Vector2f a = colliderFinalTransf.transformPoint(lc->getPoint(i));
+                sf::Vector2f b = colliderFinalTransf.transformPoint(lc->getPoint((i + 1) % numPoints));
+                float angleA = std::atan2(a.y - sourceCenter.y, a.x - sourceCenter.x);
+                float delta = std::remainder(std::atan2(b.y - sourceCenter.y, b.x - sourceCenter.x) - angleA, 2.0f * PI);
+                if (delta == 0.0f)
+                    continue;
+                float begin = (delta > 0.0f) ? angleA : angleA + delta;
+                int first = (int)std::ceil((begin + PI) / binAngle - 0.5f);
+                int last = (int)std::floor((begin + std::abs(delta) + PI) / binAngle - 0.5f);
+                for (int bin = first; bin <= last; ++bin)
+                {
+                    float angle = -PI + (bin + 0.5f) * binAngle;
+                    float d = rayLineDistance(sourceCenter, { std::cos(angle), std::sin(angle) }, a, b) / radius;
+                    float& target = distances[((bin % (int)resolution) + resolution) % resolution];
+                    target = std::min(target, std::max(0.0f, d));
+                }
+            }
+        }
+
+        for (unsigned i = 0; i < resolution; ++i)
+        {
+            unsigned value = (unsigned)(std::min(1.0f, distances[i]) * 65535.0f + 0.5f);
+            row[4 * i] = (sf::Uint8)(value >> 8);
+            row[4 * i + 1] = (sf::Uint8)(value & 255);
+            row[4 * i + 2] = 0;
+            row[4 * i + 3] = 255;
+        }
+        return radius;
+    }
+
+    bool PointLight::isSourceBlocked(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                     const Transform& transf) const
+    {
+        sf::Vector2f sourceCenter = transf.getTransform().transformPoint(getCastCenter());
+        for (const auto& collider : colliders)
+        {
+            const LightCollider* lc = collider.first;
+            std::size_t numPoints = lc->getPointCount();
+            if (!lc->isActive() || lc->getLightOverShape() || numPoints < 3)
+                continue;
+            sf::Transform colliderFinalTransf = collider.second->getTransform();
+            colliderFinalTransf *= lc->getTransform();
+
+            //the source is inside of the convex polygon if it is on the same side of all edges
+            bool positive = false;
+            bool negative = false;
+            for (std::size_t i = 0; i < numPoints && !(positive && negative); ++i)
+            {
+                sf::Vector2f point = colliderFinalTransf.transformPoint(lc->getPoint(i));
+                sf::Vector2f nextPoint = colliderFinalTransf.transformPoint(lc->getPoint((i + 1) % numPoints));
+                float side = cross(nextPoint - point, sourceCenter - point);
+                positive = positive || side > 0.0f;
+                negative = negative || side < 0.0f;
+            }
+            if (!(positive && negative))
+                return true;
+        }
+        return false;
+    }
+
+    void PointLight::loadTexture(const std::string& path)
+    {
+        mTexturePath = path;
+        if (softwareOnly)
+        {
+            //the software renderer reads the image itself, the sprite only needs its size
+            sf::Image image;
+            if (image.loadFromFile(path))
+                mSprite.setTextureRect({ 0, 0, (int)image.getSize().x, (int)image.getSize().y });
+            mSprite.setOrigin({ mSprite.getTextureRect().width*0.5f, mSprite.getTextureRect().height*0.5f });
+            return;
+        }
+        mTexture.load(path);
+        if (mTexture.isLoaded())
+        {
+            mTexture.get()->setSmooth(true);
+            mSprite.setTexture(*mTexture.get(), true);
+        }
+        mSprite.setOrigin({ mSprite.getTextureRect().width*0.5f, mSprite.getTextureRect().height*0.5f });
+    }
+
+    const std::string& PointLight::getTexturePath() const
+    {
+        return mTexturePath;
+    }
+
+    sf::Color PointLight::getColor() const
+    {
+        return mSprite.getColor();
+    }
+
+    void PointLight::setColor(const sf::Color& color)
+    {
+        mSprite.setColor(color);
+    }
+
+    void PointLight::setAnimation(const LightAnimation& animation)
+    {
+        mAnimation = animation;
+    }
+
+    const LightAnimation& PointLight::getAnimation() const
+    {
+        return mAnimation;
+    }
+
+    bool PointLight::isAnimated() const
+    {
+        return mAnimation.period > 0.0f && (mAnimation.intensity != 0.0f || mAnimation.scale != 0.0f);
+    }
+
+    sf::Vector2f PointLight::getScale() const
+    {
+        return mSprite.getScale();
+    }
+
+    sf::Vector2f PointLight::getPosition() const
+    {
+        return mSprite.getPosition();
+    }
+
+    void PointLight::setSourcePoint(const sf::Vector2f& source)
+    {
+        mSourcePoint = source;
+    }
+
+    sf::Vector2f PointLight::getSourcePoint() const
     {
         return mSourcePoint;
     }
@@ -650,7 +1558,9 @@ namespace ungod
    }
 
 
-    LightAffector::LightAffector() : mCallback(nullptr), mEmitter(nullptr), mActive(true) {}
+    LightAffector::LightAffector() : mCallback(nullptr), mEmitter(nullptr), mActive(true),
+                                     mPolicy(AffectorPolicy::Always), mInterval(250.0f), mPendingDelta(0.0f),
+                                     mThreadSafe(false) {}
 
     void LightAffector::setActive(bool active)
     {
@@ -662,6 +1572,166 @@ namespace ungod
         return mActive;
     }
 
+    void LightAffector::setPolicy(AffectorPolicy policy, float interval)
+    {
+        mPolicy = policy;
+        mInterval = interval;
+        mPendingDelta = 0.0f;
+    }
+
+    AffectorPolicy LightAffector::getPolicy() const
+    {
+        return mPolicy;
+    }
+
+    void LightAffector::setThreadSafe(bool threadSafe)
+    {
+        mThreadSafe = threadSafe;
+    }
+
+    bool LightAffector::isThreadSafe() const
+    {
+        return mThreadSafe;
+    }
+
+
+    bool LightTracks::Track::evaluate(float time, TrackInterpolation interpolation, float* out) const
+    {
+        std::size_t count = times.size();
+        if (count == 0)
+            return false;
+        std::size_t k = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+        if (k == 0 || k == count)
+        {
+            const float* value = &values[(k == 0 ? 0 : count - 1) * components];
+            std::copy(value, value + components, out);
+            return true;
+        }
+
+        //the time lies between the keys k-1 and k, cubic curves also use the keys around them
+        std::size_t k0 = k - 1;
+        std::size_t k1 = k;
+        std::size_t kp = (k0 > 0) ? k0 - 1 : k0;
+        std::size_t kn = (k1 + 1 < count) ? k1 + 1 : k1;
+        float u = (time - times[k0]) / (times[k1] - times[k0]);
+        for (unsigned c = 0; c < components; ++c)
+        {
+            float p1 = values[k0 * components + c];
+            float p2 = values[k1 * components + c];
+            if (interpolation == TrackInterpolation::Linear)
+            {
+                out[c] = p1 + (p2 - p1) * u;
+                continue;
+            }
+            float p0 = values[kp * components + c];
+            float p3 = values[kn * components + c];
+            out[c] = 0.5f * (2.0f * p1 + (p2 - p0) * u + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u * u +
+                             (3.0f * p1 - p0 - 3.0f * p2 + p3) * u * u * u);
+        }
+        return true;
+    }
+
+    void LightTracks::Track::insert(float time, const float* value)
+    {
+        auto key = std::lower_bound(times.begin(), times.end(), time);
+        std::size_t k = key - times.begin();
+        if (key != times.end() && *key == time)
+        {
+            std::copy(value, value + components, values.begin() + k * components);
+            return;
+        }
+        times.insert(key, time);
+        values.insert(values.begin() + k * components, value, value + components);
+    }
+
+    LightTracks::LightTracks() : mInterpolation(TrackInterpolation::Linear), mLightIndex(0), mTime(0.0f), mLooping(true), mFinished(false)
+    {
+        mColor.components = 4;
+        mScale.components = 2;
+        mPosition.components = 2;
+    }
+
+    void LightTracks::addColorKey(float time, const sf::Color& color)
+    {
+        float value[4] = { (float)color.r, (float)color.g, (float)color.b, (float)color.a };
+        mColor.insert(time, value);
+        mFinished = false;
+    }
+
+    void LightTracks::addScaleKey(float time, const sf::Vector2f& scale)
+    {
+        float value[2] = { scale.x, scale.y };
+        mScale.insert(time, value);
+        mFinished = false;
+    }
+
+    void LightTracks::addPositionKey(float time, const sf::Vector2f& position)
+    {
+        float value[2] = { position.x, position.y };
+        mPosition.insert(time, value);
+        mFinished = false;
+    }
+
+    void LightTracks::clear()
+    {
+        for (Track* track : { &mColor, &mScale, &mPosition })
+        {
+            track->times.clear();
+            track->values.clear();
+        }
+    }
+
+    void LightTracks::setInterpolation(TrackInterpolation interpolation)
+    {
+        mInterpolation = interpolation;
+    }
+
+    TrackInterpolation LightTracks::getInterpolation() const
+    {
+        return mInterpolation;
+    }
+
+    void LightTracks::setLooping(bool looping)
+    {
+        mLooping = looping;
+        mFinished = false;
+    }
+
+    bool LightTracks::isLooping() const
+    {
+        return mLooping;
+    }
+
+    void LightTracks::setLightIndex(std::size_t index)
+    {
+        mLightIndex = index;
+    }
+
+    std::size_t LightTracks::getLightIndex() const
+    {
+        return mLightIndex;
+    }
+
+    void LightTracks::setTime(float time)
+    {
+        mTime = time;
+        mFinished = false;
+    }
+
+    float LightTracks::getTime() const
+    {
+        return mTime;
+    }
+
+    float LightTracks::getDuration() const
+    {
+        float duration = 0.0f;
+        for (const Track* track : { &mColor, &mScale, &mPosition })
+            if (!track->times.empty())
+                duration = std::max(duration, track->times.back());
+        return duration;
+    }
+
 
 
     LightFlickering::LightFlickering(float period, float strength) : mDirection(false), mPeriod(period), mStrength(strength) {}
@@ -709,160 +1779,3628 @@ namespace ungod
                 mPeriod = NumberGenerator::getFloatRandBetw(0.5f,1.0f)*mBasePeriod;
             }
         }
-        else
+        else
+        {
+            light.mLight.mSprite.setScale( light.mLight.mSprite.getScale().x - scale,
+                                           light.mLight.mSprite.getScale().y - scale );
+            mSizeMemorizer -= scale;
+            if (mSizeMemorizer <= -mStrength*mPeriod || mTimer.getElapsedTime().asMilliseconds() > mPeriod)
+            {
+                mTimer.restart();
+                mDirection = true;
+                mPeriod = NumberGenerator::getFloatRandBetw(0.5f,1.0f)*mBasePeriod;
+            }
+        }
+    }
+
+
+    void LightFlickerSystem::add(Entity e, float period, float strength, bool randomized, std::size_t index)
+    {
+        std::pair<const void*, std::size_t> key;
+        PointLight* light = resolve(e, index, key);
+        if (!light)
+        {
+            Logger::warning("Can not let a light flicker, that the entity does not have!");
+            Logger::endl();
+            return;
+        }
+        std::size_t i = find(e, index);
+        if (i == mEntities.size())
+        {
+            mSlots[key] = i;
+            mEntities.push_back(e);
+            mIndices.push_back(index);
+            mPeriods.push_back(0.0f);
+            mBasePeriods.push_back(0.0f);
+            mStrengths.push_back(0.0f);
+            mDirections.push_back(-1.0f);
+            mElapsed.push_back(0.0f);
+            mOffsets.push_back(0.0f);
+            mRandomized.push_back(0);
+            mBounds.push_back(light->getBoundingBox());
+            mKeys.push_back(key);
+        }
+        mPeriods[i] = randomized ? NumberGenerator::getFloatRandBetw(0.5f,1.0f)*period : period;
+        mBasePeriods[i] = period;
+        mStrengths[i] = strength;
+        mRandomized[i] = randomized;
+    }
+
+    void LightFlickerSystem::remove(Entity e, std::size_t index)
+    {
+        std::size_t i = find(e, index);
+        if (i < mEntities.size())
+            removeAt(i);
+    }
+
+    void LightFlickerSystem::clear()
+    {
+        mEntities.clear();
+        mIndices.clear();
+        mPeriods.clear();
+        mBasePeriods.clear();
+        mStrengths.clear();
+        mDirections.clear();
+        mElapsed.clear();
+        mOffsets.clear();
+        mRandomized.clear();
+        mBounds.clear();
+        mKeys.clear();
+        mSlots.clear();
+        mLights.clear();
+    }
+
+    std::size_t LightFlickerSystem::getCount() const
+    {
+        return mEntities.size();
+    }
+
+    void LightFlickerSystem::update(float delta, std::vector< LightUpdate<sf::FloatRect> >& outgrown,
+                                   std::vector< LightUpdate<sf::FloatRect> >& statics)
+    {
+        outgrown.clear();
+        statics.clear();
+
+        //lights are not owned by the flicker system, drop the ones whose entity or component is gone
+        //and follow components that were reallocated
+        mLights.clear();
+        for (std::size_t i = 0; i < mEntities.size();)
+        {
+            std::pair<const void*, std::size_t> key;
+            PointLight* light = resolve(mEntities[i], mIndices[i], key);
+            if (!light)
+            {
+                removeAt(i);
+                continue;
+            }
+            if (key != mKeys[i])
+                rekey(i, key);
+            mLights.push_back(light);
+            ++i;
+        }
+
+        std::size_t count = mEntities.size();
+        mSteps.resize(count);
+
+        //branch free pass over the flat arrays, that the compiler can vectorize
+        float* steps = mSteps.data();
+        float* offsets = mOffsets.data();
+        float* elapsed = mElapsed.data();
+        const float* directions = mDirections.data();
+        const float* strengths = mStrengths.data();
+        const float* periods = mPeriods.data();
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            steps[i] = directions[i] * strengths[i] * delta / periods[i];
+            offsets[i] += steps[i];
+            elapsed[i] += delta;
+        }
+
+        //change the direction after the period, randomized lights also when they are back at or below their range
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            bool limit = mRandomized[i] && (mDirections[i] > 0.0f ? mOffsets[i] >= 0.0f : mOffsets[i] <= -mStrengths[i] * mPeriods[i]);
+            if (!limit && mElapsed[i] <= mPeriods[i])
+                continue;
+            mElapsed[i] = 0.0f;
+            mDirections[i] = -mDirections[i];
+            if (mRandomized[i])
+                mPeriods[i] = NumberGenerator::getFloatRandBetw(0.5f,1.0f)*mBasePeriods[i];
+        }
+
+        //a flickering light oscillates within its range, so it is reported only until its bounds cover that range
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            PointLight& light = *mLights[i];
+            light.mSprite.setScale(light.mSprite.getScale() + sf::Vector2f(steps[i], steps[i]));
+            sf::FloatRect bounds = light.getBoundingBox();
+            sf::FloatRect& registered = mBounds[i];
+            float right = std::max(registered.left + registered.width, bounds.left + bounds.width);
+            float bottom = std::max(registered.top + registered.height, bounds.top + bounds.height);
+            bool grown = bounds.left < registered.left || bounds.top < registered.top ||
+                         right > registered.left + registered.width || bottom > registered.top + registered.height;
+            if (grown)
+            {
+                registered.left = std::min(registered.left, bounds.left);
+                registered.top = std::min(registered.top, bounds.top);
+                registered.width = right - registered.left;
+                registered.height = bottom - registered.top;
+                outgrown.push_back({ mEntities[i], registered, mIndices[i] });
+            }
+            if (light.isStatic())
+                statics.push_back({ mEntities[i], registered, mIndices[i] });
+        }
+    }
+
+    std::size_t LightFlickerSystem::find(Entity e, std::size_t index) const
+    {
+        std::pair<const void*, std::size_t> key;
+        if (!resolve(e, index, key))
+            return mEntities.size();
+        auto slot = mSlots.find(key);
+        if (slot == mSlots.end() || mEntities[slot->second] != e || mIndices[slot->second] != index)
+            return mEntities.size();
+        return slot->second;
+    }
+
+    void LightFlickerSystem::removeAt(std::size_t i)
+    {
+        auto slot = mSlots.find(mKeys[i]);
+        if (slot != mSlots.end() && slot->second == i)
+            mSlots.erase(slot);
+
+        //swap with the last light to keep the arrays dense
+        std::size_t last = mEntities.size() - 1;
+        if (i != last)
+        {
+            slot = mSlots.find(mKeys[last]);
+            if (slot != mSlots.end() && slot->second == last)
+                slot->second = i;
+        }
+        mEntities[i] = mEntities[last];
+        mIndices[i] = mIndices[last];
+        mPeriods[i] = mPeriods[last];
+        mBasePeriods[i] = mBasePeriods[last];
+        mStrengths[i] = mStrengths[last];
+        mDirections[i] = mDirections[last];
+        mElapsed[i] = mElapsed[last];
+        mOffsets[i] = mOffsets[last];
+        mRandomized[i] = mRandomized[last];
+        mBounds[i] = mBounds[last];
+        mKeys[i] = mKeys[last];
+        mEntities.pop_back();
+        mIndices.pop_back();
+        mPeriods.pop_back();
+        mBasePeriods.pop_back();
+        mStrengths.pop_back();
+        mDirections.pop_back();
+        mElapsed.pop_back();
+        mOffsets.pop_back();
+        mRandomized.pop_back();
+        mBounds.pop_back();
+        mKeys.pop_back();
+    }
+
+    void LightFlickerSystem::rekey(std::size_t i, const std::pair<const void*, std::size_t>& key)
+    {
+        //the old key may already belong to another reallocated light
+        auto slot = mSlots.find(mKeys[i]);
+        if (slot != mSlots.end() && slot->second == i)
+            mSlots.erase(slot);
+        mSlots[key] = i;
+        mKeys[i] = key;
+    }
+
+    PointLight* LightFlickerSystem::resolve(Entity e, std::size_t index, std::pair<const void*, std::size_t>& key)
+    {
+        if (!e.valid())
+            return nullptr;
+        if (index == LightUpdate<sf::Vector2f>::NO_INDEX)
+        {
+            if (!e.has<LightEmitter>())
+                return nullptr;
+            LightEmitter& emitter = e.modify<LightEmitter>();
+            key = { &emitter, index };
+            return &emitter.getLight();
+        }
+        if (!e.has<MultiLightEmitter>() || index >= e.get<MultiLightEmitter>().getComponentCount())
+            return nullptr;
+        MultiLightEmitter& multi = e.modify<MultiLightEmitter>();
+        key = { &multi, index };
+        return &multi.getComponent(index).getLight();
+    }
+
+
+    namespace
+    {
+        const std::string DISTANCE_FIELD_VERTEX_SHADER = R"(
+varying vec2 worldPosition;
+
+void main()
+{
+    worldPosition = gl_Vertex.xy;
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+    gl_FrontColor = gl_Color;
+}
+)";
+
+        const std::string DISTANCE_FIELD_FRAGMENT_SHADER = R"(
+#define MAX_LIGHTS 32
+#define MAX_STEPS 48
+
+uniform sampler2D distanceField;
+uniform vec2 fieldOrigin;
+uniform vec2 fieldSizeInv;
+uniform float maxDistance;
+
+uniform int lightCount;
+uniform vec2 lightPositions[MAX_LIGHTS];
+uniform vec4 lightColors[MAX_LIGHTS];
+uniform float lightRadii[MAX_LIGHTS];
+uniform float sourceRadii[MAX_LIGHTS];
+
+varying vec2 worldPosition;
+
+float sceneDistance(vec2 p)
+{
+    vec2 uv = (p - fieldOrigin) * fieldSizeInv;
+    return (texture2D(distanceField, vec2(uv.x, 1.0 - uv.y)).r - 0.5) * 2.0 * maxDistance;
+}
+
+float softShadow(vec2 receiver, vec2 light, float sourceRadius)
+{
+    vec2 dir = light - receiver;
+    float dist = length(dir);
+    dir /= max(dist, 0.0001);
+    float shadow = 1.0;
+    float t = 1.0;
+    for (int i = 0; i < MAX_STEPS; ++i)
+    {
+        if (t >= dist)
+            break;
+        float d = sceneDistance(receiver + dir * t);
+        if (d <= 0.0)
+            return 0.0;
+        //fraction of the light source that is visible past the closest occluder
+        shadow = min(shadow, d * dist / (sourceRadius * t));
+        t += max(d, 1.0);
+    }
+    return clamp(shadow, 0.0, 1.0);
+}
+
+void main()
+{
+    vec3 color = vec3(0.0);
+    if (sceneDistance(worldPosition) > 0.0)
+    {
+        for (int i = 0; i < MAX_LIGHTS; ++i)
+        {
+            if (i >= lightCount)
+                break;
+            float dist = length(lightPositions[i] - worldPosition);
+            if (dist >= lightRadii[i])
+                continue;
+            float falloff = 1.0 - dist / lightRadii[i];
+            color += lightColors[i].rgb * lightColors[i].a * falloff * falloff * softShadow(worldPosition, lightPositions[i], sourceRadii[i]);
+        }
+    }
+    gl_FragColor = vec4(color, 1.0);
+}
+)";
+    }
+
+    namespace
+    {
+        const std::string LIGHT_ANIMATION_VERTEX_SHADER = R"(
+uniform float time;
+uniform float period;
+uniform float intensity;
+uniform float scale;
+uniform float seed;
+uniform int waveform;
+uniform vec2 center;
+
+varying float brightness;
+
+float hash(float n)
+{
+    return fract(sin(n * 12.9898) * 43758.5453);
+}
+
+float wave(float x)
+{
+    if (waveform == 0)
+        return 0.5 + 0.5 * sin(6.2831853 * x);
+    if (waveform == 1)
+        return 1.0 - abs(2.0 * fract(x) - 1.0);
+    float i = floor(x);
+    return mix(hash(i + 57.0 * seed), hash(i + 1.0 + 57.0 * seed), smoothstep(0.0, 1.0, fract(x)));
+}
+
+void main()
+{
+    //the animation is constant per light, so it is evaluated per vertex
+    float w = wave(time / period + seed);
+    brightness = 1.0 - intensity * w;
+    //scaling around the source point keeps the shadows aligned with their rays
+    vec2 position = center + (gl_Vertex.xy - center) * (1.0 - scale * w);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position, gl_Vertex.zw);
+    gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;
+    gl_FrontColor = gl_Color;
+}
+)";
+
+        const std::string LIGHT_ANIMATION_FRAGMENT_SHADER = R"(
+uniform sampler2D texture;
+
+varying float brightness;
+
+void main()
+{
+    vec4 color = gl_Color * texture2D(texture, gl_TexCoord[0].xy);
+    gl_FragColor = vec4(color.rgb * brightness, color.a);
+}
+)";
+
+        const std::string SHADOW_MAP_VERTEX_SHADER = R"(
+varying vec2 worldPosition;
+
+void main()
+{
+    worldPosition = gl_Vertex.xy;
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+    gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;
+    gl_FrontColor = gl_Color;
+}
+)";
+
+        const std::string SHADOW_MAP_FRAGMENT_SHADER = R"(
+#define PI 3.14159265
+
+uniform sampler2D texture;
+uniform sampler2D shadowMap;
+uniform float row;
+uniform vec2 lightCenter;
+uniform float lightRadius;
+uniform float pcfStep;
+
+varying vec2 worldPosition;
+
+float occluderDistance(float u)
+{
+    vec4 texel = texture2D(shadowMap, vec2(u, row));
+    return (texel.r * 65280.0 + texel.g * 255.0) / 65535.0 * lightRadius;
+}
+
+void main()
+{
+    vec2 toFragment = worldPosition - lightCenter;
+    float dist = length(toFragment);
+    float u = (atan(toFragment.y, toFragment.x) + PI) / (2.0 * PI);
+
+    //percentage closer filtering along the angle gives the shadow edges a soft falloff
+    float lit = 0.0;
+    for (int i = -2; i <= 2; ++i)
+        lit += step(dist, occluderDistance(u + float(i) * pcfStep));
+    lit /= 5.0;
+
+    gl_FragColor = gl_Color * texture2D(texture, gl_TexCoord[0].xy) * lit;
+}
+)";
+    }
+
+    ShadowDistanceField::ShadowDistanceField() : mChunkSize(512.0f), mResolution(128), mMaxDistance(64.0f), mSetup(false) {}
+
+    void ShadowDistanceField::setup(float chunkSize, unsigned resolution, float maxDistance)
+    {
+        mChunkSize = chunkSize;
+        mResolution = resolution;
+        mMaxDistance = maxDistance;
+        mSetup = true;
+        clear();
+    }
+
+    void ShadowDistanceField::invalidate(const sf::FloatRect& rect)
+    {
+        //a collider changes distances up to mMaxDistance away from it
+        int left = (int)std::floor((rect.left - mMaxDistance) / mChunkSize);
+        int top = (int)std::floor((rect.top - mMaxDistance) / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width + mMaxDistance) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height + mMaxDistance) / mChunkSize);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                auto chunk = mChunks.find({ x, y });
+                if (chunk != mChunks.end())
+                    chunk->second.valid = false;
+            }
+    }
+
+    void ShadowDistanceField::clear()
+    {
+        mChunks.clear();
+    }
+
+    bool ShadowDistanceField::isSetup() const
+    {
+        return mSetup;
+    }
+
+    void ShadowDistanceField::update(const sf::FloatRect& rect, quad::QuadTree<Entity>& quadtree, unsigned budget)
+    {
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        for (int x = left; x <= right && budget > 0; ++x)
+            for (int y = top; y <= bottom && budget > 0; ++y)
+            {
+                Chunk& chunk = mChunks[{ x, y }];
+                if (chunk.valid)
+                    continue;
+                compute(chunk, { x * mChunkSize, y * mChunkSize, mChunkSize, mChunkSize }, quadtree);
+                chunk.valid = true;
+                --budget;
+            }
+    }
+
+    void ShadowDistanceField::render(sf::RenderTarget& target, const sf::FloatRect& rect) const
+    {
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                //outdated chunks are still drawn until they are recomputed
+                auto chunk = mChunks.find({ x, y });
+                if (chunk == mChunks.end() || chunk->second.texture.getSize().x == 0)
+                    continue;
+                sf::Sprite sprite(chunk->second.texture);
+                sprite.setPosition(x * mChunkSize, y * mChunkSize);
+                sprite.setScale(mChunkSize / mResolution, mChunkSize / mResolution);
+                target.draw(sprite, sf::BlendNone);
+            }
+    }
+
+    float ShadowDistanceField::getMaxDistance() const
+    {
+        return mMaxDistance;
+    }
+
+    void ShadowDistanceField::compute(Chunk& chunk, const sf::FloatRect& chunkRect, quad::QuadTree<Entity>& quadtree) const
+    {
+        //gather the world space outlines of all static colliders in range of the chunk
+        sf::FloatRect range(chunkRect.left - mMaxDistance, chunkRect.top - mMaxDistance,
+                            chunkRect.width + 2.0f * mMaxDistance, chunkRect.height + 2.0f * mMaxDistance);
+        quad::PullResult<Entity> pull;
+        quadtree.retrieve(pull, { range.left, range.top, range.width, range.height });
+
+        std::vector<sf::Vector2f> points;
+        std::vector<std::size_t> offsets(1, 0);
+        std::vector<sf::FloatRect> polygonBounds;
+        auto addCollider = [&points, &offsets, &polygonBounds, &range] (const Transform& transf, const LightCollider& collider)
+        {
+            if (!collider.isActive() || !collider.isStatic() || collider.getPointCount() < 3)
+                return;
+            sf::FloatRect bounds = transf.getTransform().transformRect(collider.getBoundingBox());
+            if (!bounds.intersects(range))
+                return;
+            sf::Transform colliderFinalTransf = transf.getTransform();
+            colliderFinalTransf *= collider.getTransform();
+            for (std::size_t i = 0; i < collider.getPointCount(); ++i)
+                points.push_back(colliderFinalTransf.transformPoint(collider.getPoint(i)));
+            offsets.push_back(points.size());
+            polygonBounds.push_back(bounds);
+        };
+
+        dom::Utility<Entity>::iterate<Transform, ShadowEmitter>(pull.getList(),
+        [&addCollider] (Entity e, Transform& transf, ShadowEmitter& shadow)
+        {
+            addCollider(transf, shadow.mLightCollider);
+        });
+
+        dom::Utility<Entity>::iterate<Transform, MultiShadowEmitter>(pull.getList(),
+        [&addCollider] (Entity e, Transform& transf, MultiShadowEmitter& shadow)
+        {
+            for (std::size_t i = 0; i < shadow.getComponentCount(); ++i)
+                addCollider(transf, shadow.getComponent(i).mLightCollider);
+        });
+
+        //exact distance to the closest polygon edge for every texel center, negative inside of a polygon
+        sf::Image image;
+        image.create(mResolution, mResolution, sf::Color::White);
+        float texelSize = mChunkSize / mResolution;
+        for (unsigned y = 0; y < mResolution; ++y)
+            for (unsigned x = 0; x < mResolution; ++x)
+            {
+                sf::Vector2f p(chunkRect.left + (x + 0.5f) * texelSize, chunkRect.top + (y + 0.5f) * texelSize);
+                float distance = mMaxDistance;
+                for (std::size_t k = 0; k < polygonBounds.size(); ++k)
+                {
+                    const sf::FloatRect& b = polygonBounds[k];
+                    float dx = std::max(0.0f, std::max(b.left - p.x, p.x - (b.left + b.width)));
+                    float dy = std::max(0.0f, std::max(b.top - p.y, p.y - (b.top + b.height)));
+                    if (dx * dx + dy * dy >= distance * distance)
+                        continue;
+                    const sf::Vector2f* polygon = points.data() + offsets[k];
+                    std::size_t count = offsets[k + 1] - offsets[k];
+                    float d = polygonDistance(p, polygon, count);
+                    distance = std::min(distance, insideConvexPolygon(p, polygon, count) ? -d : d);
+                }
+                float encoded = 0.5f + 0.5f * std::max(-1.0f, std::min(1.0f, distance / mMaxDistance));
+                sf::Uint8 value = (sf::Uint8)(encoded * 255.0f + 0.5f);
+                image.setPixel(x, y, sf::Color(value, value, value));
+            }
+
+        chunk.texture.loadFromImage(image);
+        chunk.texture.setSmooth(true);
+    }
+
+
+    namespace
+    {
+        /** \brief Calls f(y, begin, end) for every row of pixel centers inside of a convex polygon. The polygon
+        * is given in pixel coordinates where pixel centers lie on integer coordinates. Only pixels inside
+        * of [0, width) x [0, height) are visited. */
+        template<typename F>
+        void forEachSpan(const std::vector<sf::Vector2f>& polygon, int width, int height, F f)
+        {
+            std::size_t n = polygon.size();
+            if (n < 3)
+                return;
+            float area = 0.0f;
+            float top = polygon[0].y;
+            float bottom = polygon[0].y;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                area += cross(polygon[i], polygon[(i + 1) % n]);
+                top = std::min(top, polygon[i].y);
+                bottom = std::max(bottom, polygon[i].y);
+            }
+            if (area == 0.0f)
+                return;
+            float orientation = (area > 0.0f) ? 1.0f : -1.0f;
+            int firstRow = (int)std::ceil(std::max(top, 0.0f));
+            int lastRow = (int)std::floor(std::min(bottom, (float)(height - 1)));
+            for (int y = firstRow; y <= lastRow; ++y)
+            {
+                //every edge bounds the span of the row from one side
+                float begin = 0.0f;
+                float end = (float)(width - 1);
+                for (std::size_t i = 0; i < n && begin <= end; ++i)
+                {
+                    sf::Vector2f a = polygon[i];
+                    sf::Vector2f d = polygon[(i + 1) % n] - a;
+                    float slope = -orientation * d.y;
+                    float offset = orientation * (d.x * (y - a.y) + d.y * a.x);
+                    if (slope > 0.0f)
+                        begin = std::max(begin, -offset / slope);
+                    else if (slope < 0.0f)
+                        end = std::min(end, -offset / slope);
+                    else if (offset < 0.0f)
+                        end = -1.0f;
+                }
+                if (begin <= end)
+                    f(y, (int)std::ceil(begin), (int)std::floor(end) + 1);
+            }
+        }
+
+        /** \brief Blends the penumbra brightness into count consecutive values of a row. l and d are the unnormalized
+        * weights of the light and the dark edge at the first value, they change by lStep and dStep per value. */
+        void blendPenumbraRow(float* row, int count, float l, float d, float lStep, float dStep,
+                              float darkBrightness, float range, bool additive)
+        {
+            int x = 0;
+#ifdef UNGOD_LIGHT_SSE2
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+            for (; x + 4 <= count; x += 4)
+            {
+                __m128 offset = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+                __m128 light = _mm_add_ps(_mm_set1_ps(l), _mm_mul_ps(offset, _mm_set1_ps(lStep)));
+                __m128 sum = _mm_add_ps(light, _mm_add_ps(_mm_set1_ps(d), _mm_mul_ps(offset, _mm_set1_ps(dStep))));
+                //lanes with a zero sum divide by zero, they are masked to a ramp of 0 afterwards
+                __m128 ramp = _mm_max_ps(zero, _mm_min_ps(_mm_div_ps(light, sum), one));
+                ramp = _mm_and_ps(ramp, _mm_cmpneq_ps(sum, zero));
+                __m128 brightness = _mm_add_ps(_mm_set1_ps(darkBrightness), _mm_mul_ps(_mm_set1_ps(range), ramp));
+                __m128 value = _mm_loadu_ps(row + x);
+                value = additive ? _mm_min_ps(_mm_add_ps(value, brightness), one) : _mm_mul_ps(value, brightness);
+                _mm_storeu_ps(row + x, value);
+            }
+#endif
+            for (; x < count; ++x)
+            {
+                float light = l + (float)x * lStep;
+                float sum = light + (d + (float)x * dStep);
+                float ramp = (sum != 0.0f) ? std::max(0.0f, std::min(light / sum, 1.0f)) : 0.0f;
+                float brightness = darkBrightness + range * ramp;
+                row[x] = additive ? std::min(row[x] + brightness, 1.0f) : row[x] * brightness;
+            }
+        }
+
+        /** \brief Blends the brightness of a penumbra triangle (source, light edge, dark edge) into the values of the
+        * points that are marked inside of it, like rasterizePenumbra does for pixels. */
+        void blendPenumbraPoints(const float* xs, const float* ys, const unsigned char* inside, std::size_t count,
+                                 const sf::Vector2f* triangle, float lightBrightness, float darkBrightness, bool additive,
+                                 float* target)
+        {
+            const sf::Vector2f toSource = triangle[0] - triangle[2];
+            const sf::Vector2f toLight = triangle[1] - triangle[0];
+            const float range = lightBrightness - darkBrightness;
+            std::size_t i = 0;
+#ifdef UNGOD_LIGHT_SSE2
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 x = _mm_loadu_ps(xs + i);
+                __m128 y = _mm_loadu_ps(ys + i);
+                __m128 light = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(toSource.x), _mm_sub_ps(y, _mm_set1_ps(triangle[2].y))),
+                                          _mm_mul_ps(_mm_set1_ps(toSource.y), _mm_sub_ps(x, _mm_set1_ps(triangle[2].x))));
+                __m128 dark = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(toLight.x), _mm_sub_ps(y, _mm_set1_ps(triangle[0].y))),
+                                         _mm_mul_ps(_mm_set1_ps(toLight.y), _mm_sub_ps(x, _mm_set1_ps(triangle[0].x))));
+                __m128 sum = _mm_add_ps(light, dark);
+                __m128 ramp = _mm_max_ps(zero, _mm_min_ps(_mm_div_ps(light, sum), one));
+                ramp = _mm_and_ps(ramp, _mm_cmpneq_ps(sum, zero));
+                __m128 brightness = _mm_add_ps(_mm_set1_ps(darkBrightness), _mm_mul_ps(_mm_set1_ps(range), ramp));
+                __m128 value = _mm_loadu_ps(target + i);
+                __m128 blended = additive ? _mm_min_ps(_mm_add_ps(value, brightness), one) : _mm_mul_ps(value, brightness);
+                __m128 selected = _mm_castsi128_ps(_mm_set_epi32(inside[i + 3] ? -1 : 0, inside[i + 2] ? -1 : 0,
+                                                                 inside[i + 1] ? -1 : 0, inside[i] ? -1 : 0));
+                _mm_storeu_ps(target + i, _mm_or_ps(_mm_and_ps(selected, blended), _mm_andnot_ps(selected, value)));
+            }
+#endif
+            for (; i < count; ++i)
+            {
+                float light = toSource.x * (ys[i] - triangle[2].y) - toSource.y * (xs[i] - triangle[2].x);
+                float sum = light + (toLight.x * (ys[i] - triangle[0].y) - toLight.y * (xs[i] - triangle[0].x));
+                float ramp = (sum != 0.0f) ? std::max(0.0f, std::min(light / sum, 1.0f)) : 0.0f;
+                float brightness = darkBrightness + range * ramp;
+                float blended = additive ? std::min(target[i] + brightness, 1.0f) : target[i] * brightness;
+                target[i] = inside[i] ? blended : target[i];
+            }
+        }
+
+        /** \brief Clears inside for every point that lies on the outer side of the edge from a along d. */
+        void testHalfPlane(const float* xs, const float* ys, std::size_t count, const sf::Vector2f& a, const sf::Vector2f& d,
+                           float orientation, unsigned char* inside)
+        {
+            std::size_t i = 0;
+#ifdef UNGOD_LIGHT_SSE2
+            const __m128 dx = _mm_set1_ps(orientation * d.x);
+            const __m128 dy = _mm_set1_ps(orientation * d.y);
+            const __m128 ax = _mm_set1_ps(a.x);
+            const __m128 ay = _mm_set1_ps(a.y);
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 side = _mm_sub_ps(_mm_mul_ps(dx, _mm_sub_ps(_mm_loadu_ps(ys + i), ay)),
+                                         _mm_mul_ps(dy, _mm_sub_ps(_mm_loadu_ps(xs + i), ax)));
+                int bits = _mm_movemask_ps(_mm_cmpge_ps(side, _mm_setzero_ps()));
+                inside[i] &= (unsigned char)(bits & 1);
+                inside[i + 1] &= (unsigned char)((bits >> 1) & 1);
+                inside[i + 2] &= (unsigned char)((bits >> 2) & 1);
+                inside[i + 3] &= (unsigned char)((bits >> 3) & 1);
+            }
+#endif
+            for (; i < count; ++i)
+                inside[i] &= (unsigned char)((orientation * d.x) * (ys[i] - a.y) - (orientation * d.y) * (xs[i] - a.x) >= 0.0f);
+        }
+
+        /** \brief Multiplies count values of target with the factors. */
+        void multiplyRow(float* target, const float* factors, std::size_t count)
+        {
+            std::size_t i = 0;
+#ifdef UNGOD_LIGHT_SSE2
+            for (; i + 4 <= count; i += 4)
+                _mm_storeu_ps(target + i, _mm_mul_ps(_mm_loadu_ps(target + i), _mm_loadu_ps(factors + i)));
+#endif
+            for (; i < count; ++i)
+                target[i] *= factors[i];
+        }
+
+        /** \brief Clamps count colors given as separate channels to [0, 1] and writes them as opaque rgba bytes. */
+        void packColors(const float* red, const float* green, const float* blue, std::size_t count, sf::Uint8* rgba)
+        {
+            std::size_t i = 0;
+#ifdef UNGOD_LIGHT_SSE2
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 scale = _mm_set1_ps(255.0f);
+            const __m128 half = _mm_set1_ps(0.5f);
+            const __m128i alpha = _mm_set1_epi32(255);
+            auto convert = [&] (const float* channel)
+            {
+                return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_loadu_ps(channel), one), scale), half));
+            };
+            for (; i + 4 <= count; i += 4)
+            {
+                //r0..r3 b0..b3 g0..g3 a0..a3, interleaved to r0 g0 b0 a0 r1 ... in two steps
+                __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(convert(red + i), convert(blue + i)),
+                                                 _mm_packs_epi32(convert(green + i), alpha));
+                __m128i pairs = _mm_unpacklo_epi8(bytes, _mm_srli_si128(bytes, 8));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + 4 * i), _mm_unpacklo_epi16(pairs, _mm_srli_si128(pairs, 8)));
+            }
+#endif
+            for (; i < count; ++i)
+            {
+                rgba[4 * i] = (sf::Uint8)(std::min(red[i], 1.0f) * 255.0f + 0.5f);
+                rgba[4 * i + 1] = (sf::Uint8)(std::min(green[i], 1.0f) * 255.0f + 0.5f);
+                rgba[4 * i + 2] = (sf::Uint8)(std::min(blue[i], 1.0f) * 255.0f + 0.5f);
+                rgba[4 * i + 3] = 255;
+            }
+        }
+
+        /** \brief Rasterizes a penumbra triangle (source, light edge, dark edge) in pixel coordinates. The brightness
+        * is interpolated linearly in angle from the dark to the light edge. It is either multiplied with or
+        * added to the buffer. */
+        void rasterizePenumbra(float* buffer, int width, int height, const std::vector<sf::Vector2f>& triangle,
+                               float lightBrightness, float darkBrightness, bool additive)
+        {
+            const sf::Vector2f& source = triangle[0];
+            const sf::Vector2f& lightEdge = triangle[1];
+            const sf::Vector2f& darkEdge = triangle[2];
+            //unnormalized barycentric weights of the light and the dark edge vertex, both are linear in x
+            sf::Vector2f toSource = source - darkEdge;
+            sf::Vector2f toLight = lightEdge - source;
+            float range = lightBrightness - darkBrightness;
+            forEachSpan(triangle, width, height, [=] (int y, int begin, int end)
+            {
+                float lightWeight = cross(toSource, sf::Vector2f((float)begin, (float)y) - darkEdge);
+                float darkWeight = cross(toLight, sf::Vector2f((float)begin, (float)y) - source);
+                blendPenumbraRow(buffer + y * width + begin, end - begin, lightWeight, darkWeight, -toSource.y, -toLight.y,
+                                 darkBrightness, range, additive);
+            });
+        }
+
+        /** \brief Returns the bilinearly filtered, premultiplied color of the image at the texel position. */
+        sf::Vector3f sampleImage(const sf::Image& image, float x, float y)
+        {
+            sf::Vector2u size = image.getSize();
+            const sf::Uint8* pixels = image.getPixelsPtr();
+            x -= 0.5f;
+            y -= 0.5f;
+            float fx = std::floor(x);
+            float fy = std::floor(y);
+            float tx = x - fx;
+            float ty = y - fy;
+            int x0 = std::max(0, std::min((int)size.x - 1, (int)fx));
+            int x1 = std::max(0, std::min((int)size.x - 1, (int)fx + 1));
+            int y0 = std::max(0, std::min((int)size.y - 1, (int)fy));
+            int y1 = std::max(0, std::min((int)size.y - 1, (int)fy + 1));
+            auto texel = [pixels, &size] (int px, int py)
+            {
+                const sf::Uint8* p = pixels + 4 * (py * size.x + px);
+                float alpha = p[3] / 255.0f;
+                return sf::Vector3f(p[0] * alpha, p[1] * alpha, p[2] * alpha) / 255.0f;
+            };
+            return (texel(x0, y0) * (1.0f - tx) + texel(x1, y0) * tx) * (1.0f - ty) +
+                   (texel(x0, y1) * (1.0f - tx) + texel(x1, y1) * tx) * ty;
+        }
+    }
+
+    const std::string StaticLightMap::INDEX_FILE = "lightmap.txt";
+
+    StaticLightMap::StaticLightMap() : mChunkSize(0.0f), mResolution(256), mResidentChunks(0) {}
+
+    void StaticLightMap::setup(float chunkSize, unsigned resolution)
+    {
+        mChunkSize = chunkSize;
+        mResolution = std::max(1u, resolution);
+        mStream.reset();
+        clear();
+    }
+
+    void StaticLightMap::clear()
+    {
+        mChunks.clear();
+    }
+
+    bool StaticLightMap::isSetup() const
+    {
+        return mChunkSize > 0.0f;
+    }
+
+    bool StaticLightMap::isBaked(const sf::FloatRect& rect) const
+    {
+        if (!isSetup())
+            return false;
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                auto chunk = mChunks.find({ x, y });
+                if (chunk == mChunks.end() || !chunk->second.valid)
+                    return false;
+            }
+        return true;
+    }
+
+    void StaticLightMap::invalidate(const sf::FloatRect& rect)
+    {
+        if (!isSetup())
+            return;
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                auto chunk = mChunks.find({ x, y });
+                sf::FloatRect region;
+                if (chunk == mChunks.end() || !chunk->second.valid ||
+                    !rect.intersects({ x * mChunkSize, y * mChunkSize, mChunkSize, mChunkSize }, region))
+                    continue;
+                //several changes in one chunk are merged into their bounding rect
+                Chunk& c = chunk->second;
+                if (c.dirty)
+                {
+                    float right = std::max(c.dirtyRect.left + c.dirtyRect.width, region.left + region.width);
+                    float bottom = std::max(c.dirtyRect.top + c.dirtyRect.height, region.top + region.height);
+                    region.left = std::min(c.dirtyRect.left, region.left);
+                    region.top = std::min(c.dirtyRect.top, region.top);
+                    region.width = right - region.left;
+                    region.height = bottom - region.top;
+                }
+                c.dirtyRect = region;
+                c.dirty = true;
+            }
+    }
+
+    void StaticLightMap::update(const sf::FloatRect& rect, unsigned budget,
+                                const std::function<void(const sf::FloatRect&, sf::RenderTexture&)>& bake)
+    {
+        if (!isSetup())
+            return;
+        if (mStream)
+            updateStream(rect);
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        for (int x = left; x <= right && budget > 0; ++x)
+            for (int y = top; y <= bottom && budget > 0; ++y)
+            {
+                //streamed chunks are never baked from scratch, only their outdated regions are
+                if (mStream && mChunks.find({ x, y }) == mChunks.end())
+                    continue;
+                Chunk& chunk = mChunks[{ x, y }];
+                if (!chunk.valid)
+                    bakeRegion(chunk, x, y, { x * mChunkSize, y * mChunkSize, mChunkSize, mChunkSize }, bake);
+                else if (chunk.dirty)
+                    bakeRegion(chunk, x, y, chunk.dirtyRect, bake);
+                else
+                    continue;
+                chunk.valid = true;
+                chunk.dirty = false;
+                --budget;
+            }
+    }
+
+    void StaticLightMap::bakeRegion(Chunk& chunk, int x, int y, const sf::FloatRect& region,
+                                    const std::function<void(const sf::FloatRect&, sf::RenderTexture&)>& bake)
+    {
+        //snap the region to whole texels of the chunk
+        float texel = mChunkSize / mResolution;
+        sf::Vector2f origin(x * mChunkSize, y * mChunkSize);
+        int left = std::max(0, (int)std::floor((region.left - origin.x) / texel));
+        int top = std::max(0, (int)std::floor((region.top - origin.y) / texel));
+        int right = std::min((int)mResolution, (int)std::ceil((region.left + region.width - origin.x) / texel));
+        int bottom = std::min((int)mResolution, (int)std::ceil((region.top + region.height - origin.y) / texel));
+        if (!chunk.texture)
+            createTexture(chunk);
+        if (right <= left || bottom <= top)
+            return;
+
+        //bake into the upper left corner of the scratch texture, then copy over the outdated texels
+        if (mBakeTexture.getSize() != sf::Vector2u(mResolution, mResolution))
+            mBakeTexture.create(mResolution, mResolution);
+        sf::FloatRect world(origin.x + left * texel, origin.y + top * texel, (right - left) * texel, (bottom - top) * texel);
+        sf::View view(world);
+        view.setViewport({ 0.0f, 0.0f, (float)(right - left) / mResolution, (float)(bottom - top) / mResolution });
+        mBakeTexture.setView(view);
+        mBakeTexture.clear(sf::Color::Black);
+        bake(world, mBakeTexture);
+        mBakeTexture.display();
+
+        sf::Sprite sprite(mBakeTexture.getTexture(), { 0, 0, right - left, bottom - top });
+        sprite.setPosition((float)left, (float)top);
+        chunk.texture->setView(chunk.texture->getDefaultView());
+        chunk.texture->draw(sprite, sf::BlendNone);
+        chunk.texture->display();
+    }
+
+    void StaticLightMap::createTexture(Chunk& chunk) const
+    {
+        chunk.texture.reset(new sf::RenderTexture());
+        chunk.texture->create(mResolution, mResolution);
+        chunk.texture->setSmooth(true);
+        chunk.texture->clear(sf::Color::Black);
+        chunk.texture->display();
+    }
+
+    void StaticLightMap::render(sf::RenderTarget& target, const sf::FloatRect& rect) const
+    {
+        if (!isSetup())
+            return;
+        int left = (int)std::floor(rect.left / mChunkSize);
+        int top = (int)std::floor(rect.top / mChunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize);
+        sf::Sprite sprite;
+        sprite.setScale(mChunkSize / mResolution, mChunkSize / mResolution);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                auto chunk = mChunks.find({ x, y });
+                if (chunk == mChunks.end() || !chunk->second.valid)
+                    continue;
+                sprite.setTexture(chunk->second.texture->getTexture(), true);
+                sprite.setPosition(x * mChunkSize, y * mChunkSize);
+                target.draw(sprite, sf::BlendAdd);
+            }
+    }
+
+    bool StaticLightMap::save(const std::string& directory) const
+    {
+        std::ofstream index(directory + "/" + INDEX_FILE);
+        if (!index)
+            return false;
+        index << mChunkSize << " " << mResolution << "\n";
+        for (const auto& chunk : mChunks)
+        {
+            if (!chunk.second.valid)
+                continue;
+            std::string file = "chunk_" + std::to_string(chunk.first.first) + "_" + std::to_string(chunk.first.second) + ".png";
+            if (!chunk.second.texture->getTexture().copyToImage().saveToFile(directory + "/" + file))
+                return false;
+            index << chunk.first.first << " " << chunk.first.second << " " << file << "\n";
+        }
+        return true;
+    }
+
+    bool StaticLightMap::load(const std::string& directory)
+    {
+        std::ifstream index(directory + "/" + INDEX_FILE);
+        float chunkSize;
+        unsigned resolution;
+        if (!(index >> chunkSize >> resolution))
+            return false;
+        setup(chunkSize, resolution);
+        int x, y;
+        std::string file;
+        sf::Texture texture;
+        while (index >> x >> y >> file)
+        {
+            if (!texture.loadFromFile(directory + "/" + file))
+            {
+                ungod::Logger::warning("Could not load light map chunk " + file + "!");
+                ungod::Logger::endl();
+                continue;
+            }
+            Chunk& chunk = mChunks[{ x, y }];
+            createTexture(chunk);
+            chunk.texture->draw(sf::Sprite(texture), sf::BlendNone);
+            chunk.texture->display();
+            chunk.valid = true;
+        }
+        return true;
+    }
+
+    bool StaticLightMap::write(const std::string& path, LightMapFormat format) const
+    {
+        std::map<std::pair<int, int>, sf::Image> images;
+        for (const auto& chunk : mChunks)
+            if (chunk.second.valid)
+                images[chunk.first] = chunk.second.texture->getTexture().copyToImage();
+        return LightMapStream::write(path, mChunkSize, mResolution, format, images);
+    }
+
+    bool StaticLightMap::stream(const std::string& path, unsigned residentChunks)
+    {
+        std::unique_ptr<LightMapStream> stream(new LightMapStream());
+        if (!stream->open(path))
+            return false;
+        setup(stream->getChunkSize(), stream->getResolution());
+        mStream = std::move(stream);
+        mResidentChunks = std::max(1u, residentChunks);
+        return true;
+    }
+
+    void StaticLightMap::updateStream(const sf::FloatRect& rect)
+    {
+        //request the chunks around the rect with a margin of one chunk, so that they are ready when they become visible
+        int left = (int)std::floor(rect.left / mChunkSize) - 1;
+        int top = (int)std::floor(rect.top / mChunkSize) - 1;
+        int right = (int)std::floor((rect.left + rect.width) / mChunkSize) + 1;
+        int bottom = (int)std::floor((rect.top + rect.height) / mChunkSize) + 1;
+        sf::IntRect ring(left, top, right - left + 1, bottom - top + 1);
+
+        //chunks that left the ring before they were decoded are not needed anymore
+        mStream->cancel(ring);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+                if (mChunks.find({ x, y }) == mChunks.end())
+                    mStream->request(x, y);
+
+        //uploads have to happen on the thread that owns the context
+        std::pair<int, int> key;
+        std::vector<sf::Uint8> pixels;
+        for (unsigned i = 0; i < STREAM_UPLOADS && mStream->fetch(key, pixels); ++i)
+        {
+            if (mChunks.find(key) != mChunks.end() || !ring.contains(key.first, key.second))
+                continue;
+            if (mUploadTexture.getSize() != sf::Vector2u(mResolution, mResolution))
+                mUploadTexture.create(mResolution, mResolution);
+            mUploadTexture.update(pixels.data());
+            Chunk& chunk = mChunks[key];
+            createTexture(chunk);
+            chunk.texture->draw(sf::Sprite(mUploadTexture), sf::BlendNone);
+            chunk.texture->display();
+            chunk.valid = true;
+        }
+
+        //evict the chunks that are farthest away from the rect. The ring is always kept, otherwise a budget below
+        //its size would evict chunks that are requested again right away
+        sf::Vector2f center(rect.left + rect.width / 2.0f, rect.top + rect.height / 2.0f);
+        while (mChunks.size() > mResidentChunks)
+        {
+            auto farthest = mChunks.end();
+            float maxDistance = -1.0f;
+            for (auto chunk = mChunks.begin(); chunk != mChunks.end(); ++chunk)
+            {
+                if (ring.contains(chunk->first.first, chunk->first.second))
+                    continue;
+                sf::FloatRect chunkRect(chunk->first.first * mChunkSize, chunk->first.second * mChunkSize, mChunkSize, mChunkSize);
+                float distance = std::hypot(chunkRect.left + mChunkSize / 2.0f - center.x, chunkRect.top + mChunkSize / 2.0f - center.y);
+                if (distance > maxDistance)
+                {
+                    maxDistance = distance;
+                    farthest = chunk;
+                }
+            }
+            if (farthest == mChunks.end())
+                break;
+            mChunks.erase(farthest);
+        }
+    }
+
+    const char LightMapStream::MAGIC[4] = { 'U', 'L', 'M', '1' };
+
+    namespace
+    {
+        template<typename T>
+        void writeValue(std::ostream& stream, const T& value)
+        {
+            stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        template<typename T>
+        T readValue(const sf::Uint8* data)
+        {
+            T value;
+            std::memcpy(&value, data, sizeof(T));
+            return value;
+        }
+
+        /** \brief Returns the 8 gray values a BC4 block with the given endpoints can represent. */
+        void bc4Palette(sf::Uint8 r0, sf::Uint8 r1, sf::Uint8* palette)
+        {
+            palette[0] = r0;
+            palette[1] = r1;
+            if (r0 > r1)
+            {
+                for (int i = 2; i < 8; ++i)
+                    palette[i] = (sf::Uint8)(((8 - i) * r0 + (i - 1) * r1) / 7);
+            }
+            else
+            {
+                for (int i = 2; i < 6; ++i)
+                    palette[i] = (sf::Uint8)(((6 - i) * r0 + (i - 1) * r1) / 5);
+                palette[6] = 0;
+                palette[7] = 255;
+            }
+        }
+
+        /** \brief Encodes the texels of an image in the given format. */
+        void encodeLightMap(const sf::Image& image, LightMapFormat format, std::vector<sf::Uint8>& data)
+        {
+            sf::Vector2u size = image.getSize();
+            const sf::Uint8* pixels = image.getPixelsPtr();
+            auto gray = [pixels, &size] (unsigned x, unsigned y)
+            {
+                const sf::Uint8* p = pixels + 4 * (std::min(y, size.y - 1) * size.x + std::min(x, size.x - 1));
+                return std::max(p[0], std::max(p[1], p[2]));
+            };
+            switch (format)
+            {
+            case LightMapFormat::RGBA:
+                data.assign(pixels, pixels + 4 * size.x * size.y);
+                break;
+            case LightMapFormat::Gray:
+                data.resize(size.x * size.y);
+                for (unsigned y = 0; y < size.y; ++y)
+                    for (unsigned x = 0; x < size.x; ++x)
+                        data[y * size.x + x] = gray(x, y);
+                break;
+            case LightMapFormat::BC4:
+            {
+                unsigned blocksX = (size.x + 3) / 4;
+                unsigned blocksY = (size.y + 3) / 4;
+                data.assign(8 * blocksX * blocksY, 0);
+                for (unsigned by = 0; by < blocksY; ++by)
+                    for (unsigned bx = 0; bx < blocksX; ++bx)
+                    {
+                        sf::Uint8 values[16];
+                        sf::Uint8 high = 0;
+                        sf::Uint8 low = 255;
+                        for (unsigned t = 0; t < 16; ++t)
+                        {
+                            values[t] = gray(4 * bx + t % 4, 4 * by + t / 4);
+                            high = std::max(high, values[t]);
+                            low = std::min(low, values[t]);
+                        }
+                        sf::Uint8 palette[8];
+                        bc4Palette(high, low, palette);
+                        std::uint64_t indices = 0;
+                        for (unsigned t = 0; t < 16 && high > low; ++t)
+                        {
+                            std::uint64_t best = 0;
+                            for (std::uint64_t i = 1; i < 8; ++i)
+                                if (std::abs(palette[i] - values[t]) < std::abs(palette[best] - values[t]))
+                                    best = i;
+                            indices |= best << (3 * t);
+                        }
+                        sf::Uint8* block = &data[8 * (by * blocksX + bx)];
+                        block[0] = high;
+                        block[1] = low;
+                        for (unsigned b = 0; b < 6; ++b)
+                            block[2 + b] = (sf::Uint8)(indices >> (8 * b));
+                    }
+                break;
+            }
+            }
+        }
+    }
+
+    LightMapStream::LightMapStream() :
+        mData(nullptr), mSize(0), mMapping(nullptr), mFile(0), mFormat(LightMapFormat::RGBA), mChunkSize(0.0f), mResolution(0), mStop(false) {}
+
+    LightMapStream::~LightMapStream()
+    {
+        close();
+    }
+
+    bool LightMapStream::open(const std::string& path)
+    {
+        close();
+
+        #ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        HANDLE mapping = GetFileSizeEx(file, &size) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+        void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!data)
+        {
+            if (mapping)
+                CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+        mFile = reinterpret_cast<std::intptr_t>(file);
+        mMapping = mapping;
+        mSize = (std::size_t)size.QuadPart;
+        #else
+        int file = ::open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            return false;
+        struct stat info;
+        void* data = (fstat(file, &info) == 0 && info.st_size > 0) ?
+                     mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+        if (data == MAP_FAILED)
+        {
+            ::close(file);
+            return false;
+        }
+        mFile = file;
+        mMapping = data;
+        mSize = (std::size_t)info.st_size;
+        #endif
+        mData = static_cast<const sf::Uint8*>(data);
+
+        //header: magic, format, chunk size, resolution, chunk count, followed by the chunk table
+        const std::size_t headerSize = 20;
+        const std::size_t entrySize = 24;
+        if (mSize < headerSize || std::memcmp(mData, MAGIC, 4) != 0)
+        {
+            ungod::Logger::warning("Invalid light map file " + path + "!");
+            ungod::Logger::endl();
+            close();
+            return false;
+        }
+        std::uint32_t format = readValue<std::uint32_t>(mData + 4);
+        if (format > (std::uint32_t)LightMapFormat::BC4)
+        {
+            ungod::Logger::warning("Unknown format of light map file " + path + "!");
+            ungod::Logger::endl();
+            close();
+            return false;
+        }
+        mFormat = (LightMapFormat)format;
+        mChunkSize = readValue<float>(mData + 8);
+        mResolution = readValue<std::uint32_t>(mData + 12);
+        std::uint32_t count = readValue<std::uint32_t>(mData + 16);
+        //the worker allocates 4 * res² bytes per chunk, so the header is checked before anything is decoded
+        if (!std::isfinite(mChunkSize) || mChunkSize <= 0.0f || mResolution == 0 || mResolution > MAX_RESOLUTION)
+        {
+            ungod::Logger::warning("Invalid chunk size or resolution in light map file " + path + "!");
+            ungod::Logger::endl();
+            close();
+            return false;
+        }
+        if ((mSize - headerSize) / entrySize < count)
+        {
+            ungod::Logger::warning("Truncated light map file " + path + "!");
+            ungod::Logger::endl();
+            close();
+            return false;
+        }
+        //entries have to lie inside of the file, compared without overflow, and hold a whole chunk
+        std::uint64_t blocks = (std::uint64_t)((mResolution + 3) / 4) * ((mResolution + 3) / 4);
+        std::uint64_t texels = (std::uint64_t)mResolution * mResolution;
+        std::uint64_t chunkBytes = (mFormat == LightMapFormat::RGBA) ? 4 * texels : (mFormat == LightMapFormat::Gray) ? texels : 8 * blocks;
+        std::size_t skipped = 0;
+        for (std::uint32_t i = 0; i < count; ++i)
+        {
+            const sf::Uint8* entry = mData + headerSize + (std::size_t)i * entrySize;
+            Entry e { readValue<std::uint64_t>(entry + 8), readValue<std::uint64_t>(entry + 16) };
+            if (e.offset <= mSize && e.size <= mSize - e.offset && e.size >= chunkBytes)
+                mEntries[{ readValue<std::int32_t>(entry), readValue<std::int32_t>(entry + 4) }] = e;
+            else
+                ++skipped;
+        }
+        if (skipped > 0)
+        {
+            ungod::Logger::warning("Skipped " + std::to_string(skipped) + " corrupt chunks of light map file " + path + "!");
+            ungod::Logger::endl();
+        }
+
+        mStop = false;
+        mWorker = std::thread(&LightMapStream::work, this);
+        return true;
+    }
+
+    void LightMapStream::close()
+    {
+        if (mWorker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mStop = true;
+            }
+            mCondition.notify_all();
+            mWorker.join();
+        }
+        mRequests.clear();
+        mQueued.clear();
+        mDecoded.clear();
+        mEntries.clear();
+        if (!mData)
+            return;
+        #ifdef _WIN32
+        UnmapViewOfFile(mData);
+        CloseHandle(static_cast<HANDLE>(mMapping));
+        CloseHandle(reinterpret_cast<HANDLE>(mFile));
+        #else
+        munmap(mMapping, mSize);
+        ::close((int)mFile);
+        #endif
+        mData = nullptr;
+        mMapping = nullptr;
+        mSize = 0;
+    }
+
+    bool LightMapStream::isOpen() const
+    {
+        return mData != nullptr;
+    }
+
+    bool LightMapStream::contains(int x, int y) const
+    {
+        return mEntries.find({ x, y }) != mEntries.end();
+    }
+
+    void LightMapStream::request(int x, int y)
+    {
+        if (!contains(x, y))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mQueued.insert({ x, y }).second)
+                return;
+            mRequests.emplace_back(x, y);
+        }
+        mCondition.notify_one();
+    }
+
+    void LightMapStream::cancel(const sf::IntRect& keep)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto outside = [this, &keep] (const std::pair<int, int>& chunk)
+        {
+            if (keep.contains(chunk.first, chunk.second))
+                return false;
+            mQueued.erase(chunk);
+            return true;
+        };
+        mRequests.erase(std::remove_if(mRequests.begin(), mRequests.end(), outside), mRequests.end());
+        mDecoded.erase(std::remove_if(mDecoded.begin(), mDecoded.end(),
+                       [&outside] (const std::pair< std::pair<int, int>, std::vector<sf::Uint8> >& decoded) { return outside(decoded.first); }),
+                       mDecoded.end());
+    }
+
+    bool LightMapStream::fetch(std::pair<int, int>& chunk, std::vector<sf::Uint8>& pixels)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mDecoded.empty())
+            return false;
+        chunk = mDecoded.front().first;
+        pixels = std::move(mDecoded.front().second);
+        mDecoded.pop_front();
+        mQueued.erase(chunk);
+        return true;
+    }
+
+    float LightMapStream::getChunkSize() const
+    {
+        return mChunkSize;
+    }
+
+    unsigned LightMapStream::getResolution() const
+    {
+        return mResolution;
+    }
+
+    void LightMapStream::work()
+    {
+        while (true)
+        {
+            std::pair<int, int> chunk;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this] { return mStop || !mRequests.empty(); });
+                if (mStop)
+                    return;
+                chunk = mRequests.front();
+                mRequests.pop_front();
+            }
+            //the mapping and the table are never modified while the worker runs
+            std::vector<sf::Uint8> pixels;
+            decode(mEntries.at(chunk), pixels);
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDecoded.emplace_back(chunk, std::move(pixels));
+        }
+    }
+
+    void LightMapStream::decode(const Entry& entry, std::vector<sf::Uint8>& pixels) const
+    {
+        const unsigned res = mResolution;
+        const sf::Uint8* data = mData + entry.offset;
+        pixels.assign(4 * res * res, 255);
+        switch (mFormat)
+        {
+        case LightMapFormat::RGBA:
+            std::memcpy(pixels.data(), data, std::min<std::size_t>(pixels.size(), entry.size));
+            break;
+        case LightMapFormat::Gray:
+            for (unsigned i = 0; i < res * res && i < entry.size; ++i)
+                std::memset(&pixels[4 * i], data[i], 3);
+            break;
+        case LightMapFormat::BC4:
+        {
+            unsigned blocksX = (res + 3) / 4;
+            unsigned blocksY = (res + 3) / 4;
+            for (unsigned b = 0; b < blocksX * blocksY && 8 * b + 8 <= entry.size; ++b)
+            {
+                const sf::Uint8* block = data + 8 * b;
+                sf::Uint8 palette[8];
+                bc4Palette(block[0], block[1], palette);
+                std::uint64_t indices = 0;
+                for (unsigned i = 0; i < 6; ++i)
+                    indices |= (std::uint64_t)block[2 + i] << (8 * i);
+                for (unsigned t = 0; t < 16; ++t)
+                {
+                    unsigned x = 4 * (b % blocksX) + t % 4;
+                    unsigned y = 4 * (b / blocksX) + t / 4;
+                    if (x < res && y < res)
+                        std::memset(&pixels[4 * (y * res + x)], palette[(indices >> (3 * t)) & 7], 3);
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    bool LightMapStream::write(const std::string& path, float chunkSize, unsigned resolution, LightMapFormat format,
+                               const std::map<std::pair<int, int>, sf::Image>& chunks)
+    {
+        if (resolution == 0 || resolution > MAX_RESOLUTION)
+        {
+            ungod::Logger::warning("The resolution of a streamed light map must not exceed " + std::to_string(MAX_RESOLUTION) + "!");
+            ungod::Logger::endl();
+            return false;
+        }
+
+        //chunks of another size would be rejected by open, so they are left out
+        std::vector< std::pair< std::pair<int, int>, std::vector<sf::Uint8> > > encoded;
+        for (const auto& chunk : chunks)
+        {
+            if (chunk.second.getSize() != sf::Vector2u(resolution, resolution))
+                continue;
+            encoded.emplace_back(chunk.first, std::vector<sf::Uint8>());
+            encodeLightMap(chunk.second, format, encoded.back().second);
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        file.write(MAGIC, 4);
+        writeValue(file, (std::uint32_t)format);
+        writeValue(file, chunkSize);
+        writeValue(file, (std::uint32_t)resolution);
+        writeValue(file, (std::uint32_t)encoded.size());
+        std::uint64_t offset = 20 + 24 * encoded.size();
+        for (const auto& chunk : encoded)
+        {
+            writeValue(file, (std::int32_t)chunk.first.first);
+            writeValue(file, (std::int32_t)chunk.first.second);
+            writeValue(file, offset);
+            writeValue(file, (std::uint64_t)chunk.second.size());
+            offset += chunk.second.size();
+        }
+        for (const auto& chunk : encoded)
+            file.write(reinterpret_cast<const char*>(chunk.second.data()), chunk.second.size());
+        return (bool)file;
+    }
+
+    float StaticLightMap::getChunkSize() const
+    {
+        return mChunkSize;
+    }
+
+    unsigned StaticLightMap::getResolution() const
+    {
+        return mResolution;
+    }
+
+    LightProbeGrid::LightProbeGrid() : mCellSize(0.0f), mChunkCells(16) {}
+
+    void LightProbeGrid::setup(float cellSize, unsigned chunkCells)
+    {
+        mCellSize = cellSize;
+        mChunkCells = (int)std::max(1u, chunkCells);
+        clear();
+    }
+
+    void LightProbeGrid::invalidate(const sf::FloatRect& rect)
+    {
+        if (!isSetup())
+            return;
+        float chunkSize = mCellSize * mChunkCells;
+        int left = (int)std::floor(rect.left / chunkSize);
+        int top = (int)std::floor(rect.top / chunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / chunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / chunkSize);
+        for (int x = left; x <= right; ++x)
+            for (int y = top; y <= bottom; ++y)
+            {
+                auto chunk = mChunks.find({ x, y });
+                if (chunk != mChunks.end())
+                    chunk->second.valid = false;
+            }
+    }
+
+    void LightProbeGrid::clear()
+    {
+        mChunks.clear();
+    }
+
+    void LightProbeGrid::update(const sf::FloatRect& rect, unsigned budget,
+                                const std::function<void(const sf::FloatRect&, const std::vector<sf::Vector2f>&, std::vector<sf::Color>&)>& evaluate)
+    {
+        if (!isSetup())
+            return;
+        float chunkSize = mCellSize * mChunkCells;
+        int left = (int)std::floor(rect.left / chunkSize);
+        int top = (int)std::floor(rect.top / chunkSize);
+        int right = (int)std::floor((rect.left + rect.width) / chunkSize);
+        int bottom = (int)std::floor((rect.top + rect.height) / chunkSize);
+        std::vector<sf::Vector2f> positions;
+        for (int x = left; x <= right && budget > 0; ++x)
+            for (int y = top; y <= bottom && budget > 0; ++y)
+            {
+                Chunk& chunk = mChunks[{ x, y }];
+                if (chunk.valid)
+                    continue;
+                //probes sit in the centers of the cells
+                positions.clear();
+                for (int j = 0; j < mChunkCells; ++j)
+                    for (int i = 0; i < mChunkCells; ++i)
+                        positions.emplace_back((x * mChunkCells + i + 0.5f) * mCellSize, (y * mChunkCells + j + 0.5f) * mCellSize);
+                evaluate({ x * chunkSize, y * chunkSize, chunkSize, chunkSize }, positions, chunk.probes);
+                chunk.valid = true;
+                --budget;
+            }
+    }
+
+    sf::Color LightProbeGrid::sample(const sf::Vector2f& position) const
+    {
+        if (!isSetup())
+            return sf::Color::Black;
+        float fx = position.x / mCellSize - 0.5f;
+        float fy = position.y / mCellSize - 0.5f;
+        int x0 = (int)std::floor(fx);
+        int y0 = (int)std::floor(fy);
+        float tx = fx - x0;
+        float ty = fy - y0;
+
+        //the four probes usually share a chunk, so it is looked up only once in that case
+        const Chunk* cached = nullptr;
+        std::pair<int, int> cachedKey;
+        auto probe = [this, &cached, &cachedKey] (int x, int y)
+        {
+            std::pair<int, int> key((int)std::floor((float)x / mChunkCells), (int)std::floor((float)y / mChunkCells));
+            if (!cached || key != cachedKey)
+            {
+                auto chunk = mChunks.find(key);
+                cached = (chunk != mChunks.end() && !chunk->second.probes.empty()) ? &chunk->second : nullptr;
+                cachedKey = key;
+            }
+            if (!cached)
+                return sf::Vector3f(0.0f, 0.0f, 0.0f);
+            const sf::Color& c = cached->probes[(y - key.second * mChunkCells) * mChunkCells + (x - key.first * mChunkCells)];
+            return sf::Vector3f(c.r, c.g, c.b);
+        };
+        sf::Vector3f value = (probe(x0, y0) * (1.0f - tx) + probe(x0 + 1, y0) * tx) * (1.0f - ty) +
+                             (probe(x0, y0 + 1) * (1.0f - tx) + probe(x0 + 1, y0 + 1) * tx) * ty;
+        return sf::Color((sf::Uint8)(value.x + 0.5f), (sf::Uint8)(value.y + 0.5f), (sf::Uint8)(value.z + 0.5f));
+    }
+
+    bool LightProbeGrid::isSetup() const
+    {
+        return mCellSize > 0.0f;
+    }
+
+    LightRasterizer::LightRasterizer() : mThreadCount(0) {}
+
+    void LightRasterizer::setThreadCount(unsigned count)
+    {
+        mThreadCount = count;
+    }
+
+    void LightRasterizer::clear()
+    {
+        mLights.clear();
+    }
+
+    void LightRasterizer::addLight(const PointLight& light,
+                                   const Transform& transf,
+                                   const std::vector< std::pair<LightCollider*, Transform*> >& colliders)
+    {
+        std::vector<ShadowGeometry> shadows;
+        std::vector<bool> hidden;
+        light.computeShadowGeometry(colliders, transf, shadows, hidden);
+        addLight(light, transf, colliders, shadows, hidden);
+    }
+
+    void LightRasterizer::addLight(const PointLight& light,
+                                   const Transform& transf,
+                                   const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                   const std::vector<ShadowGeometry>& shadows,
+                                   const std::vector<bool>& hidden)
+    {
+        //texture contents are not accessible without a GL context, so the image file is read once more
+        const std::string& path = light.getTexturePath();
+        auto image = mImages.find(path);
+        if (image == mImages.end())
+        {
+            image = mImages.emplace(path, sf::Image()).first;
+            if (!image->second.loadFromFile(path))
+            {
+                ungod::Logger::warning("Could not load light image " + path + " for software rendering!");
+                ungod::Logger::endl();
+            }
+        }
+        if (image->second.getSize().x == 0 || image->second.getSize().y == 0)
+            return;
+
+        RasterLight raster;
+        raster.image = &image->second;
+        raster.textureRect = sf::FloatRect(light.mSprite.getTextureRect());
+        if (raster.textureRect.width == 0 || raster.textureRect.height == 0)
+            raster.textureRect = sf::FloatRect(0.0f, 0.0f, (float)image->second.getSize().x, (float)image->second.getSize().y);
+        sf::Transform spriteTransform = transf.getTransform() * light.mSprite.getTransform();
+        raster.bounds = spriteTransform.transformRect({ 0.0f, 0.0f, raster.textureRect.width, raster.textureRect.height });
+        raster.toTexture.translate(raster.textureRect.left, raster.textureRect.top);
+        raster.toTexture *= spriteTransform.getInverse();
+        sf::Color color = light.getColor();
+        raster.color = sf::Vector3f(color.r, color.g, color.b) * (color.a / (255.0f * 255.0f));
+        raster.extension = light.getShadowExtension();
+
+        raster.shadows = shadows;
+
+        //colliders are masked black after the shadows, light over shape colliders stay lit
+        for (std::size_t i = 0; i < colliders.size(); ++i)
+        {
+            if (hidden[i] || colliders[i].first->getLightOverShape())
+                continue;
+            sf::Transform colliderFinalTransf = colliders[i].second->getTransform();
+            colliderFinalTransf *= colliders[i].first->getTransform();
+            raster.masks.emplace_back();
+            for (std::size_t j = 0; j < colliders[i].first->getPointCount(); ++j)
+                raster.masks.back().push_back(colliderFinalTransf.transformPoint(colliders[i].first->getPoint(j)));
+        }
+
+        mLights.push_back(std::move(raster));
+    }
+
+    void LightRasterizer::render(sf::Image& image, const sf::Vector2u& size, const sf::FloatRect& area, const sf::Color& ambient) const
+    {
+        if (size.x == 0 || size.y == 0)
+        {
+            image.create(size.x, size.y);
+            return;
+        }
+
+        std::vector<sf::Uint8> pixels(4 * size.x * size.y);
+        int tilesX = ((int)size.x + TILE_SIZE - 1) / TILE_SIZE;
+        int tileCount = tilesX * (((int)size.y + TILE_SIZE - 1) / TILE_SIZE);
+
+        //tiles write disjoint regions of the pixel buffer, so workers only have to share the tile counter
+        std::atomic<int> nextTile(0);
+        auto worker = [&] ()
+        {
+            for (int t = nextTile++; t < tileCount; t = nextTile++)
+            {
+                sf::IntRect tile((t % tilesX) * TILE_SIZE, (t / tilesX) * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+                tile.width = std::min(tile.width, (int)size.x - tile.left);
+                tile.height = std::min(tile.height, (int)size.y - tile.top);
+                renderTile(pixels, size, tile, area, ambient);
+            }
+        };
+        unsigned threadCount = (mThreadCount > 0) ? mThreadCount : std::max(1u, std::thread::hardware_concurrency());
+        threadCount = std::min(threadCount, (unsigned)tileCount);
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threadCount; ++i)
+            workers.emplace_back(worker);
+        worker();
+        for (auto& w : workers)
+            w.join();
+
+        image.create(size.x, size.y, pixels.data());
+    }
+
+    void LightRasterizer::renderTile(std::vector<sf::Uint8>& pixels, const sf::Vector2u& size, const sf::IntRect& tile,
+                                     const sf::FloatRect& area, const sf::Color& ambient) const
+    {
+        const int width = tile.width;
+        const int height = tile.height;
+        const float scaleX = area.width / size.x;
+        const float scaleY = area.height / size.y;
+        sf::FloatRect tileRect(area.left + tile.left * scaleX, area.top + tile.top * scaleY, width * scaleX, height * scaleY);
+
+        std::vector<float> red(width * height, ambient.r / 255.0f);
+        std::vector<float> green(width * height, ambient.g / 255.0f);
+        std::vector<float> blue(width * height, ambient.b / 255.0f);
+        std::vector<float> shade(width * height);
+        std::vector<float> antumbra(width * height);
+        std::vector<sf::Vector2f> polygon;
+
+        //world to tile pixel coordinates, pixel centers lie on integer coordinates
+        auto toTile = [&] (const sf::Vector2f& p)
+        {
+            return sf::Vector2f((p.x - area.left) / scaleX - tile.left - 0.5f, (p.y - area.top) / scaleY - tile.top - 0.5f);
+        };
+        auto mask = [&] (float* buffer, const std::vector<sf::Vector2f>& points)
+        {
+            polygon.clear();
+            for (const auto& p : points)
+                polygon.push_back(toTile(p));
+            forEachSpan(polygon, width, height, [buffer, width] (int y, int begin, int end)
+            {
+                std::fill(buffer + y * width + begin, buffer + y * width + end, 0.0f);
+            });
+        };
+
+        for (const auto& light : mLights)
+        {
+            if (!light.bounds.intersects(tileRect))
+                continue;
+
+            std::fill(shade.begin(), shade.end(), 1.0f);
+            for (const auto& shadow : light.shadows)
+            {
+                float* target = shade.data();
+                if (shadow.antumbra)
+                {
+                    std::fill(antumbra.begin(), antumbra.end(), 1.0f);
+                    target = antumbra.data();
+                }
+                mask(target, shadow.mask);
+                for (const auto& penumbra : shadow.penumbras)
+                {
+                    polygon = { toTile(penumbra.source),
+                                toTile(penumbra.source + normalizeVector(penumbra.lightEdge) * light.extension),
+                                toTile(penumbra.source + normalizeVector(penumbra.darkEdge) * light.extension) };
+                    rasterizePenumbra(target, width, height, polygon, penumbra.lightBrightness, penumbra.darkBrightness, shadow.antumbra);
+                }
+                if (shadow.antumbra)
+                    multiplyRow(shade.data(), antumbra.data(), shade.size());
+            }
+            for (const auto& points : light.masks)
+                mask(shade.data(), points);
+
+            //emission of the light texture, scaled by the shadows
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    float s = shade[y * width + x];
+                    if (s == 0.0f)
+                        continue;
+                    sf::Vector2f world(area.left + (tile.left + x + 0.5f) * scaleX, area.top + (tile.top + y + 0.5f) * scaleY);
+                    sf::Vector2f texel = light.toTexture.transformPoint(world);
+                    if (texel.x < light.textureRect.left || texel.y < light.textureRect.top ||
+                        texel.x >= light.textureRect.left + light.textureRect.width ||
+                        texel.y >= light.textureRect.top + light.textureRect.height)
+                        continue;
+                    sf::Vector3f emission = sampleImage(*light.image, texel.x, texel.y);
+                    red[y * width + x] += light.color.x * emission.x * s;
+                    green[y * width + x] += light.color.y * emission.y * s;
+                    blue[y * width + x] += light.color.z * emission.z * s;
+                }
+            }
+        }
+
+        //additive blending saturates, since all terms are positive clamping once at the end is equivalent
+        for (int y = 0; y < height; ++y)
+            packColors(red.data() + y * width, green.data() + y * width, blue.data() + y * width, width,
+                       pixels.data() + 4 * ((tile.top + y) * size.x + tile.left));
+    }
+
+    void LightRasterizer::sample(const std::vector<sf::Vector2f>& points, std::vector<sf::Color>& colors, const sf::Color& ambient) const
+    {
+        colors.assign(points.size(), ambient);
+        if (points.empty() || mLights.empty())
+            return;
+
+        //grid over the bounding rect of the points, every cell lists the lights that overlap it
+        sf::Vector2f lower = points[0];
+        sf::Vector2f upper = points[0];
+        for (const auto& p : points)
+        {
+            lower.x = std::min(lower.x, p.x);
+            lower.y = std::min(lower.y, p.y);
+            upper.x = std::max(upper.x, p.x);
+            upper.y = std::max(upper.y, p.y);
+        }
+        sf::Vector2f cellSize(std::max(1.0f, (upper.x - lower.x) / SAMPLE_GRID_SIZE), std::max(1.0f, (upper.y - lower.y) / SAMPLE_GRID_SIZE));
+        auto cellOf = [&] (float value, float origin, float size)
+        {
+            return std::max(0, std::min(SAMPLE_GRID_SIZE - 1, (int)((value - origin) / size)));
+        };
+        std::vector< std::vector<std::size_t> > grid(SAMPLE_GRID_SIZE * SAMPLE_GRID_SIZE);
+        for (std::size_t l = 0; l < mLights.size(); ++l)
+        {
+            const sf::FloatRect& b = mLights[l].bounds;
+            if (b.left > upper.x || b.top > upper.y || b.left + b.width < lower.x || b.top + b.height < lower.y)
+                continue;
+            int x0 = cellOf(b.left, lower.x, cellSize.x);
+            int x1 = cellOf(b.left + b.width, lower.x, cellSize.x);
+            int y0 = cellOf(b.top, lower.y, cellSize.y);
+            int y1 = cellOf(b.top + b.height, lower.y, cellSize.y);
+            for (int y = y0; y <= y1; ++y)
+                for (int x = x0; x <= x1; ++x)
+                    grid[y * SAMPLE_GRID_SIZE + x].push_back(l);
+        }
+
+        //bucket the points per light
+        std::vector< std::vector<std::size_t> > lightPoints(mLights.size());
+        for (std::size_t i = 0; i < points.size(); ++i)
+        {
+            const auto& cell = grid[cellOf(points[i].y, lower.y, cellSize.y) * SAMPLE_GRID_SIZE + cellOf(points[i].x, lower.x, cellSize.x)];
+            for (std::size_t l : cell)
+                if (mLights[l].bounds.contains(points[i]))
+                    lightPoints[l].push_back(i);
+        }
+
+        std::vector<float> red(points.size(), ambient.r / 255.0f);
+        std::vector<float> green(points.size(), ambient.g / 255.0f);
+        std::vector<float> blue(points.size(), ambient.b / 255.0f);
+        std::vector<float> xs, ys, shade, antumbra;
+        std::vector<unsigned char> inside;
+        for (std::size_t l = 0; l < mLights.size(); ++l)
+        {
+            const auto& indices = lightPoints[l];
+            if (indices.empty())
+                continue;
+            const RasterLight& light = mLights[l];
+            xs.resize(indices.size());
+            ys.resize(indices.size());
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                xs[i] = points[indices[i]].x;
+                ys[i] = points[indices[i]].y;
+            }
+            shadePoints(light, xs, ys, shade, antumbra, inside);
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                if (shade[i] == 0.0f)
+                    continue;
+                sf::Vector2f texel = light.toTexture.transformPoint(xs[i], ys[i]);
+                if (texel.x < light.textureRect.left || texel.y < light.textureRect.top ||
+                    texel.x >= light.textureRect.left + light.textureRect.width ||
+                    texel.y >= light.textureRect.top + light.textureRect.height)
+                    continue;
+                sf::Vector3f emission = sampleImage(*light.image, texel.x, texel.y);
+                red[indices[i]] += light.color.x * emission.x * shade[i];
+                green[indices[i]] += light.color.y * emission.y * shade[i];
+                blue[indices[i]] += light.color.z * emission.z * shade[i];
+            }
+        }
+
+        for (std::size_t i = 0; i < points.size(); ++i)
+            colors[i] = sf::Color((sf::Uint8)(std::min(1.0f, red[i]) * 255.0f + 0.5f),
+                                  (sf::Uint8)(std::min(1.0f, green[i]) * 255.0f + 0.5f),
+                                  (sf::Uint8)(std::min(1.0f, blue[i]) * 255.0f + 0.5f));
+    }
+
+    void LightRasterizer::shadePoints(const RasterLight& light, const std::vector<float>& xs, const std::vector<float>& ys,
+                                      std::vector<float>& shade, std::vector<float>& antumbra, std::vector<unsigned char>& inside) const
+    {
+        const std::size_t count = xs.size();
+        shade.assign(count, 1.0f);
+        inside.resize(count);
+
+        //marks the points inside of a convex polygon, edges are tested one after another for all points
+        auto testPolygon = [&] (const sf::Vector2f* polygon, std::size_t n)
+        {
+            std::fill(inside.begin(), inside.end(), (unsigned char)1);
+            float area = 0.0f;
+            for (std::size_t e = 0; e < n; ++e)
+                area += cross(polygon[e], polygon[(e + 1) % n]);
+            if (n < 3 || area == 0.0f)
+            {
+                std::fill(inside.begin(), inside.end(), (unsigned char)0);
+                return;
+            }
+            float orientation = (area > 0.0f) ? 1.0f : -1.0f;
+            for (std::size_t e = 0; e < n; ++e)
+                testHalfPlane(xs.data(), ys.data(), count, polygon[e], polygon[(e + 1) % n] - polygon[e], orientation, inside.data());
+        };
+        auto mask = [&] (float* target, const std::vector<sf::Vector2f>& polygon)
+        {
+            testPolygon(polygon.data(), polygon.size());
+            for (std::size_t i = 0; i < count; ++i)
+                target[i] = inside[i] ? 0.0f : target[i];
+        };
+
+        for (const auto& shadow : light.shadows)
+        {
+            float* target = shade.data();
+            if (shadow.antumbra)
+            {
+                antumbra.assign(count, 1.0f);
+                target = antumbra.data();
+            }
+            mask(target, shadow.mask);
+            for (const auto& penumbra : shadow.penumbras)
+            {
+                sf::Vector2f triangle[3] = { penumbra.source,
+                                             penumbra.source + normalizeVector(penumbra.lightEdge) * light.extension,
+                                             penumbra.source + normalizeVector(penumbra.darkEdge) * light.extension };
+                testPolygon(triangle, 3);
+                blendPenumbraPoints(xs.data(), ys.data(), inside.data(), count, triangle, penumbra.lightBrightness,
+                                    penumbra.darkBrightness, shadow.antumbra, target);
+            }
+            if (shadow.antumbra)
+                multiplyRow(shade.data(), antumbra.data(), count);
+        }
+        for (const auto& points : light.masks)
+            mask(shade.data(), points);
+    }
+
+    namespace
+    {
+        //pixel buffer objects and fences are not part of the gl headers on every platform, so they are loaded at runtime
+        typedef void (APIENTRY *GenBuffersFunc)(GLsizei, GLuint*);
+        typedef void (APIENTRY *DeleteBuffersFunc)(GLsizei, const GLuint*);
+        typedef void (APIENTRY *BindBufferFunc)(GLenum, GLuint);
+        typedef void (APIENTRY *BufferDataFunc)(GLenum, std::ptrdiff_t, const void*, GLenum);
+        typedef void* (APIENTRY *MapBufferFunc)(GLenum, GLenum);
+        typedef GLboolean (APIENTRY *UnmapBufferFunc)(GLenum);
+        typedef void* (APIENTRY *FenceSyncFunc)(GLenum, GLbitfield);
+        typedef GLenum (APIENTRY *ClientWaitSyncFunc)(void*, GLbitfield, std::uint64_t);
+        typedef void (APIENTRY *DeleteSyncFunc)(void*);
+
+        const GLenum PIXEL_PACK_BUFFER = 0x88EB;
+        const GLenum STREAM_READ = 0x88E1;
+        const GLenum READ_ONLY = 0x88B8;
+        const GLenum SYNC_GPU_COMMANDS_COMPLETE = 0x9117;
+        const GLenum ALREADY_SIGNALED = 0x911A;
+        const GLenum CONDITION_SATISFIED = 0x911C;
+
+        struct BufferFunctions
+        {
+            GenBuffersFunc genBuffers = nullptr;
+            DeleteBuffersFunc deleteBuffers = nullptr;
+            BindBufferFunc bindBuffer = nullptr;
+            BufferDataFunc bufferData = nullptr;
+            MapBufferFunc mapBuffer = nullptr;
+            UnmapBufferFunc unmapBuffer = nullptr;
+            FenceSyncFunc fenceSync = nullptr;
+            ClientWaitSyncFunc clientWaitSync = nullptr;
+            DeleteSyncFunc deleteSync = nullptr;
+        } glBuffers;
+
+        /** \brief Loads the buffer functions, requires an active context. Returns false if pixel buffer objects are not supported. */
+        bool loadBufferFunctions()
+        {
+            glBuffers.genBuffers = reinterpret_cast<GenBuffersFunc>(sf::Context::getFunction("glGenBuffers"));
+            glBuffers.deleteBuffers = reinterpret_cast<DeleteBuffersFunc>(sf::Context::getFunction("glDeleteBuffers"));
+            glBuffers.bindBuffer = reinterpret_cast<BindBufferFunc>(sf::Context::getFunction("glBindBuffer"));
+            glBuffers.bufferData = reinterpret_cast<BufferDataFunc>(sf::Context::getFunction("glBufferData"));
+            glBuffers.mapBuffer = reinterpret_cast<MapBufferFunc>(sf::Context::getFunction("glMapBuffer"));
+            glBuffers.unmapBuffer = reinterpret_cast<UnmapBufferFunc>(sf::Context::getFunction("glUnmapBuffer"));
+            glBuffers.fenceSync = reinterpret_cast<FenceSyncFunc>(sf::Context::getFunction("glFenceSync"));
+            glBuffers.clientWaitSync = reinterpret_cast<ClientWaitSyncFunc>(sf::Context::getFunction("glClientWaitSync"));
+            glBuffers.deleteSync = reinterpret_cast<DeleteSyncFunc>(sf::Context::getFunction("glDeleteSync"));
+            if (!glBuffers.fenceSync || !glBuffers.clientWaitSync || !glBuffers.deleteSync)
+            {
+                glBuffers.fenceSync = nullptr;
+                glBuffers.clientWaitSync = nullptr;
+                glBuffers.deleteSync = nullptr;
+            }
+            return glBuffers.genBuffers && glBuffers.deleteBuffers && glBuffers.bindBuffer && glBuffers.bufferData && glBuffers.mapBuffer && glBuffers.unmapBuffer;
+        }
+    }
+
+    LightMapReadback::LightMapReadback() : mNext(0), mFrame(0), mDownsample(1), mLoaded(false), mSupported(false)
+    {
+        mSlots.resize(3);
+    }
+
+    LightMapReadback::~LightMapReadback()
+    {
+        release();
+    }
+
+    void LightMapReadback::setup(unsigned ringSize, unsigned downsample)
+    {
+        release();
+        mSlots.clear();
+        mSlots.resize(std::max(2u, ringSize));
+        mNext = 0;
+        mDownsample = std::max(1u, downsample);
+    }
+
+    void LightMapReadback::request(sf::RenderTexture& texture)
+    {
+        if (!mLoaded)
+        {
+            texture.setActive(true);
+            mLoaded = true;
+            mSupported = loadBufferFunctions();
+            if (!mSupported)
+            {
+                ungod::Logger::warning("Pixel buffer objects are not supported, light map readback is disabled!");
+                ungod::Logger::endl();
+            }
+        }
+        if (!mSupported)
+            return;
+
+        Slot& slot = mSlots[mNext];
+        if (slot.pending)
+            return;
+
+        //downsampling is a regular draw, so it does not stall either
+        sf::RenderTexture* source = &texture;
+        if (mDownsample > 1)
+        {
+            sf::Vector2u size(std::max(1u, texture.getSize().x / mDownsample), std::max(1u, texture.getSize().y / mDownsample));
+            if (mDownsampleTexture.getSize() != size)
+                mDownsampleTexture.create(size.x, size.y);
+            sf::Sprite sprite(texture.getTexture());
+            sprite.setScale((float)size.x / texture.getSize().x, (float)size.y / texture.getSize().y);
+            mDownsampleTexture.clear();
+            mDownsampleTexture.draw(sprite, sf::BlendNone);
+            mDownsampleTexture.display();
+            source = &mDownsampleTexture;
+        }
+
+        source->setActive(true);
+        if (slot.buffer == 0)
+            glBuffers.genBuffers(1, &slot.buffer);
+        glBuffers.bindBuffer(PIXEL_PACK_BUFFER, slot.buffer);
+        if (slot.size != source->getSize())
+        {
+            slot.size = source->getSize();
+            glBuffers.bufferData(PIXEL_PACK_BUFFER, 4 * slot.size.x * slot.size.y, nullptr, STREAM_READ);
+        }
+        //with a pack buffer bound, glReadPixels only queues the copy and returns immediately
+        glReadPixels(0, 0, slot.size.x, slot.size.y, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBuffers.bindBuffer(PIXEL_PACK_BUFFER, 0);
+        if (glBuffers.fenceSync)
+            slot.fence = glBuffers.fenceSync(SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.pending = true;
+        slot.frame = mFrame++;
+        mNext = (mNext + 1) % mSlots.size();
+    }
+
+    bool LightMapReadback::poll()
+    {
+        if (!mSupported)
+            return false;
+        //reads finish in the order they were issued, the oldest one is the next slot of the ring
+        Slot* latest = nullptr;
+        for (std::size_t i = 0; i < mSlots.size(); ++i)
+        {
+            Slot& slot = mSlots[(mNext + i) % mSlots.size()];
+            if (!slot.pending)
+                continue;
+            if (!isReady(slot))
+                break;
+            //only the most recent of several finished reads is mapped
+            if (latest)
+                discard(*latest);
+            latest = &slot;
+        }
+        if (!latest)
+            return false;
+        read(*latest);
+        if (mCallback)
+            mCallback(mPixels, mSize);
+        return true;
+    }
+
+    bool LightMapReadback::isReady(Slot& slot) const
+    {
+        if (slot.fence)
+        {
+            GLenum status = glBuffers.clientWaitSync(slot.fence, 0, 0);
+            return status == ALREADY_SIGNALED || status == CONDITION_SATISFIED;
+        }
+        //without fences the copy is assumed to be done after the ring was cycled once
+        return mFrame - slot.frame >= mSlots.size() - 1;
+    }
+
+    void LightMapReadback::discard(Slot& slot)
+    {
+        slot.pending = false;
+        if (slot.fence)
+        {
+            glBuffers.deleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+    }
+
+    void LightMapReadback::read(Slot& slot)
+    {
+        discard(slot);
+        glBuffers.bindBuffer(PIXEL_PACK_BUFFER, slot.buffer);
+        const sf::Uint8* data = static_cast<const sf::Uint8*>(glBuffers.mapBuffer(PIXEL_PACK_BUFFER, READ_ONLY));
+        if (data)
+        {
+            //gl rows start at the bottom
+            mSize = slot.size;
+            mPixels.resize(4 * mSize.x * mSize.y);
+            for (unsigned y = 0; y < mSize.y; ++y)
+                std::copy(data + 4 * mSize.x * (mSize.y - 1 - y), data + 4 * mSize.x * (mSize.y - y), mPixels.begin() + 4 * mSize.x * y);
+            glBuffers.unmapBuffer(PIXEL_PACK_BUFFER);
+        }
+        glBuffers.bindBuffer(PIXEL_PACK_BUFFER, 0);
+    }
+
+    void LightMapReadback::release()
+    {
+        if (!mSupported)
+            return;
+        sf::Context context;
+        for (auto& slot : mSlots)
+        {
+            if (slot.fence)
+                glBuffers.deleteSync(slot.fence);
+            if (slot.buffer != 0)
+                glBuffers.deleteBuffers(1, &slot.buffer);
+            slot = Slot();
+        }
+    }
+
+    void LightMapReadback::setCallback(const std::function<void(const std::vector<sf::Uint8>&, const sf::Vector2u&)>& callback)
+    {
+        mCallback = callback;
+    }
+
+    const std::vector<sf::Uint8>& LightMapReadback::getPixels() const
+    {
+        return mPixels;
+    }
+
+    sf::Vector2u LightMapReadback::getSize() const
+    {
+        return mSize;
+    }
+
+    LightJobPool::LightJobPool() : mJob(nullptr), mCount(0), mChunkSize(1), mNext(0), mBusy(0), mGeneration(0), mStop(false) {}
+
+    LightJobPool::~LightJobPool()
+    {
+        stop();
+    }
+
+    void LightJobPool::setThreadCount(unsigned count)
+    {
+        stop();
+        count = (count > 0) ? count : std::max(1u, std::thread::hardware_concurrency());
+        mStop = false;
+        for (unsigned i = 1; i < count; ++i)
+            mWorkers.emplace_back(&LightJobPool::work, this, mGeneration);
+    }
+
+    unsigned LightJobPool::getThreadCount() const
+    {
+        return (unsigned)mWorkers.size() + 1;
+    }
+
+    void LightJobPool::run(std::size_t count, std::size_t chunkSize, const std::function<void(std::size_t, std::size_t)>& job)
+    {
+        chunkSize = std::max<std::size_t>(1, chunkSize);
+        if (mWorkers.empty() || count <= chunkSize)
+        {
+            for (std::size_t begin = 0; begin < count; begin += chunkSize)
+                job(begin, std::min(begin + chunkSize, count));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJob = &job;
+            mCount = count;
+            mChunkSize = chunkSize;
+            mNext = 0;
+            mBusy = (unsigned)mWorkers.size();
+            ++mGeneration;
+        }
+        mWake.notify_all();
+        runChunks();
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDone.wait(lock, [this] { return mBusy == 0; });
+        mJob = nullptr;
+    }
+
+    void LightJobPool::work(unsigned generation)
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWake.wait(lock, [this, generation] { return mStop || mGeneration != generation; });
+                if (mStop)
+                    return;
+                generation = mGeneration;
+            }
+            runChunks();
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mBusy == 0)
+                mDone.notify_one();
+        }
+    }
+
+    void LightJobPool::runChunks()
+    {
+        for (std::size_t begin = mNext.fetch_add(mChunkSize); begin < mCount; begin = mNext.fetch_add(mChunkSize))
+            (*mJob)(begin, std::min(begin + mChunkSize, mCount));
+    }
+
+    void LightJobPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWake.notify_all();
+        for (auto& worker : mWorkers)
+            worker.join();
+        mWorkers.clear();
+    }
+
+
+    LightSnapshotBuffer::LightSnapshotBuffer() : mBack(0), mFront(2), mPending(1), mPublished(false) {}
+
+    LightSnapshot& LightSnapshotBuffer::getBack()
+    {
+        return mSnapshots[mBack];
+    }
+
+    void LightSnapshotBuffer::publish()
+    {
+        //the release makes the writes to the back snapshot visible to the reader that acquires it
+        mBack = mPending.exchange(mBack | FRESH, std::memory_order_acq_rel) & ~FRESH;
+        mPublished.store(true, std::memory_order_release);
+    }
+
+    LightSnapshot& LightSnapshotBuffer::acquire()
+    {
+        if (mPending.load(std::memory_order_relaxed) & FRESH)
+            mFront = mPending.exchange(mFront, std::memory_order_acq_rel) & ~FRESH;
+        return mSnapshots[mFront];
+    }
+
+    bool LightSnapshotBuffer::hasPublished() const
+    {
+        return mPublished.load(std::memory_order_acquire);
+    }
+
+
+    std::shared_ptr<const ShadowGeometryCache::Entry> ShadowGeometryCache::get(const PointLight* light, const sf::Transform& transform,
+                                                                         const std::function<void(Entry&)>& compute)
+    {
+        std::shared_ptr<Slot> slot;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            std::shared_ptr<Slot>& entry = mSlots[light];
+            //an outdated slot is replaced, views that still hold it keep it alive until they are done
+            if (!entry || entry->version != mVersion ||
+                !std::equal(transform.getMatrix(), transform.getMatrix() + 16, entry->transform.getMatrix()))
+            {
+                entry = std::make_shared<Slot>();
+                entry->transform = transform;
+                entry->version = mVersion;
+            }
+            slot = entry;
+        }
+        //computed outside of the lock, so that different lights are computed in parallel
+        std::call_once(slot->computed, compute, std::ref(slot->entry));
+        return std::shared_ptr<const Entry>(slot, &slot->entry);
+    }
+
+    void ShadowGeometryCache::invalidate()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        //slots that were not requested since the previous invalidation are outdated already (or their light was
+        //removed), views that still hold them keep them alive until they are done
+        for (auto it = mSlots.begin(); it != mSlots.end();)
+        {
+            if (it->second->version != mVersion)
+                it = mSlots.erase(it);
+            else
+                ++it;
+        }
+        ++mVersion;
+    }
+
+    void ShadowGeometryCache::clear()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSlots.clear();
+    }
+
+
+    void LightRenderContext::setImageSize(const sf::Vector2u& imageSize)
+    {
+        mLightTexture.create(imageSize.x, imageSize.y);
+        mEmissionTexture.create(imageSize.x, imageSize.y);
+        mAntumbraTexture.create(imageSize.x, imageSize.y);
+        mCompositionTexture.create(imageSize.x, imageSize.y);
+        mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / imageSize.x, 1.0f / imageSize.y));
+    }
+
+    const sf::Texture& LightRenderContext::getLightMap() const
+    {
+        return mCompositionTexture.getTexture();
+    }
+
+    ShadowScheduler::ShadowScheduler() : mBudget(0), mMaxStaleness(0), mFrame(0) {}
+
+    void ShadowScheduler::setup(unsigned budget, unsigned maxStaleness)
+    {
+        mBudget = budget;
+        mMaxStaleness = maxStaleness;
+        if (mBudget == 0)
+            clear();
+    }
+
+    bool ShadowScheduler::isEnabled() const
+    {
+        return mBudget > 0;
+    }
+
+    void ShadowScheduler::clear()
+    {
+        mMasks.clear();
+        mRequests.clear();
+        mPool.clear();
+        mScratch.clear();
+    }
+
+    void ShadowScheduler::invalidate(const sf::FloatRect& region)
+    {
+        for (auto& mask : mMasks)
+            if (mask.second.bounds.intersects(region))
+                outdate(mask.second);
+    }
+
+    void ShadowScheduler::invalidate(const PointLight* light)
+    {
+        auto mask = mMasks.find(light);
+        if (mask != mMasks.end())
+            outdate(mask->second);
+    }
+
+    std::size_t ShadowScheduler::addLight(const PointLight* light, const sf::FloatRect& bounds, unsigned maskSize)
+    {
+        Mask& mask = mMasks[light];
+        mask.seenFrame = mFrame;
+        //lights moved by their transform are only detected by their bounds
+        if (mask.bounds != bounds || mask.size != maskSize)
+            outdate(mask);
+        mRequests.push_back({ &mask, bounds, maskSize, false });
+        return mRequests.size() - 1;
+    }
+
+    void ShadowScheduler::schedule(const sf::FloatRect& viewRect)
+    {
+        //lights without a mask and lights that reached the maximum staleness are rendered in any case
+        unsigned budget = mBudget;
+        std::vector<std::size_t> outdated;
+        std::vector<std::size_t> current;
+        for (std::size_t i = 0; i < mRequests.size(); ++i)
+        {
+            const Mask& mask = *mRequests[i].mask;
+            if (!mask.texture || (mask.outdated && mFrame - mask.outdatedFrame >= mMaxStaleness))
+            {
+                mRequests[i].scheduled = true;
+                budget = budget > 0 ? budget - 1 : 0;
+            }
+            else if (mask.outdated)
+                outdated.push_back(i);
+            else
+                current.push_back(i);
+        }
+
+        //outdated masks are ordered by coverage of the view, distance to the camera and staleness
+        sf::Vector2f center(viewRect.left + viewRect.width / 2.0f, viewRect.top + viewRect.height / 2.0f);
+        float diagonal = std::max(std::hypot(viewRect.width, viewRect.height), 1.0f);
+        float viewArea = std::max(viewRect.width * viewRect.height, 1.0f);
+        std::vector<float> priorities(mRequests.size(), 0.0f);
+        for (std::size_t i : outdated)
+        {
+            const Request& request = mRequests[i];
+            sf::FloatRect visible;
+            float coverage = request.bounds.intersects(viewRect, visible) ? visible.width * visible.height / viewArea : 0.0f;
+            float distance = std::hypot(request.bounds.left + request.bounds.width / 2.0f - center.x,
+                                        request.bounds.top + request.bounds.height / 2.0f - center.y) / diagonal;
+            float staleness = (float)(mFrame - request.mask->outdatedFrame + 1);
+            priorities[i] = staleness * (coverage + 0.01f) / (1.0f + distance);
+        }
+        std::sort(outdated.begin(), outdated.end(), [&priorities] (std::size_t a, std::size_t b) { return priorities[a] > priorities[b]; });
+
+        //up to date masks are refreshed round robin with the remaining budget, oldest first
+        std::sort(current.begin(), current.end(), [this] (std::size_t a, std::size_t b)
+                  { return mRequests[a].mask->renderedFrame < mRequests[b].mask->renderedFrame; });
+
+        for (const auto* group : { &outdated, &current })
+            for (std::size_t i = 0; i < group->size() && budget > 0; ++i, --budget)
+                mRequests[(*group)[i]].scheduled = true;
+
+        for (auto& request : mRequests)
+        {
+            if (!request.scheduled)
+                continue;
+            Mask& mask = *request.mask;
+            if (!mask.texture || mask.size != request.size)
+            {
+                release(mask);
+                mask.texture = acquire(request.size);
+                mask.size = request.size;
+            }
+            mask.bounds = request.bounds;
+            mask.renderedFrame = mFrame;
+            mask.outdated = false;
+        }
+    }
+
+    bool ShadowScheduler::isScheduled(std::size_t index) const
+    {
+        return mRequests[index].scheduled;
+    }
+
+    sf::RenderTexture& ShadowScheduler::getMask(std::size_t index)
+    {
+        return *mRequests[index].mask->texture;
+    }
+
+    const sf::FloatRect& ShadowScheduler::getMaskBounds(std::size_t index) const
+    {
+        return mRequests[index].mask->bounds;
+    }
+
+    sf::RenderTexture& ShadowScheduler::getScratch(unsigned size, unsigned index)
+    {
+        sf::RenderTexture& scratch = mScratch[{ size, index }];
+        if (scratch.getSize().x != size)
+            scratch.create(size, size);
+        return scratch;
+    }
+
+    void ShadowScheduler::endFrame()
+    {
+        mRequests.clear();
+        for (auto mask = mMasks.begin(); mask != mMasks.end();)
+        {
+            if (mFrame - mask->second.seenFrame >= std::max(1u, mMaxStaleness))
+            {
+                release(mask->second);
+                mask = mMasks.erase(mask);
+            }
+            else
+                ++mask;
+        }
+        ++mFrame;
+    }
+
+    unsigned ShadowScheduler::getMaskSize(float pixels)
+    {
+        unsigned size = MIN_MASK_SIZE;
+        while (size < pixels && size < MAX_MASK_SIZE)
+            size *= 2;
+        return size;
+    }
+
+    std::unique_ptr<sf::RenderTexture> ShadowScheduler::acquire(unsigned size)
+    {
+        auto& pool = mPool[size];
+        if (!pool.empty())
+        {
+            std::unique_ptr<sf::RenderTexture> texture = std::move(pool.back());
+            pool.pop_back();
+            return texture;
+        }
+        std::unique_ptr<sf::RenderTexture> texture(new sf::RenderTexture());
+        texture->create(size, size);
+        texture->setSmooth(true);
+        return texture;
+    }
+
+    void ShadowScheduler::release(Mask& mask)
+    {
+        if (mask.texture)
+            mPool[mask.size].push_back(std::move(mask.texture));
+        mask.size = 0;
+    }
+
+    void ShadowScheduler::outdate(Mask& mask)
+    {
+        if (mask.outdated)
+            return;
+        mask.outdated = true;
+        mask.outdatedFrame = mFrame;
+    }
+
+    LightSystem::LightSystem() : mQuadTree(nullptr), mAmbientColor(sf::Color::White), mColorShift(0,0,0), mDeferNotifications(false),
+        mMergeUmbras(false), mShadowTechnique(ShadowTechnique::Penumbras), mAnimationTime(0.0), mRenderFrame(0), mReadbackEnabled(false),
+        mStaticLightsComposed(false)
+    {
+        //changed contents outdate the shadow masks around them, the rects are local to the entity
+        mContentsChangedSignal.connect([this] (Entity e, const sf::IntRect& rect)
+            {
+                sf::FloatRect bounds(rect);
+                if (e.has<Transform>())
+                    bounds = e.get<Transform>().getTransform().transformRect(bounds);
+                mShadowScheduler.invalidate(bounds);
+            });
+    }
+
+    void LightSystem::init(quad::QuadTree<Entity>* quadtree,
+              const sf::Vector2u &imageSize,
+              const std::string& unshadowVertex,
+              const std::string& unshadowFragment,
+              const std::string& lightOverShapeVertex,
+              const std::string& lightOverShapeFragment,
+              const std::string& penumbraTexture)
+    {
+        mQuadTree = quadtree;
+
+        mUnshadowVertex = unshadowVertex;
+        mUnshadowFragment = unshadowFragment;
+        mLightOverShapeVertex = lightOverShapeVertex;
+        mLightOverShapeFragment = lightOverShapeFragment;
+
+        mPenumbraTexture.load(penumbraTexture);
+
+        if (mPenumbraTexture.isLoaded())
+        {
+            mPenumbraTexture.get()->setSmooth(true);
+        }
+        else
+        {
+            ungod::Logger::warning("No valid penumbra texture loaded!");
+            ungod::Logger::endl();
+        }
+
+        initRenderContext(mContext, imageSize);
+
+        if (!mShadowMapShader.loadFromMemory(SHADOW_MAP_VERTEX_SHADER, SHADOW_MAP_FRAGMENT_SHADER))
+        {
+            ungod::Logger::warning("Could not compile the shadow map shader!");
+            ungod::Logger::endl();
+        }
+        mShadowMapShader.setUniform("texture", sf::Shader::CurrentTexture);
+    }
+
+    void LightSystem::render(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states,
+                             LightRenderContext& context) const
+    {
+        sf::View view = target.getView();
+        sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+
+        context.mCompositionTexture.clear(mAmbientColor);
+        //the light map is composed only if all chunks of the view are baked, baking is left to the main view
+        bool staticLightsComposed = mStaticLightMap.isBaked(viewRect);
+        if (staticLightsComposed)
+        {
+            context.mCompositionTexture.setView(view);
+            mStaticLightMap.render(context.mCompositionTexture, viewRect);
+        }
+        context.mCompositionTexture.setView(context.mCompositionTexture.getDefaultView());
+        context.mCompositionTexture.display();
+
+        auto renderLight = [this, &context, &target, &states, staticLightsComposed]
+            (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
+        {
+            if (!staticLightsComposed || !light.mLight.isStatic())
+                composeLight(context, target, states, light.mLight, lightTransf, *getGeometry(lightTransf, light, candidates), mAnimationTime,
+                             mShadowTechnique, mMergeUmbras);
+        };
+        visitLights(pull.getList(), renderLight);
+
+        states.blendMode = sf::BlendMultiply;
+
+        context.mDisplaySprite.setTexture(context.mCompositionTexture.getTexture(), true);
+        target.setView(target.getDefaultView());
+        target.draw(context.mDisplaySprite, states);
+        target.setView(view);
+    }
+
+    void LightSystem::initRenderContext(LightRenderContext& context, const sf::Vector2u& imageSize) const
+    {
+        context.mUnshadowShader.loadFromFile(mUnshadowVertex, mUnshadowFragment);
+        context.mLightOverShapeShader.loadFromFile(mLightOverShapeVertex, mLightOverShapeFragment);
+
+        context.setImageSize(imageSize);
+
+        if (mPenumbraTexture.isLoaded())
+            context.mUnshadowShader.setUniform("penumbraTexture", *mPenumbraTexture.get());
+
+        context.mLightOverShapeShader.setUniform("emissionTexture", context.mEmissionTexture.getTexture());
+
+        if (!context.mLightAnimationShader.loadFromMemory(LIGHT_ANIMATION_VERTEX_SHADER, LIGHT_ANIMATION_FRAGMENT_SHADER))
+        {
+            ungod::Logger::warning("Could not compile the light animation shader!");
+            ungod::Logger::endl();
+        }
+        context.mLightAnimationShader.setUniform("texture", sf::Shader::CurrentTexture);
+    }
+
+    void LightSystem::initSoftware(quad::QuadTree<Entity>* quadtree)
+    {
+        mQuadTree = quadtree;
+        softwareOnly = true;
+    }
+
+    void LightSystem::setImageSize(const sf::Vector2u &imageSize)
+    {
+        mContext.setImageSize(imageSize);
+    }
+
+    void LightSystem::render(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states)
+    {
+        //remember which lights are on screen, affectors of the other lights may be updated less often
+        ++mRenderFrame;
+        dom::Utility<Entity>::iterate<LightEmitter>(pull.getList(),
+          [this] (Entity e, LightEmitter& light)
+          {
+              light.mVisibleFrame = mRenderFrame;
+          });
+        dom::Utility<Entity>::iterate<MultiLightEmitter>(pull.getList(),
+          [this] (Entity e, MultiLightEmitter& light)
+          {
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  light.getComponent(i).mVisibleFrame = mRenderFrame;
+          });
+
+        mContext.mCompositionTexture.clear(mAmbientColor);
+        mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+        mContext.mCompositionTexture.display();
+
+        sf::View view = target.getView();
+        sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+
+        if (mLightProbes.isSetup())
+            updateLightProbes(viewRect);
+
+        //static lights come from the baked chunks once all chunks of the view are baked, the techniques below only
+        //render the dynamic ones then. Until that, the static lights are rendered like dynamic ones, so that they
+        //neither vanish nor are drawn twice where some chunks are baked already
+        if (mStaticLightMap.isSetup())
+            mStaticLightMap.update(viewRect, STATIC_LIGHT_MAP_CHUNK_BUDGET,
+                [this] (const sf::FloatRect& chunkRect, sf::RenderTexture& texture) { bakeStaticChunk(chunkRect, texture); });
+        mStaticLightsComposed = mStaticLightMap.isBaked(viewRect);
+        if (mStaticLightsComposed)
+        {
+            mContext.mCompositionTexture.setView(view);
+            mStaticLightMap.render(mContext.mCompositionTexture, viewRect);
+            mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+            mContext.mCompositionTexture.display();
+        }
+
+        //without a prepared field the lights would be drawn unshadowed, the default technique is used instead
+        if (mShadowTechnique == ShadowTechnique::DistanceField && mDistanceField.isSetup() && mQuadTree)
+        {
+            renderDistanceField(pull, target, states);
+        }
+        else if (mShadowTechnique == ShadowTechnique::ShadowMap)
+        {
+            renderShadowMaps(pull, target, states);
+        }
+        else if (mShadowScheduler.isEnabled())
+        {
+            renderScheduled(pull, target, states);
+        }
+        else
+        {
+            //lights of the same entity share the retrieval of their colliders
+            visitLights(pull.getList(),
+              [this, &target, &states] (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
+              {
+                  renderLight(target, states, lightTransf, light, candidates);
+              });
+        }
+
+        if (mReadbackEnabled)
+        {
+            mReadback.poll();
+            mReadback.request(mContext.mCompositionTexture);
+        }
+
+		states.blendMode = sf::BlendMultiply;
+
+		mContext.mDisplaySprite.setTexture(mContext.mCompositionTexture.getTexture(), true);
+		target.setView(target.getDefaultView());
+		target.draw(mContext.mDisplaySprite, states);
+		target.setView(view);
+    }
+
+
+    void LightSystem::captureSnapshot(const std::list<Entity>& entities)
+    {
+
+        LightSnapshot& snapshot = mSnapshots.getBack();
+        snapshot.ambientColor = mAmbientColor;
+        snapshot.animationTime = mAnimationTime;
+        snapshot.technique = mShadowTechnique == ShadowTechnique::VisibilityPolygon ? ShadowTechnique::VisibilityPolygon : ShadowTechnique::Penumbras;
+        snapshot.mergeUmbras = mMergeUmbras;
+
+        //the entries of the back snapshot are overwritten in place, so that their memory is reused
+        std::size_t lightCount = 0;
+        std::size_t colliderCount = 0;
+        std::map<const LightCollider*, std::size_t> colliderIndices;
+        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+        auto addCollider = [&snapshot, &colliderCount, &colliderIndices] (const LightCollider& collider, const Transform& transf)
+        {
+            auto index = colliderIndices.emplace(&collider, colliderCount);
+            if (!index.second)
+                return index.first->second;
+            sf::FloatRect bounds = transf.getTransform().transformRect(collider.getBoundingBox());
+            if (colliderCount < snapshot.colliders.size())
+            {
+                LightSnapshot::Collider& entry = snapshot.colliders[colliderCount];
+                entry.collider = collider;
+                entry.transform = transf;
+                entry.bounds = bounds;
+            }
+            else
+                snapshot.colliders.push_back({ collider, transf, bounds });
+            return colliderCount++;
+        };
+
+        ++mRenderFrame;
+        auto addLight = [this, &snapshot, &lightCount, &colliders, &addCollider] (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
+        {
+            light.mVisibleFrame = mRenderFrame;
+            const PointLight& pointLight = light.mLight;
+            if (!pointLight.isActive())
+                return;
+            if (lightCount == snapshot.lights.size())
+                snapshot.lights.emplace_back();
+            LightSnapshot::Light& entry = snapshot.lights[lightCount++];
+            entry.texturePath = pointLight.getTexturePath();
+            entry.textureRect = pointLight.mSprite.getTextureRect();
+            entry.origin = pointLight.mSprite.getOrigin();
+            entry.position = pointLight.mSprite.getPosition();
+            entry.scale = pointLight.mSprite.getScale();
+            entry.color = pointLight.getColor();
+            entry.sourcePoint = pointLight.mSourcePoint;
+            entry.radius = pointLight.mRadius;
+            entry.shadowOverExtendMultiplier = pointLight.mShadowOverExtendMultiplier;
+            entry.animation = pointLight.getAnimation();
+            entry.transform = lightTransf;
+            entry.bounds = lightTransf.getTransform().transformRect(pointLight.getBoundingBox());
+
+            //the colliders are taken from the quadtree now, so that rendering does not have to test all of them
+            colliders.clear();
+            gatherColliders(lightTransf, light, candidates, colliders);
+            entry.colliders.clear();
+            for (const auto& collider : colliders)
+                entry.colliders.push_back(addCollider(*collider.first, *collider.second));
+        };
+        visitLights(entities, addLight);
+
+        snapshot.lights.erase(snapshot.lights.begin() + lightCount, snapshot.lights.end());
+        snapshot.colliders.erase(snapshot.colliders.begin() + colliderCount, snapshot.colliders.end());
+    }
+
+    void LightSystem::publishSnapshot()
+    {
+        mSnapshots.publish();
+    }
+
+    void LightSystem::renderSnapshot(sf::RenderTarget& target, sf::RenderStates states)
+    {
+        LightSnapshot& snapshot = mSnapshots.acquire();
+
+        mContext.mCompositionTexture.clear(snapshot.ambientColor);
+        mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+        mContext.mCompositionTexture.display();
+
+        sf::View view = target.getView();
+        sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+
+        ShadowGeometryCache::Entry geometry;
+        for (const LightSnapshot::Light& light : snapshot.lights)
+        {
+            if (!light.bounds.intersects(viewRect))
+                continue;
+
+            //the light is rebuilt from its parameters with a texture that belongs to this thread
+            std::unique_ptr<PointLight>& proxy = mSnapshotLights[light.texturePath];
+            if (!proxy)
+                proxy.reset(new PointLight(light.texturePath));
+            proxy->mSprite.setTextureRect(light.textureRect);
+            proxy->mSprite.setOrigin(light.origin);
+            proxy->mSprite.setPosition(light.position);
+            proxy->mSprite.setScale(light.scale);
+            proxy->setColor(light.color);
+            proxy->mSourcePoint = light.sourcePoint;
+            proxy->mRadius = light.radius;
+            proxy->mShadowOverExtendMultiplier = light.shadowOverExtendMultiplier;
+            proxy->setAnimation(light.animation);
+
+            geometry.colliders.clear();
+            for (std::size_t c : light.colliders)
+                geometry.colliders.emplace_back(&snapshot.colliders[c].collider, &snapshot.colliders[c].transform);
+            computeGeometry(*proxy, light.transform, geometry, snapshot.technique);
+            composeLight(mContext, target, states, *proxy, light.transform, geometry, snapshot.animationTime,
+                         snapshot.technique, snapshot.mergeUmbras);
+        }
+
+        if (mReadbackEnabled)
+        {
+            mReadback.poll();
+            mReadback.request(mContext.mCompositionTexture);
+        }
+
+		states.blendMode = sf::BlendMultiply;
+
+		mContext.mDisplaySprite.setTexture(mContext.mCompositionTexture.getTexture(), true);
+		target.setView(target.getDefaultView());
+		target.draw(mContext.mDisplaySprite, states);
+		target.setView(view);
+    }
+
+    void LightSystem::renderSoftware(const sf::FloatRect& area, const sf::Vector2u& size, sf::Image& image)
+    {
+        prepareRasterizer({ area });
+        mRasterizer.render(image, size, area, mAmbientColor);
+    }
+
+    void LightSystem::queryLight(const std::vector<sf::Vector2f>& points, std::vector<sf::Color>& colors)
+    {
+        if (points.empty())
+        {
+            colors.clear();
+            return;
+        }
+        //group the points into cells, so that distant groups of points do not pull in all lights between them
+        std::map< std::pair<int, int>, sf::FloatRect > cells;
+        for (const auto& p : points)
+        {
+            std::pair<int, int> cell((int)std::floor(p.x / QUERY_CELL_SIZE), (int)std::floor(p.y / QUERY_CELL_SIZE));
+            auto inserted = cells.emplace(cell, sf::FloatRect(p, { 0.0f, 0.0f }));
+            if (inserted.second)
+                continue;
+            sf::FloatRect& area = inserted.first->second;
+            float right = std::max(area.left + area.width, p.x);
+            float bottom = std::max(area.top + area.height, p.y);
+            area.left = std::min(area.left, p.x);
+            area.top = std::min(area.top, p.y);
+            area.width = right - area.left;
+            area.height = bottom - area.top;
+        }
+        std::vector<sf::FloatRect> areas;
+        areas.reserve(cells.size());
+        for (const auto& cell : cells)
+            areas.push_back(cell.second);
+        prepareRasterizer(areas);
+        mRasterizer.sample(points, colors, mAmbientColor);
+    }
+
+    void LightSystem::prepareRasterizer(const std::vector<sf::FloatRect>& areas)
+    {
+        mRasterizer.clear();
+        std::set<const PointLight*> added;
+        for (const auto& area : areas)
+        {
+            quad::PullResult<Entity> pull;
+            mQuadTree->retrieve(pull, { area.left, area.top, area.width, area.height });
+
+            auto addLight = [this, &area, &added] (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
+            {
+                if (!light.mLight.isActive())
+                    return;
+                //the area may be a single point, which FloatRect::intersects never reports as intersecting
+                sf::FloatRect bounds = lightTransf.getTransform().transformRect(light.mLight.getBoundingBox());
+                if (bounds.left > area.left + area.width || bounds.left + bounds.width < area.left ||
+                    bounds.top > area.top + area.height || bounds.top + bounds.height < area.top)
+                    return;
+                if (!added.insert(&light.mLight).second)
+                    return;
+                //the geometry is shared with the views that rendered the light this frame
+                std::shared_ptr<const ShadowGeometryCache::Entry> geometry = getGeometry(lightTransf, light, candidates);
+                if (geometry->sourceBlocked)
+                    return;
+                if (mShadowTechnique == ShadowTechnique::VisibilityPolygon)
+                    mRasterizer.addLight(light.mLight, lightTransf, geometry->colliders);
+                else
+                    mRasterizer.addLight(light.mLight, lightTransf, geometry->colliders, geometry->shadows, geometry->hidden);
+            };
+            visitLights(pull.getList(), addLight);
+        }
+    }
+
+    void LightSystem::enableReadback(unsigned ringSize, unsigned downsample)
+    {
+        mReadback.setup(ringSize, downsample);
+        mReadbackEnabled = true;
+    }
+
+    void LightSystem::disableReadback()
+    {
+        mReadbackEnabled = false;
+        mReadback.setup(0, 1);
+    }
+
+    void LightSystem::onReadback(const std::function<void(const std::vector<sf::Uint8>&, const sf::Vector2u&)>& callback)
+    {
+        mReadback.setCallback(callback);
+    }
+
+    const LightMapReadback& LightSystem::getReadback() const
+    {
+        return mReadback;
+    }
+
+    void LightSystem::initStaticLightMap(float chunkSize, unsigned resolution)
+    {
+        mStaticLightMap.setup(chunkSize, resolution);
+    }
+
+    void LightSystem::bakeStaticLights(const sf::FloatRect& rect)
+    {
+        mStaticLightMap.update(rect, std::numeric_limits<unsigned>::max(),
+            [this] (const sf::FloatRect& chunkRect, sf::RenderTexture& texture) { bakeStaticChunk(chunkRect, texture); });
+    }
+
+    bool LightSystem::saveStaticLightMap(const std::string& directory) const
+    {
+        return mStaticLightMap.save(directory);
+    }
+
+    bool LightSystem::loadStaticLightMap(const std::string& directory)
+    {
+        return mStaticLightMap.load(directory);
+    }
+
+    bool LightSystem::writeStaticLightMap(const std::string& path, LightMapFormat format) const
+    {
+        return mStaticLightMap.write(path, format);
+    }
+
+    bool LightSystem::streamStaticLightMap(const std::string& path, unsigned residentChunks)
+    {
+        if (mStaticLightMap.stream(path, residentChunks))
+            return true;
+        ungod::Logger::warning("Could not stream the light map " + path + "!");
+        ungod::Logger::endl();
+        return false;
+    }
+
+    void LightSystem::bakeStaticChunk(const sf::FloatRect& rect, sf::RenderTexture& texture)
+    {
+        if (mBakeLightTexture.getSize() != texture.getSize())
+        {
+            mBakeLightTexture.create(texture.getSize().x, texture.getSize().y);
+            mBakeAntumbraTexture.create(texture.getSize().x, texture.getSize().y);
+        }
+
+        quad::PullResult<Entity> pull;
+        mQuadTree->retrieve(pull, { rect.left, rect.top, rect.width, rect.height });
+
+        //the baked chunk is rendered exactly like the composition, but only with static lights and colliders
+        sf::View view = texture.getView();
+        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+        auto bakeLight = [this, &colliders, &view, &texture] (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
+        {
+            if (!light.mLight.isActive() || !light.mLight.isStatic())
+                return;
+            colliders.clear();
+            gatherColliders(lightTransf, light, candidates, colliders);
+            colliders.erase(std::remove_if(colliders.begin(), colliders.end(),
+                            [] (const std::pair<LightCollider*, Transform*>& c) { return !c.first->isStatic(); }), colliders.end());
+            if (light.mLight.isSourceBlocked(colliders, lightTransf))
+                return;
+            light.mLight.render(view, mBakeLightTexture, mContext.mEmissionTexture, mBakeAntumbraTexture,
+                                colliders, mContext.mUnshadowShader, mContext.mLightOverShapeShader, lightTransf, mMergeUmbras);
+            texture.setView(texture.getDefaultView());
+            texture.draw(sf::Sprite(mBakeLightTexture.getTexture()), sf::BlendAdd);
+            texture.setView(view);
+        };
+        //the light over shape shader addresses the target by pixel, so it has to match the bake target meanwhile
+        mContext.mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / texture.getSize().x, 1.0f / texture.getSize().y));
+        visitLights(pull.getList(), bakeLight);
+        sf::Vector2u imageSize = mContext.mCompositionTexture.getSize();
+        mContext.mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / imageSize.x, 1.0f / imageSize.y));
+    }
+
+    bool LightSystem::isBaked(const PointLight& light) const
+    {
+        return light.isStatic() && mStaticLightsComposed;
+    }
+
+    void LightSystem::initLightProbes(float cellSize, unsigned chunkCells)
+    {
+        mLightProbes.setup(cellSize, chunkCells);
+    }
+
+    void LightSystem::updateLightProbes(const sf::FloatRect& rect)
+    {
+        mLightProbes.update(rect, LIGHT_PROBE_CHUNK_BUDGET,
+            [this] (const sf::FloatRect& chunkRect, const std::vector<sf::Vector2f>& positions, std::vector<sf::Color>& colors)
+            {
+                computeLightProbes(chunkRect, positions, colors);
+            });
+    }
+
+    sf::Color LightSystem::sampleLightProbes(const sf::Vector2f& position) const
+    {
+        return mAmbientColor + mLightProbes.sample(position);
+    }
+
+    LightRasterizer& LightSystem::getRasterizer()
+    {
+        return mRasterizer;
+    }
+
+    void LightSystem::renderLight(sf::RenderTarget& target, sf::RenderStates states, Transform& lightTransf, LightEmitter& light,
+                                  ColliderCandidates& candidates)
+    {
+        if (isBaked(light.mLight))
+            return;
+
+        composeLight(mContext, target, states, light.mLight, lightTransf, *getGeometry(lightTransf, light, candidates), mAnimationTime,
+                     mShadowTechnique, mMergeUmbras);
+    }
+
+    std::shared_ptr<const ShadowGeometryCache::Entry> LightSystem::getGeometry(const Transform& lightTransf, const LightEmitter& light,
+                                                                               ColliderCandidates& candidates) const
+    {
+        //the geometry only depends on the transform of the light, so moved or scaled lights need no invalidation
+        return mGeometryCache.get(&light.mLight, lightTransf.getTransform() * light.mLight.mSprite.getTransform(),
+            [this, &lightTransf, &light, &candidates] (ShadowGeometryCache::Entry& entry)
+            {
+                gatherColliders(lightTransf, light, candidates, entry.colliders);
+                computeGeometry(light.mLight, lightTransf, entry, mShadowTechnique);
+            });
+    }
+
+    void LightSystem::computeGeometry(const PointLight& light, const Transform& lightTransf, ShadowGeometryCache::Entry& geometry,
+                                      ShadowTechnique technique) const
+    {
+        //a light that is emitted inside of a collider is blocked completely
+        geometry.sourceBlocked = light.isSourceBlocked(geometry.colliders, lightTransf);
+        geometry.shadows.clear();
+        geometry.hidden.clear();
+        if (!geometry.sourceBlocked && technique != ShadowTechnique::VisibilityPolygon)
+            light.computeShadowGeometry(geometry.colliders, lightTransf, geometry.shadows, geometry.hidden);
+    }
+
+    void LightSystem::composeLight(LightRenderContext& context, sf::RenderTarget& target, sf::RenderStates states, const PointLight& light,
+                                   const Transform& lightTransf, const ShadowGeometryCache::Entry& geometry, double time,
+                                   ShadowTechnique technique, bool mergeUmbras) const
+    {
+        if (geometry.sourceBlocked)
+            return;
+
+        if (technique == ShadowTechnique::VisibilityPolygon)
+        {
+            //render the light as a single visibility polygon
+            light.renderVisibility(target.getView(), context.mLightTexture, geometry.colliders,
+                                   context.mUnshadowShader, context.mLightOverShapeShader, lightTransf);
+        }
+        else
+        {
+            //render the light and the colliders, draw umbras, penumbras + antumbras
+            light.renderShadows(target.getView(), context.mLightTexture, context.mEmissionTexture, context.mAntumbraTexture,
+                                geometry.colliders, geometry.shadows, geometry.hidden,
+                                context.mUnshadowShader, context.mLightOverShapeShader, lightTransf, mergeUmbras);
+        }
+
+        //draw the resulting texture in the application window
+        sf::RenderStates compoRenderStates = states;
+        compoRenderStates.blendMode = sf::BlendAdd;
+        context.mDisplaySprite.setTexture(context.mLightTexture.getTexture(), true);
+        if (light.isAnimated())
+        {
+            sf::Vector2f center = lightTransf.getTransform().transformPoint(light.getCastCenter());
+            setAnimationUniforms(context.mLightAnimationShader, light,
+                                 sf::Vector2f(context.mCompositionTexture.mapCoordsToPixel(center, target.getView())), time);
+            compoRenderStates.shader = &context.mLightAnimationShader;
+        }
+        context.mCompositionTexture.draw(context.mDisplaySprite, compoRenderStates);
+    }
+
+    void LightSystem::gatherColliders(const Transform& lightTransf, const LightEmitter& light,
+                                      std::vector< std::pair<LightCollider*, Transform*> >& colliders) const
+    {
+        ColliderCandidates candidates(lightTransf.getTransform().transformRect(light.mLight.getBoundingBox()));
+        gatherColliders(lightTransf, light, candidates, colliders);
+    }
+
+    void LightSystem::gatherColliders(const Transform& lightTransf, const LightEmitter& light, ColliderCandidates& candidates,
+                                      std::vector< std::pair<LightCollider*, Transform*> >& colliders) const
+    {
+        gatherCandidates(candidates);
+
+        //test if the collider is "in range" of the light. Do not render penumbras otherwise
+        sf::FloatRect lightBounds = lightTransf.getTransform().transformRect(light.mLight.getBoundingBox());
+        for (std::size_t i = 0; i < candidates.colliders.size(); ++i)
+            if (candidates.colliderBounds[i].intersects(lightBounds))
+                colliders.push_back(candidates.colliders[i]);
+    }
+
+    void LightSystem::gatherCandidates(ColliderCandidates& candidates) const
+    {
+        if (candidates.gathered)
+            return;
+        candidates.gathered = true;
+
+        //pull all entities near the lights
+        quad::PullResult<Entity> shadowsPull;
+        const sf::FloatRect& bounds = candidates.bounds;
+        mQuadTree->retrieve(shadowsPull, { bounds.left, bounds.top, bounds.width, bounds.height });
+
+        //keep the light-colliders that are in range of any of the lights
+        auto addCollider = [&candidates] (LightCollider& collider, Transform& colliderTransf)
+        {
+            sf::FloatRect colliderBounds = colliderTransf.getTransform().transformRect(collider.getBoundingBox());
+            if (colliderBounds.intersects(candidates.bounds))
+            {
+                candidates.colliders.emplace_back(&collider, &colliderTransf);
+                candidates.colliderBounds.push_back(colliderBounds);
+            }
+        };
+        dom::Utility<Entity>::iterate<Transform, ShadowEmitter>(shadowsPull.getList(),
+          [&addCollider] (Entity e, Transform& colliderTransf, ShadowEmitter& shadow)
+          {
+              addCollider(shadow.mLightCollider, colliderTransf);
+          });
+        dom::Utility<Entity>::iterate<Transform, MultiShadowEmitter>(shadowsPull.getList(),
+          [&addCollider] (Entity e, Transform& colliderTransf, MultiShadowEmitter& shadow)
+          {
+              for (std::size_t i = 0; i < shadow.getComponentCount(); ++i)
+                  addCollider(shadow.getComponent(i).mLightCollider, colliderTransf);
+          });
+    }
+
+    void LightSystem::clusterLights(const Transform& lightTransf, const MultiLightEmitter& light,
+                                    std::vector<ColliderCandidates>& clusters, std::vector<std::size_t>& clusterOf) const
+    {
+        //lights join a cluster as long as its union bounds stay close to the area the lights cover themselves
+        clusters.clear();
+        clusterOf.assign(light.getComponentCount(), 0);
+        std::vector<float> areas;
+        for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+        {
+            const PointLight& pointLight = light.getComponent(i).mLight;
+            sf::FloatRect bounds = lightTransf.getTransform().transformRect(pointLight.getBoundingBox());
+            float area = bounds.width * bounds.height;
+            std::size_t c = 0;
+            if (pointLight.isActive())
+            {
+                for (; c < clusters.size(); ++c)
+                {
+                    sf::FloatRect merged = clusters[c].bounds;
+                    float right = std::max(merged.left + merged.width, bounds.left + bounds.width);
+                    float bottom = std::max(merged.top + merged.height, bounds.top + bounds.height);
+                    merged.left = std::min(merged.left, bounds.left);
+                    merged.top = std::min(merged.top, bounds.top);
+                    merged.width = right - merged.left;
+                    merged.height = bottom - merged.top;
+                    if (areas[c] >= 0.0f && merged.width * merged.height <= LIGHT_CLUSTER_AREA_RATIO * (areas[c] + area))
+                    {
+                        clusters[c].bounds = merged;
+                        areas[c] += area;
+                        break;
+                    }
+                }
+            }
+            else
+                c = clusters.size();
+            if (c == clusters.size())
+            {
+                //inactive lights get a cluster of their own, that is never joined
+                clusters.emplace_back(bounds);
+                areas.push_back(pointLight.isActive() ? area : -1.0f);
+            }
+            clusterOf[i] = c;
+        }
+    }
+
+    void LightSystem::visitLights(const std::list<Entity>& entities,
+                                  const std::function<void(Transform&, LightEmitter&, ColliderCandidates&)>& visit) const
+    {
+        dom::Utility<Entity>::iterate<Transform, LightEmitter>(entities,
+          [&visit] (Entity e, Transform& lightTransf, LightEmitter& light)
+          {
+              ColliderCandidates candidates(lightTransf.getTransform().transformRect(light.mLight.getBoundingBox()));
+              visit(lightTransf, light, candidates);
+          });
+
+        //the colliders of a cluster are only retrieved once one of its lights asks for them
+        std::vector<ColliderCandidates> clusters;
+        std::vector<std::size_t> clusterOf;
+        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(entities,
+          [this, &visit, &clusters, &clusterOf] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
+          {
+              clusterLights(lightTransf, light, clusters, clusterOf);
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  visit(lightTransf, light.getComponent(i), clusters[clusterOf[i]]);
+          });
+    }
+
+    void LightSystem::renderScheduled(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states)
+    {
+        sf::View view = target.getView();
+        sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+        float pixelsPerUnit = mContext.mCompositionTexture.getSize().x / view.getSize().x;
+
+        //register the visible lights, colliders are only gathered for the lights that are re-rendered
+        std::vector< std::pair<const Transform*, const LightEmitter*> > lights;
+        auto addLight = [this, &lights, pixelsPerUnit] (Transform& lightTransf, LightEmitter& light)
+        {
+            if (!light.mLight.isActive() || isBaked(light.mLight))
+                return;
+            sf::FloatRect bounds = lightTransf.getTransform().transformRect(light.mLight.getBoundingBox());
+            mShadowScheduler.addLight(&light.mLight, bounds,
+                                      ShadowScheduler::getMaskSize(std::max(bounds.width, bounds.height) * pixelsPerUnit));
+            lights.emplace_back(&lightTransf, &light);
+        };
+        dom::Utility<Entity>::iterate<Transform, LightEmitter>(pull.getList(),
+          [&addLight] (Entity e, Transform& lightTransf, LightEmitter& light)
+          {
+              addLight(lightTransf, light);
+          });
+        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(pull.getList(),
+          [&addLight] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
+          {
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  addLight(lightTransf, light.getComponent(i));
+          });
+
+        mShadowScheduler.schedule(viewRect);
+
+        sf::RenderStates compoRenderStates = states;
+        compoRenderStates.blendMode = sf::BlendAdd;
+        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+        mContext.mCompositionTexture.setView(view);
+        for (std::size_t i = 0; i < lights.size(); ++i)
+        {
+            sf::RenderTexture& mask = mShadowScheduler.getMask(i);
+            const sf::FloatRect& bounds = mShadowScheduler.getMaskBounds(i);
+            if (mShadowScheduler.isScheduled(i))
+            {
+                const Transform& lightTransf = *lights[i].first;
+                const PointLight& light = lights[i].second->mLight;
+                colliders.clear();
+                gatherColliders(lightTransf, *lights[i].second, colliders);
+
+                //masks are rendered in world space, so that they stay valid while the camera moves
+                sf::View maskView(bounds);
+                //the light over shape shader addresses the mask by pixel, so target size and emission have to match it
+                sf::RenderTexture& emission = mShadowScheduler.getScratch(mask.getSize().x, 1);
+                mContext.mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / mask.getSize().x, 1.0f / mask.getSize().y));
+                mContext.mLightOverShapeShader.setUniform("emissionTexture", emission.getTexture());
+                if (light.isSourceBlocked(colliders, lightTransf))
+                {
+                    mask.clear(sf::Color::Black);
+                    mask.display();
+                }
+                else if (mShadowTechnique == ShadowTechnique::VisibilityPolygon)
+                    light.renderVisibility(maskView, mask, colliders, mContext.mUnshadowShader, mContext.mLightOverShapeShader, lightTransf);
+                else
+                    light.render(maskView, mask, emission, mShadowScheduler.getScratch(mask.getSize().x),
+                                 colliders, mContext.mUnshadowShader, mContext.mLightOverShapeShader, lightTransf, mMergeUmbras);
+            }
+            sf::Sprite sprite(mask.getTexture());
+            sprite.setPosition(bounds.left, bounds.top);
+            sprite.setScale(bounds.width / mask.getSize().x, bounds.height / mask.getSize().y);
+            //animations are applied while composing, so they do not outdate the mask
+            sf::RenderStates maskStates = compoRenderStates;
+            const PointLight& light = lights[i].second->mLight;
+            if (light.isAnimated())
+            {
+                sf::Vector2f center = lights[i].first->getTransform().transformPoint(light.getCastCenter());
+                setAnimationUniforms(mContext.mLightAnimationShader, light, sprite.getInverseTransform().transformPoint(center), mAnimationTime);
+                maskStates.shader = &mContext.mLightAnimationShader;
+            }
+            mContext.mCompositionTexture.draw(sprite, maskStates);
+        }
+        mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+        sf::Vector2u imageSize = mContext.mCompositionTexture.getSize();
+        mContext.mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / imageSize.x, 1.0f / imageSize.y));
+        mContext.mLightOverShapeShader.setUniform("emissionTexture", mContext.mEmissionTexture.getTexture());
+
+        mShadowScheduler.endFrame();
+    }
+
+    void LightSystem::renderDistanceField(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states)
+    {
+        //the field covers twice the view, so that occluders next to the screen still cast shadows onto it
+        sf::View view = target.getView();
+        sf::FloatRect viewRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+        sf::FloatRect fieldRect(view.getCenter() - view.getSize(), view.getSize() * 2.0f);
+        mDistanceField.update(fieldRect, *mQuadTree, DISTANCE_FIELD_CHUNK_BUDGET);
+
+        if (mDistanceFieldTexture.getSize() != mContext.mLightTexture.getSize())
+        {
+            mDistanceFieldTexture.create(mContext.mLightTexture.getSize().x, mContext.mLightTexture.getSize().y);
+            mDistanceFieldTexture.setSmooth(true);
+        }
+        mDistanceFieldTexture.setView(sf::View(fieldRect));
+        mDistanceFieldTexture.clear(sf::Color::White);
+        mDistanceField.render(mDistanceFieldTexture, fieldRect);
+        mDistanceFieldTexture.display();
+
+        //collect the parameters of all lights
+        std::vector<sf::Glsl::Vec2> positions;
+        std::vector<sf::Glsl::Vec4> colors;
+        std::vector<float> radii;
+        std::vector<float> sourceRadii;
+        auto addLight = [this, &positions, &colors, &radii, &sourceRadii] (const Transform& transf, const LightEmitter& light)
+        {
+            if (!light.mLight.isActive() || isBaked(light.mLight))
+                return;
+            sf::FloatRect bounds = transf.getTransform().transformRect(light.mLight.getBoundingBox());
+            positions.push_back(transf.getTransform().transformPoint(light.mLight.getCastCenter()));
+            colors.push_back(sf::Glsl::Vec4(light.mLight.getColor()));
+            radii.push_back(0.5f * std::max(bounds.width, bounds.height));
+            sourceRadii.push_back(std::max(light.mLight.mRadius, 1.0f));
+        };
+
+        dom::Utility<Entity>::iterate<Transform, LightEmitter>(pull.getList(),
+          [&addLight] (Entity e, Transform& lightTransf, LightEmitter& light)
+          {
+              addLight(lightTransf, light);
+          });
+
+        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(pull.getList(),
+          [&addLight] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
+          {
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  addLight(lightTransf, light.getComponent(i));
+          });
+
+        mDistanceFieldShader.setUniform("distanceField", mDistanceFieldTexture.getTexture());
+        mDistanceFieldShader.setUniform("fieldOrigin", sf::Glsl::Vec2(fieldRect.left, fieldRect.top));
+        mDistanceFieldShader.setUniform("fieldSizeInv", sf::Glsl::Vec2(1.0f / fieldRect.width, 1.0f / fieldRect.height));
+
+        //a screen filling quad in world coordinates, every pass composes a batch of lights
+        sf::Vertex quad[4] = { sf::Vertex({ viewRect.left, viewRect.top }),
+                               sf::Vertex({ viewRect.left + viewRect.width, viewRect.top }),
+                               sf::Vertex({ viewRect.left, viewRect.top + viewRect.height }),
+                               sf::Vertex({ viewRect.left + viewRect.width, viewRect.top + viewRect.height }) };
+        sf::RenderStates lightStates;
+        lightStates.blendMode = sf::BlendAdd;
+        lightStates.shader = &mDistanceFieldShader;
+
+        mContext.mCompositionTexture.setView(view);
+        for (std::size_t first = 0; first < positions.size(); first += DISTANCE_FIELD_LIGHTS)
+        {
+            std::size_t count = std::min<std::size_t>(DISTANCE_FIELD_LIGHTS, positions.size() - first);
+            mDistanceFieldShader.setUniform("lightCount", (int)count);
+            mDistanceFieldShader.setUniformArray("lightPositions", &positions[first], count);
+            mDistanceFieldShader.setUniformArray("lightColors", &colors[first], count);
+            mDistanceFieldShader.setUniformArray("lightRadii", &radii[first], count);
+            mDistanceFieldShader.setUniformArray("sourceRadii", &sourceRadii[first], count);
+            mContext.mCompositionTexture.draw(quad, 4, sf::TriangleStrip, lightStates);
+        }
+        mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+        mContext.mCompositionTexture.display();
+    }
+
+    void LightSystem::renderShadowMaps(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states)
+    {
+        std::vector< std::pair<Transform*, LightEmitter*> > lights;
+        dom::Utility<Entity>::iterate<Transform, LightEmitter>(pull.getList(),
+          [this, &lights] (Entity e, Transform& lightTransf, LightEmitter& light)
+          {
+              if (light.mLight.isActive() && !isBaked(light.mLight))
+                  lights.emplace_back(&lightTransf, &light);
+          });
+        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(pull.getList(),
+          [this, &lights] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
+          {
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  if (light.getComponent(i).mLight.isActive() && !isBaked(light.getComponent(i).mLight))
+                      lights.emplace_back(&lightTransf, &light.getComponent(i));
+          });
+        if (lights.empty())
+            return;
+
+        //one row per light in a shared atlas, that is uploaded once per frame
+        unsigned rows = 16;
+        while (rows < lights.size())
+            rows *= 2;
+        if (mShadowMapAtlas.getSize() != sf::Vector2u(SHADOW_MAP_RESOLUTION, rows))
+        {
+            mShadowMapAtlas.create(SHADOW_MAP_RESOLUTION, rows);
+            mShadowMapAtlas.setRepeated(true);
+            mShadowMapAtlas.setSmooth(false);
+        }
+        mShadowMapPixels.assign(4 * SHADOW_MAP_RESOLUTION * rows, 0);
+
+        std::vector<float> radii(lights.size(), 0.0f);
+        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+        for (std::size_t i = 0; i < lights.size(); ++i)
+        {
+            colliders.clear();
+            gatherColliders(*lights[i].first, *lights[i].second, colliders);
+            if (lights[i].second->mLight.isSourceBlocked(colliders, *lights[i].first))
+                continue;
+            radii[i] = lights[i].second->mLight.computeShadowMap(colliders, *lights[i].first,
+                                                                   &mShadowMapPixels[4 * SHADOW_MAP_RESOLUTION * i], SHADOW_MAP_RESOLUTION);
+        }
+        mShadowMapAtlas.update(mShadowMapPixels.data());
+
+        //draw every light directly into the composition, shadowed by a lookup into its row
+        sf::RenderStates lightStates;
+        lightStates.blendMode = sf::BlendAdd;
+        lightStates.shader = &mShadowMapShader;
+        mShadowMapShader.setUniform("shadowMap", mShadowMapAtlas);
+        mContext.mCompositionTexture.setView(target.getView());
+        for (std::size_t i = 0; i < lights.size(); ++i)
         {
-            light.mLight.mSprite.setScale( light.mLight.mSprite.getScale().x - scale,
-                                           light.mLight.mSprite.getScale().y - scale );
-            mSizeMemorizer -= scale;
-            if (mSizeMemorizer <= -mStrength*mPeriod || mTimer.getElapsedTime().asMilliseconds() > mPeriod)
+            const PointLight& light = lights[i].second->mLight;
+            if (radii[i] == 0.0f || !light.mSprite.getTexture())
+                continue;
+            sf::Transform lightTransform = lights[i].first->getTransform() * light.mSprite.getTransform();
+            sf::FloatRect local = light.mSprite.getLocalBounds();
+            sf::FloatRect texRect(light.mSprite.getTextureRect());
+            sf::Vertex quad[4];
+            for (unsigned c = 0; c < 4; ++c)
             {
-                mTimer.restart();
-                mDirection = true;
-                mPeriod = NumberGenerator::getFloatRandBetw(0.5f,1.0f)*mBasePeriod;
+                sf::Vector2f corner((c % 2) ? local.width : 0.0f, (c / 2) ? local.height : 0.0f);
+                quad[c] = sf::Vertex(lightTransform.transformPoint(corner), light.getColor(),
+                                     { texRect.left + ((c % 2) ? texRect.width : 0.0f), texRect.top + ((c / 2) ? texRect.height : 0.0f) });
             }
+            mShadowMapShader.setUniform("row", (i + 0.5f) / rows);
+            mShadowMapShader.setUniform("lightCenter", sf::Glsl::Vec2(lights[i].first->getTransform().transformPoint(light.getCastCenter())));
+            mShadowMapShader.setUniform("lightRadius", radii[i]);
+            //the filter kernel covers roughly the angle of the light source as seen from the edge of the light
+            mShadowMapShader.setUniform("pcfStep", 0.25f * light.mRadius / (radii[i] * 2.0f * PI));
+            lightStates.texture = light.mSprite.getTexture();
+            mContext.mCompositionTexture.draw(quad, 4, sf::TriangleStrip, lightStates);
         }
+        mContext.mCompositionTexture.setView(mContext.mCompositionTexture.getDefaultView());
+        mContext.mCompositionTexture.display();
     }
 
-
-    LightSystem::LightSystem() : mQuadTree(nullptr), mAmbientColor(sf::Color::White), mColorShift(0,0,0) {}
-
-    void LightSystem::init(quad::QuadTree<Entity>* quadtree,
-              const sf::Vector2u &imageSize,
-              const std::string& unshadowVertex,
-              const std::string& unshadowFragment,
-              const std::string& lightOverShapeVertex,
-              const std::string& lightOverShapeFragment,
-              const std::string& penumbraTexture)
+    void LightSystem::invalidateCollider(Entity e, const LightCollider& collider)
     {
-        mQuadTree = quadtree;
+        //a changed collider may cast shadows of any light
+        mGeometryCache.invalidate();
+        sf::FloatRect bounds = collider.getBoundingBox();
+        if (e.has<Transform>())
+            bounds = e.get<Transform>().getTransform().transformRect(bounds);
+
+        //every light that overlaps the collider has to update its shadows
+        mShadowScheduler.invalidate(bounds);
+
+        if (!collider.isStatic())
+            return;
+        mDistanceField.invalidate(bounds);
+
+        //the shadow of the collider may reach everything the static lights it overlaps illuminate
+        if ((!mLightProbes.isSetup() && !mStaticLightMap.isSetup()) || !mQuadTree)
+            return;
+        quad::PullResult<Entity> pull;
+        mQuadTree->retrieve(pull, { bounds.left, bounds.top, bounds.width, bounds.height });
+        auto invalidate = [this, &bounds] (const Transform& lightTransf, const PointLight& light)
+        {
+            sf::FloatRect lightBounds = lightTransf.getTransform().transformRect(light.getBoundingBox());
+            if (light.isStatic() && lightBounds.intersects(bounds))
+            {
+                mLightProbes.invalidate(lightBounds);
+                mStaticLightMap.invalidate(lightBounds);
+            }
+        };
+        dom::Utility<Entity>::iterate<Transform, LightEmitter>(pull.getList(),
+          [&invalidate] (Entity e, Transform& lightTransf, LightEmitter& light)
+          {
+              invalidate(lightTransf, light.mLight);
+          });
+        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(pull.getList(),
+          [&invalidate] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
+          {
+              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
+                  invalidate(lightTransf, light.getComponent(i).mLight);
+          });
+    }
 
-        mUnshadowShader.loadFromFile(unshadowVertex, unshadowFragment);
-        mLightOverShapeShader.loadFromFile(lightOverShapeVertex, lightOverShapeFragment);
+    void LightSystem::invalidateLight(Entity e, const PointLight& light)
+    {
+        invalidateLight(e, light, light.getBoundingBox());
+    }
 
-        setImageSize(imageSize);
+    void LightSystem::invalidateLight(Entity e, const PointLight& light, sf::FloatRect bounds)
+    {
+        mShadowScheduler.invalidate(&light);
+        if (!light.isStatic() || (!mLightProbes.isSetup() && !mStaticLightMap.isSetup()))
+            return;
+        if (e.has<Transform>())
+            bounds = e.get<Transform>().getTransform().transformRect(bounds);
+        mLightProbes.invalidate(bounds);
+        mStaticLightMap.invalidate(bounds);
+    }
 
-        mPenumbraTexture.load(penumbraTexture);
+    void LightSystem::computeLightProbes(const sf::FloatRect& rect, const std::vector<sf::Vector2f>& positions, std::vector<sf::Color>& colors)
+    {
+        quad::PullResult<Entity> pull;
+        mQuadTree->retrieve(pull, { rect.left, rect.top, rect.width, rect.height });
 
-        if (mPenumbraTexture.isLoaded())
-        {
-            mPenumbraTexture.get()->setSmooth(true);
-            mUnshadowShader.setUniform("penumbraTexture", *mPenumbraTexture.get());
-        }
-        else
+        //only static lights occluded by static colliders, so the probes stay valid until one of them changes
+        mProbeRasterizer.clear();
+        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+        auto addLight = [this, &colliders] (Transform& lightTransf, LightEmitter& light, ColliderCandidates& candidates)
         {
-            ungod::Logger::warning("No valid penumbra texture loaded!");
-            ungod::Logger::endl();
-        }
+            if (!light.mLight.isActive() || !light.mLight.isStatic())
+                return;
+            colliders.clear();
+            gatherColliders(lightTransf, light, candidates, colliders);
+            colliders.erase(std::remove_if(colliders.begin(), colliders.end(),
+                            [] (const std::pair<LightCollider*, Transform*>& c) { return !c.first->isStatic(); }), colliders.end());
+            if (!light.mLight.isSourceBlocked(colliders, lightTransf))
+                mProbeRasterizer.addLight(light.mLight, lightTransf, colliders);
+        };
+        visitLights(pull.getList(), addLight);
 
-        mLightOverShapeShader.setUniform("emissionTexture", mEmissionTexture.getTexture());
+        mProbeRasterizer.sample(positions, colors, sf::Color::Black);
     }
 
-    void LightSystem::setImageSize(const sf::Vector2u &imageSize)
+    namespace
     {
-        mLightTexture.create(imageSize.x, imageSize.y);
-        mEmissionTexture.create(imageSize.x, imageSize.y);
-        mAntumbraTexture.create(imageSize.x, imageSize.y);
-        mCompositionTexture.create(imageSize.x, imageSize.y);
-        mLightOverShapeShader.setUniform("targetSizeInv", sf::Vector2f(1.0f / imageSize.x, 1.0f / imageSize.y));
+        /** \brief Applies the updates of a batch grouped by component type, the LightEmitters first. */
+        template<typename T, typename F>
+        void forEachLightUpdate(const std::vector< LightUpdate<T> >& updates, F apply)
+        {
+            for (const auto& update : updates)
+                if (update.index == LightUpdate<T>::NO_INDEX)
+                {
+                    Entity e = update.entity;
+                    apply(update, e.modify<LightEmitter>().getLight());
+                }
+            for (const auto& update : updates)
+                if (update.index != LightUpdate<T>::NO_INDEX)
+                {
+                    Entity e = update.entity;
+                    apply(update, e.modify<MultiLightEmitter>().getComponent(update.index).getLight());
+                }
+        }
     }
 
-    void LightSystem::render(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states)
+    void LightSystem::update(const std::list<Entity>& entities, float delta)
     {
-        mCompositionTexture.clear(mAmbientColor);
-        mCompositionTexture.setView(mCompositionTexture.getDefaultView());
-        mCompositionTexture.display();
+        //colliders may have moved with their entities without notice, so geometry is only shared within a frame
+        mGeometryCache.invalidate();
 
-        //iterator over the one-light-components
-        dom::Utility<Entity>::iterate<Transform, LightEmitter>(pull.getList(),
-          [this, &target, &states] (Entity e, Transform& lightTransf, LightEmitter& light)
-          {
-              renderLight(target, states, e, lightTransf, light);
-          });
+        updateAffectors(entities, delta);
 
-        //iterate over the multiple-light-components
-        dom::Utility<Entity>::iterate<Transform, MultiLightEmitter>(pull.getList(),
-          [this, &target, &states] (Entity e, Transform& lightTransf, MultiLightEmitter& light)
-          {
-              for (std::size_t i = 0; i < light.getComponentCount(); ++i)
-              {
-                renderLight(target, states, e, lightTransf, light.getComponent(i));
-              }
-          });
+        updateTracks(entities, delta);
 
-		states.blendMode = sf::BlendMultiply;
+        //flickering writes the scales directly, only lights that left their quadtree bounds are notified
+        //and only static lights may outdate baked lighting
+        std::vector< LightUpdate<sf::FloatRect> > outgrown;
+        std::vector< LightUpdate<sf::FloatRect> > statics;
+        mFlicker.update(delta, outgrown, statics);
+        forEachLightUpdate(statics, [this] (const LightUpdate<sf::FloatRect>& update, PointLight& light)
+        {
+            invalidateLight(update.entity, light, update.value);
+        });
+        for (const auto& update : outgrown)
+            notifyContentsChanged(update.entity, static_cast<sf::IntRect>(update.value));
+        mAnimationTime += delta;
 
-		mDisplaySprite.setTexture(mCompositionTexture.getTexture(), true);
-		sf::View view = target.getView();
-		target.setView(target.getDefaultView());
-		target.draw(mDisplaySprite, states);
-		target.setView(view);
+        if (mDeferNotifications)
+            flushContentsChanged();
     }
 
+    void LightSystem::enableShadowScheduler(unsigned budget, unsigned maxStaleness)
+    {
+        mShadowScheduler.setup(std::max(1u, budget), maxStaleness);
+    }
 
-    void LightSystem::renderLight(sf::RenderTarget& target, sf::RenderStates states, Entity e, Transform& lightTransf, LightEmitter& light)
+    void LightSystem::disableShadowScheduler()
     {
-        //pull all entities near the light
-        quad::PullResult<Entity> shadowsPull;
-        sf::FloatRect bounds = light.mLight.getBoundingBox();
-        sf::Vector2f transformedUpperBound = lightTransf.getTransform().transformPoint( {bounds.left, bounds.top} );
-        mQuadTree->retrieve(shadowsPull, { transformedUpperBound.x, transformedUpperBound.y, bounds.width, bounds.height });
+        mShadowScheduler.setup(0, 0);
+    }
 
-        std::vector< std::pair<LightCollider*, Transform*> > colliders;
+    void LightSystem::setUmbraMerging(bool merge)
+    {
+        mMergeUmbras = merge;
+    }
 
-        //find the entities with light-colliders that are on the screen
-        dom::Utility<Entity>::iterate<Transform, ShadowEmitter>(shadowsPull.getList(),
-        [this, &colliders, &light, &lightTransf] (Entity e, Transform& colliderTransf, ShadowEmitter& shadow)
-        {
-            sf::FloatRect colliderBounds = colliderTransf.getTransform().transformRect( shadow.mLightCollider.getBoundingBox() );
-            sf::FloatRect lightBounds = lightTransf.getTransform().transformRect( light.mLight.getBoundingBox() );
-            //test if the collider is "in range" of the light. Do not render penumbras otherwise
-            if ( colliderBounds.intersects(lightBounds) )
-                colliders.emplace_back( &shadow.mLightCollider, &colliderTransf );
-        });
+    bool LightSystem::getUmbraMerging() const
+    {
+        return mMergeUmbras;
+    }
 
-        dom::Utility<Entity>::iterate<Transform, MultiShadowEmitter>(shadowsPull.getList(),
-        [this, &colliders, &light, &lightTransf] (Entity e, Transform& colliderTransf, MultiShadowEmitter& shadow)
+    void LightSystem::initDistanceField(float chunkSize, unsigned resolution, float maxDistance)
+    {
+        if (!mDistanceFieldShader.loadFromMemory(DISTANCE_FIELD_VERTEX_SHADER, DISTANCE_FIELD_FRAGMENT_SHADER))
         {
-            for (std::size_t i = 0; i < shadow.getComponentCount(); ++i)
-            {
-                sf::FloatRect colliderBounds = colliderTransf.getTransform().transformRect( shadow.getComponent(i).mLightCollider.getBoundingBox() );
-                sf::FloatRect lightBounds = lightTransf.getTransform().transformRect( light.mLight.getBoundingBox() );
-                //test if the collider is "in range" of the light. Do not render penumbras otherwise
-                if ( colliderBounds.intersects(lightBounds) )
-                    colliders.emplace_back( &shadow.getComponent(i).mLightCollider, &colliderTransf );
-            }
-        });
-
-        //render the light and the colliders, draw umbras, penumbras + antumbras
-        light.mLight.render(target.getView(), mLightTexture, mEmissionTexture, mAntumbraTexture,
-                            colliders, mUnshadowShader, mLightOverShapeShader, lightTransf);
+            ungod::Logger::warning("Could not compile the distance field shader!");
+            ungod::Logger::endl();
+            return;
+        }
+        mDistanceField.setup(chunkSize, resolution, maxDistance);
+        mDistanceFieldShader.setUniform("maxDistance", maxDistance);
+    }
 
-        //draw the resulting texture in the application window
-        sf::RenderStates compoRenderStates = states;
-        compoRenderStates.blendMode = sf::BlendAdd;
-        mDisplaySprite.setTexture(mLightTexture.getTexture(), true);
-        mCompositionTexture.draw(mDisplaySprite, compoRenderStates);
+    void LightSystem::setShadowTechnique(ShadowTechnique technique)
+    {
+        mShadowTechnique = technique;
     }
 
-    void LightSystem::update(const std::list<Entity>& entities, float delta)
+    ShadowTechnique LightSystem::getShadowTechnique() const
     {
-        //iterate over LightAffectors
-        dom::Utility<Entity>::iterate<LightAffector>(entities,
-          [delta, this] (Entity e, LightAffector& affector)
-          {
-              if (affector.isActive() && affector.mCallback)
-                affector.mCallback( delta, *affector.mEmitter );
-          });
-        //iterate over MultilightLightAffectors
-        dom::Utility<Entity>::iterate<MultiLightAffector>(entities,
-          [delta, this] (Entity e, MultiLightAffector& affector)
-          {
-              for (std::size_t i = 0; i < affector.getComponentCount(); ++i)
-              {
-                  if (affector.getComponent(i).isActive() && affector.getComponent(i).mCallback)
-                    affector.getComponent(i).mCallback( delta, *affector.getComponent(i).mEmitter );
-              }
-          });
+        return mShadowTechnique;
     }
 
     void LightSystem::setAmbientColor(const sf::Color& color)
@@ -911,72 +5449,439 @@ namespace ungod
     void LightSystem::setLocalLightPosition(Entity e, const sf::Vector2f& position)
     {
         LightEmitter& emitter = e.modify<LightEmitter>();
+        invalidateLight(e, emitter.mLight);
         emitter.mLight.mSprite.setPosition(position);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(emitter.mLight.getBoundingBox()));
+        invalidateLight(e, emitter.mLight);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(emitter.mLight.getBoundingBox()));
     }
 
     void LightSystem::setLocalLightPosition(Entity e, const sf::Vector2f& position, std::size_t index)
     {
         MultiLightEmitter& multi = e.modify<MultiLightEmitter>();
+        invalidateLight(e, multi.getComponent(index).mLight);
         multi.getComponent(index).mLight.mSprite.setPosition(position);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(multi.getComponent(index).mLight.getBoundingBox()));
+        invalidateLight(e, multi.getComponent(index).mLight);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(multi.getComponent(index).mLight.getBoundingBox()));
     }
 
     void LightSystem::setLightScale(Entity e, const sf::Vector2f& scale)
     {
         LightEmitter& emitter = e.modify<LightEmitter>();
+        invalidateLight(e, emitter.mLight);
         emitter.mLight.mSprite.setScale(scale);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(emitter.mLight.getBoundingBox()));
+        invalidateLight(e, emitter.mLight);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(emitter.mLight.getBoundingBox()));
     }
 
     void LightSystem::setLightScale(Entity e, const sf::Vector2f& scale, std::size_t index)
     {
         MultiLightEmitter& multi = e.modify<MultiLightEmitter>();
+        invalidateLight(e, multi.getComponent(index).mLight);
         multi.getComponent(index).mLight.mSprite.setScale(scale);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(multi.getComponent(index).mLight.getBoundingBox()));
+        invalidateLight(e, multi.getComponent(index).mLight);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(multi.getComponent(index).mLight.getBoundingBox()));
     }
 
     void LightSystem::setLightColor(Entity e, const sf::Color& color)
     {
         LightEmitter& emitter = e.modify<LightEmitter>();
         emitter.mLight.mSprite.setColor(color);
+        invalidateLight(e, emitter.mLight);
     }
 
     void LightSystem::setLightColor(Entity e, const sf::Color& color, std::size_t index)
     {
         MultiLightEmitter& multi = e.modify<MultiLightEmitter>();
         multi.getComponent(index).mLight.setColor(color);
+        invalidateLight(e, multi.getComponent(index).mLight);
     }
 
     void LightSystem::setPoint(Entity e, const sf::Vector2f& point, std::size_t i)
     {
-        e.modify<ShadowEmitter>().mLightCollider.setPoint(i, point);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(e.get<ShadowEmitter>().mLightCollider.getBoundingBox()));
+        ShadowEmitter& shadow = e.modify<ShadowEmitter>();
+        invalidateCollider(e, shadow.mLightCollider);
+        shadow.mLightCollider.setPoint(i, point);
+        invalidateCollider(e, shadow.mLightCollider);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(shadow.mLightCollider.getBoundingBox()));
     }
 
     void LightSystem::setPoint(Entity e, const sf::Vector2f& point, std::size_t pointIndex, std::size_t colliderIndex)
     {
         MultiShadowEmitter& multi = e.modify<MultiShadowEmitter>();
+        invalidateCollider(e, multi.getComponent(colliderIndex).mLightCollider);
         multi.getComponent(colliderIndex).mLightCollider.setPoint(pointIndex, point);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(multi.getComponent(colliderIndex).mLightCollider.getBoundingBox()));
+        invalidateCollider(e, multi.getComponent(colliderIndex).mLightCollider);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(multi.getComponent(colliderIndex).mLightCollider.getBoundingBox()));
     }
 
     void LightSystem::setPoints(Entity e, const std::vector<sf::Vector2f>& points)
     {
         ShadowEmitter& shadow = e.modify<ShadowEmitter>();
+        invalidateCollider(e, shadow.mLightCollider);
         shadow.mLightCollider.setPointCount(points.size());
         for (std::size_t i = 0; i < points.size(); ++i)
             shadow.mLightCollider.setPoint(i, points[i]);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(shadow.mLightCollider.getBoundingBox()));
+        invalidateCollider(e, shadow.mLightCollider);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(shadow.mLightCollider.getBoundingBox()));
     }
 
     void LightSystem::setPoints(Entity e, const std::vector<sf::Vector2f>& points, std::size_t colliderIndex)
     {
         MultiShadowEmitter& multi = e.modify<MultiShadowEmitter>();
+        invalidateCollider(e, multi.getComponent(colliderIndex).mLightCollider);
         multi.getComponent(colliderIndex).mLightCollider.setPointCount(points.size());
         for (std::size_t i = 0; i < points.size(); ++i)
             multi.getComponent(colliderIndex).mLightCollider.setPoint(i, points[i]);
-        mContentsChangedSignal(e, static_cast<sf::IntRect>(multi.getComponent(colliderIndex).mLightCollider.getBoundingBox()));
+        invalidateCollider(e, multi.getComponent(colliderIndex).mLightCollider);
+        notifyContentsChanged(e, static_cast<sf::IntRect>(multi.getComponent(colliderIndex).mLightCollider.getBoundingBox()));
+    }
+
+    void LightSystem::setLocalLightPositions(const std::vector< LightUpdate<sf::Vector2f> >& updates)
+    {
+        batchNotifications([this, &updates] ()
+        {
+            forEachLightUpdate(updates, [this] (const LightUpdate<sf::Vector2f>& update, PointLight& light)
+            {
+                invalidateLight(update.entity, light);
+                light.mSprite.setPosition(update.value);
+                invalidateLight(update.entity, light);
+                notifyContentsChanged(update.entity, static_cast<sf::IntRect>(light.getBoundingBox()));
+            });
+        });
+    }
+
+    void LightSystem::setLightScales(const std::vector< LightUpdate<sf::Vector2f> >& updates)
+    {
+        batchNotifications([this, &updates] ()
+        {
+            forEachLightUpdate(updates, [this] (const LightUpdate<sf::Vector2f>& update, PointLight& light)
+            {
+                invalidateLight(update.entity, light);
+                light.mSprite.setScale(update.value);
+                invalidateLight(update.entity, light);
+                notifyContentsChanged(update.entity, static_cast<sf::IntRect>(light.getBoundingBox()));
+            });
+        });
+    }
+
+    void LightSystem::setLightColors(const std::vector< LightUpdate<sf::Color> >& updates)
+    {
+        forEachLightUpdate(updates, [this] (const LightUpdate<sf::Color>& update, PointLight& light)
+        {
+            light.setColor(update.value);
+            invalidateLight(update.entity, light);
+        });
+    }
+
+    void LightSystem::setPoints(const std::vector<ColliderPointUpdate>& updates)
+    {
+        batchNotifications([this, &updates] ()
+        {
+            for (bool multi : { false, true })
+            {
+                //a run of updates of the same collider is invalidated and notified once
+                const ColliderPointUpdate* run = nullptr;
+                LightCollider* collider = nullptr;
+                auto endRun = [this, &run, &collider] ()
+                {
+                    if (!collider)
+                        return;
+                    invalidateCollider(run->entity, *collider);
+                    notifyContentsChanged(run->entity, static_cast<sf::IntRect>(collider->getBoundingBox()));
+                };
+                for (const auto& update : updates)
+                {
+                    if ((update.colliderIndex != ColliderPointUpdate::NO_INDEX) != multi)
+                        continue;
+                    if (!run || run->entity != update.entity || run->colliderIndex != update.colliderIndex)
+                    {
+                        endRun();
+                        run = &update;
+                        Entity e = update.entity;
+                        collider = multi ? &e.modify<MultiShadowEmitter>().getComponent(update.colliderIndex).mLightCollider :
+                                           &e.modify<ShadowEmitter>().mLightCollider;
+                        invalidateCollider(update.entity, *collider);
+                    }
+                    collider->setPoint(update.pointIndex, update.point);
+                }
+                endRun();
+            }
+        });
+    }
+
+    void LightSystem::batchNotifications(const std::function<void()>& apply)
+    {
+        //a batch emits at most one notification per entity, even in immediate mode
+        bool deferred = mDeferNotifications;
+        mDeferNotifications = true;
+        apply();
+        mDeferNotifications = deferred;
+        if (!deferred)
+            flushContentsChanged();
+    }
+
+    void LightSystem::setColliderStatic(Entity e, bool isStatic)
+    {
+        ShadowEmitter& shadow = e.modify<ShadowEmitter>();
+        shadow.mLightCollider.setStatic(true);
+        invalidateCollider(e, shadow.mLightCollider);
+        shadow.mLightCollider.setStatic(isStatic);
+    }
+
+    void LightSystem::setColliderStatic(Entity e, bool isStatic, std::size_t colliderIndex)
+    {
+        LightCollider& collider = e.modify<MultiShadowEmitter>().getComponent(colliderIndex).mLightCollider;
+        collider.setStatic(true);
+        invalidateCollider(e, collider);
+        collider.setStatic(isStatic);
+    }
+
+    void LightSystem::setLightStatic(Entity e, bool isStatic)
+    {
+        LightEmitter& emitter = e.modify<LightEmitter>();
+        emitter.mLight.setStatic(true);
+        invalidateLight(e, emitter.mLight);
+        emitter.mLight.setStatic(isStatic);
+    }
+
+    void LightSystem::setLightStatic(Entity e, bool isStatic, std::size_t index)
+    {
+        PointLight& light = e.modify<MultiLightEmitter>().getComponent(index).mLight;
+        light.setStatic(true);
+        invalidateLight(e, light);
+        light.setStatic(isStatic);
+    }
+
+    void LightSystem::setLightFlickering(Entity e, float period, float strength, bool randomized)
+    {
+        mFlicker.add(e, period, strength, randomized);
+    }
+
+    void LightSystem::setLightFlickering(Entity e, float period, float strength, bool randomized, std::size_t index)
+    {
+        mFlicker.add(e, period, strength, randomized, index);
+    }
+
+    void LightSystem::removeLightFlickering(Entity e)
+    {
+        mFlicker.remove(e);
+    }
+
+    void LightSystem::removeLightFlickering(Entity e, std::size_t index)
+    {
+        mFlicker.remove(e, index);
+    }
+
+    void LightSystem::updateAffectors(const std::list<Entity>& entities, float delta)
+    {
+        if (mAffectorJobs.getThreadCount() <= 1)
+        {
+            //iterate over LightAffectors
+            dom::Utility<Entity>::iterate<LightAffector>(entities,
+              [delta, this] (Entity e, LightAffector& affector)
+              {
+                  updateAffector(affector, delta);
+              });
+            //iterate over MultilightLightAffectors
+            dom::Utility<Entity>::iterate<MultiLightAffector>(entities,
+              [delta, this] (Entity e, MultiLightAffector& affector)
+              {
+                  for (std::size_t i = 0; i < affector.getComponentCount(); ++i)
+                      updateAffector(affector.getComponent(i), delta);
+              });
+            return;
+        }
+
+        //affectors are grouped by the emitter they are bound to, a group is never split between threads
+        struct Job
+        {
+            Entity entity;
+            LightEmitter* emitter;
+            std::vector<LightAffector*> affectors;
+            bool serial;            ///<an affector of the light is not marked as thread safe
+            sf::FloatRect bounds;   ///<local bounds of the light before the update
+        };
+        std::vector<Job> jobs;
+        std::map<const LightEmitter*, std::size_t> jobOf;
+        auto addAffector = [&jobs, &jobOf] (Entity e, LightAffector& affector)
+        {
+            if (!affector.mEmitter)
+                return;
+            auto job = jobOf.emplace(affector.mEmitter, jobs.size());
+            if (job.second)
+                jobs.push_back({ e, affector.mEmitter, {}, false, affector.mEmitter->mLight.getBoundingBox() });
+            Job& target = jobs[job.first->second];
+            target.affectors.push_back(&affector);
+            if (!affector.isThreadSafe())
+                target.serial = true;
+        };
+        dom::Utility<Entity>::iterate<LightAffector>(entities,
+          [&addAffector] (Entity e, LightAffector& affector)
+          {
+              addAffector(e, affector);
+          });
+        dom::Utility<Entity>::iterate<MultiLightAffector>(entities,
+          [&addAffector] (Entity e, MultiLightAffector& affector)
+          {
+              for (std::size_t i = 0; i < affector.getComponentCount(); ++i)
+                  addAffector(e, affector.getComponent(i));
+          });
+
+        std::vector<std::size_t> parallel;
+        std::vector<std::size_t> serial;
+        for (std::size_t i = 0; i < jobs.size(); ++i)
+            (jobs[i].serial ? serial : parallel).push_back(i);
+        mAffectorJobs.run(parallel.size(), AFFECTOR_CHUNK_SIZE, [this, &jobs, &parallel, delta] (std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+                for (LightAffector* affector : jobs[parallel[i]].affectors)
+                    updateAffector(*affector, delta);
+        });
+        for (std::size_t i : serial)
+            for (LightAffector* affector : jobs[i].affectors)
+                updateAffector(*affector, delta);
+
+        //merge: only lights that outgrew their bounds are notified for the quadtree, any other invalidation is
+        //left to the callbacks as in the serial update
+        for (const auto& job : jobs)
+        {
+            sf::FloatRect bounds = job.emitter->mLight.getBoundingBox();
+            if (bounds.left < job.bounds.left || bounds.top < job.bounds.top ||
+                bounds.left + bounds.width > job.bounds.left + job.bounds.width ||
+                bounds.top + bounds.height > job.bounds.top + job.bounds.height)
+                notifyContentsChanged(job.entity, static_cast<sf::IntRect>(bounds));
+        }
+    }
+
+    void LightSystem::updateTracks(const std::list<Entity>& entities, float delta)
+    {
+        //evaluate all tracks first and apply the results with the batch setters
+        std::vector< LightUpdate<sf::Color> > colors;
+        std::vector< LightUpdate<sf::Vector2f> > scales;
+        std::vector< LightUpdate<sf::Vector2f> > positions;
+        auto evaluate = [&colors, &scales, &positions, delta] (Entity e, LightTracks& tracks, const PointLight& light, std::size_t index)
+        {
+            if (tracks.mFinished)
+                return;
+            float duration = tracks.getDuration();
+            tracks.mTime += delta;
+            if (tracks.mLooping && duration > 0.0f)
+                tracks.mTime = std::fmod(tracks.mTime, duration);
+            else if (tracks.mTime >= duration)
+            {
+                //the last keys are applied once, afterwards the tracks rest
+                tracks.mTime = duration;
+                tracks.mFinished = true;
+            }
+            float value[4];
+            if (tracks.mColor.evaluate(tracks.mTime, tracks.mInterpolation, value))
+            {
+                sf::Uint8 channels[4];
+                for (unsigned c = 0; c < 4; ++c)
+                    channels[c] = (sf::Uint8)std::max(0.0f, std::min(255.0f, std::round(value[c])));
+                sf::Color color(channels[0], channels[1], channels[2], channels[3]);
+                if (color != light.getColor())
+                    colors.push_back({ e, color, index });
+            }
+            //values that did not change are not written, so resting or constant tracks cause no invalidation
+            if (tracks.mScale.evaluate(tracks.mTime, tracks.mInterpolation, value) &&
+                sf::Vector2f(value[0], value[1]) != light.mSprite.getScale())
+                scales.push_back({ e, sf::Vector2f(value[0], value[1]), index });
+            if (tracks.mPosition.evaluate(tracks.mTime, tracks.mInterpolation, value) &&
+                sf::Vector2f(value[0], value[1]) != light.mSprite.getPosition())
+                positions.push_back({ e, sf::Vector2f(value[0], value[1]), index });
+        };
+        dom::Utility<Entity>::iterate<LightEmitter, LightTracks>(entities,
+          [&evaluate] (Entity e, LightEmitter& light, LightTracks& tracks)
+          {
+              evaluate(e, tracks, light.mLight, LightUpdate<sf::Color>::NO_INDEX);
+          });
+        dom::Utility<Entity>::iterate<MultiLightEmitter, LightTracks>(entities,
+          [&evaluate] (Entity e, MultiLightEmitter& light, LightTracks& tracks)
+          {
+              if (!e.has<LightEmitter>() && tracks.mLightIndex < light.getComponentCount())
+                  evaluate(e, tracks, light.getComponent(tracks.mLightIndex).mLight, tracks.mLightIndex);
+          });
+        dom::Utility<Entity>::iterate<MultiLightEmitter, MultiLightTracks>(entities,
+          [&evaluate] (Entity e, MultiLightEmitter& light, MultiLightTracks& tracks)
+          {
+              for (std::size_t i = 0; i < tracks.getComponentCount(); ++i)
+                  if (tracks.getComponent(i).mLightIndex < light.getComponentCount())
+                      evaluate(e, tracks.getComponent(i), light.getComponent(tracks.getComponent(i).mLightIndex).mLight,
+                               tracks.getComponent(i).mLightIndex);
+          });
+
+        if (!colors.empty())
+            setLightColors(colors);
+        if (!scales.empty())
+            setLightScales(scales);
+        if (!positions.empty())
+            setLocalLightPositions(positions);
+    }
+
+    void LightSystem::updateAffector(LightAffector& affector, float delta)
+    {
+        if (!affector.isActive() || !affector.mCallback)
+            return;
+        //lights count as visible until the first frame is rendered
+        bool visible = affector.mEmitter->mVisibleFrame == mRenderFrame;
+        switch (affector.mPolicy)
+        {
+        case AffectorPolicy::Always:
+            affector.mCallback(delta, *affector.mEmitter);
+            break;
+        case AffectorPolicy::VisibleOnly:
+            if (visible)
+                affector.mCallback(delta, *affector.mEmitter);
+            break;
+        case AffectorPolicy::ReducedRate:
+            affector.mPendingDelta += delta;
+            if (visible || affector.mPendingDelta >= affector.mInterval)
+            {
+                //callbacks step by their delta, so the catch up is split into steps of at most the frame delta
+                float step = std::max(delta, 1.0f);
+                while (affector.mPendingDelta > step)
+                {
+                    affector.mCallback(step, *affector.mEmitter);
+                    affector.mPendingDelta -= step;
+                }
+                affector.mCallback(affector.mPendingDelta, *affector.mEmitter);
+                affector.mPendingDelta = 0.0f;
+            }
+            break;
+        }
+    }
+
+    void LightSystem::setLightAnimation(Entity e, const LightAnimation& animation)
+    {
+        e.modify<LightEmitter>().mLight.setAnimation(animation);
+    }
+
+    void LightSystem::setLightAnimation(Entity e, const LightAnimation& animation, std::size_t index)
+    {
+        e.modify<MultiLightEmitter>().getComponent(index).mLight.setAnimation(animation);
+    }
+
+    float LightSystem::getAnimationTime() const
+    {
+        return (float)mAnimationTime;
+    }
+
+    void LightSystem::setAnimationUniforms(sf::Shader& shader, const PointLight& light, const sf::Vector2f& center, double time) const
+    {
+        const LightAnimation& animation = light.getAnimation();
+        shader.setUniform("time", (float)time);
+        shader.setUniform("period", animation.period);
+        shader.setUniform("intensity", animation.intensity);
+        shader.setUniform("scale", animation.scale);
+        shader.setUniform("seed", animation.seed);
+        shader.setUniform("waveform", (int)animation.waveform);
+        shader.setUniform("center", center);
+    }
+
+    void LightSystem::setAffectorThreads(unsigned count)
+    {
+        mAffectorJobs.setThreadCount(count);
     }
 
     void LightSystem::setAffectorCallback(Entity e, const std::function<void(float, LightEmitter&)>& callback)
@@ -1005,18 +5910,87 @@ namespace ungod
         mContentsChangedSignal.connect(callback);
     }
 
+    void LightSystem::setDeferredNotifications(bool deferred)
+    {
+        if (!deferred)
+            flushContentsChanged();
+        mDeferNotifications = deferred;
+    }
+
+    bool LightSystem::getDeferredNotifications() const
+    {
+        return mDeferNotifications;
+    }
+
+    void LightSystem::flushContentsChanged()
+    {
+        if (mPendingChanges.empty())
+            return;
+        //swap first, listeners may cause new notifications
+        std::vector< std::pair<Entity, sf::IntRect> > changes;
+        changes.swap(mPendingChanges);
+        mPendingIndices.clear();
+        for (const auto& change : changes)
+            mContentsChangedSignal(change.first, change.second);
+    }
+
+    const void* LightSystem::getPendingKey(Entity e) const
+    {
+        //every entity that notifies owns at least one of these components, its address identifies the entity
+        if (e.has<LightEmitter>())
+            return &e.get<LightEmitter>();
+        if (e.has<ShadowEmitter>())
+            return &e.get<ShadowEmitter>();
+        if (e.has<MultiLightEmitter>())
+            return &e.get<MultiLightEmitter>();
+        if (e.has<MultiShadowEmitter>())
+            return &e.get<MultiShadowEmitter>();
+        return nullptr;
+    }
+
+    void LightSystem::notifyContentsChanged(Entity e, const sf::IntRect& rect)
+    {
+        if (!mDeferNotifications)
+        {
+            mContentsChangedSignal(e, rect);
+            return;
+        }
+        //components may be reallocated while changes are pending, so a stale key is detected by its entity
+        const void* key = getPendingKey(e);
+        auto pending = key ? mPendingIndices.find(key) : mPendingIndices.end();
+        if (pending == mPendingIndices.end() || mPendingChanges[pending->second].first != e)
+        {
+            if (key)
+                mPendingIndices[key] = mPendingChanges.size();
+            mPendingChanges.emplace_back(e, rect);
+            return;
+        }
+        sf::IntRect& merged = mPendingChanges[pending->second].second;
+        int right = std::max(merged.left + merged.width, rect.left + rect.width);
+        int bottom = std::max(merged.top + merged.height, rect.top + rect.height);
+        merged.left = std::min(merged.left, rect.left);
+        merged.top = std::min(merged.top, rect.top);
+        merged.width = right - merged.left;
+        merged.height = bottom - merged.top;
+    }
+
     void LightSystem::moveLights(Entity e, const sf::Vector2f& vec)
     {
         if (e.has<LightEmitter>())
         {
-            e.modify<LightEmitter>().mLight.mSprite.move(vec);
+            LightEmitter& light = e.modify<LightEmitter>();
+            invalidateLight(e, light.mLight);
+            light.mLight.mSprite.move(vec);
+            invalidateLight(e, light.mLight);
         }
         if (e.has<MultiLightEmitter>())
         {
             MultiLightEmitter& light = e.modify<MultiLightEmitter>();
             for (std::size_t i = 0; i < light.getComponentCount(); ++i)
             {
+                invalidateLight(e, light.getComponent(i).mLight);
                 light.getComponent(i).mLight.mSprite.move(vec);
+                invalidateLight(e, light.getComponent(i).mLight);
             }
         }
     }
@@ -1025,14 +5999,19 @@ namespace ungod
     {
         if (e.has<ShadowEmitter>())
         {
-            e.modify<ShadowEmitter>().mLightCollider.mShape.move(vec);
+            ShadowEmitter& shadow = e.modify<ShadowEmitter>();
+            invalidateCollider(e, shadow.mLightCollider);
+            shadow.mLightCollider.mShape.move(vec);
+            invalidateCollider(e, shadow.mLightCollider);
         }
         if (e.has<MultiShadowEmitter>())
         {
             MultiShadowEmitter& shadow = e.modify<MultiShadowEmitter>();
             for (std::size_t i = 0; i < shadow.getComponentCount(); ++i)
             {
+                invalidateCollider(e, shadow.getComponent(i).mLightCollider);
                 shadow.getComponent(i).mLightCollider.mShape.move(vec);
+                invalidateCollider(e, shadow.getComponent(i).mLightCollider);
             }
         }
     }
@@ -30,6 +30,15 @@
 #define LIGHT_H
 
 #include <SFML/Graphics.hpp>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <thread>
 #include "owls/Signal.h"
 #include "quadtree/QuadTree.h"
 #include "ungod/visual/Image.h"
@@ -38,6 +47,40 @@
 namespace ungod
 {
     struct Penumbra;
+    struct ShadowGeometry;
+
+    /** \brief The algorithms a LightSystem can use to compute the shadows of its lights. */
+    enum class ShadowTechnique
+    {
+        Penumbras,          ///< umbra, penumbras and antumbra of every collider are rendered one after another
+        VisibilityPolygon,  ///< the visibility polygon of a light is computed in one sweep and rendered as a single fan
+        DistanceField,      ///< soft shadows of all lights are ray marched in a distance field of the static colliders
+        ShadowMap           ///< every light gets a row in a shared 1d polar distance map, lights are drawn with a single lookup
+    };
+
+    /** \brief The curves a LightAnimation can follow. */
+    enum class LightWaveform
+    {
+        Sine,       ///< smooth pulsing
+        Triangle,   ///< linear pulsing, like LightFlickering
+        Noise       ///< smoothly interpolated random values, a new one every period
+    };
+
+    /** \brief An animation of the brightness and size of a light, that is evaluated on the gpu from the time
+    * of the light system. Costs no cpu time per frame and leaves the bounds of the light unchanged. */
+    struct LightAnimation
+    {
+        float period = 0.0f;        ///<length of a cycle in milliseconds, 0 disables the animation
+        float intensity = 0.0f;     ///<fraction the brightness is reduced by at most
+        float scale = 0.0f;         ///<fraction the light shrinks by at most
+        float seed = 0.0f;          ///<phase offset in cycles, lights with different seeds are out of sync
+        LightWaveform waveform = LightWaveform::Sine;
+    };
+
+    /** \brief Clips a convex polygon against an axis aligned rectangle (Sutherland-Hodgman).
+    * Positions, texture coordinates and colors of the vertices are interpolated along clipped edges.
+    * The polygon may become empty if it lies completely outside of the rectangle. */
+    void clipPolygon(std::vector<sf::Vertex>& polygon, const sf::FloatRect& rect);
 
     /** \brief A base class for lights and light-colliders. Provides basic functionality for
     * disable and enable the derived device. */
@@ -55,15 +98,24 @@ namespace ungod
         /** \brief Toggles the active status (flips the bool). */
         void toggleActive();
 
+        /** \brief Marks the device as static. Static devices are assumed to never change and
+        * are allowed to be cached by the light system. */
+        void setStatic(bool isStatic);
+
+        /** \brief Returns true if the device is static. */
+        bool isStatic() const;
+
         /** \brief Renders penumbras to the texture. */
         void unmaskWithPenumbras(sf::RenderTexture& renderTexture,
                                  sf::RenderStates states,
                                  sf::Shader& unshadowShader,
                                  const std::vector<Penumbra>& penumbras,
-                                 float shadowExtension) const;
+                                 float shadowExtension,
+                                 const sf::FloatRect& clipRect) const;
 
     private:
         bool mActive; ///<states whether the object is currently active, that means it performs its underlying actions
+        bool mStatic; ///<states whether the object is promised to never change
     };
 
     /** \brief A collider for lights. Will cause the casting of shadows.
@@ -93,6 +145,9 @@ namespace ungod
 
         void render(sf::RenderTarget& target, sf::RenderStates states);
 
+        /** \brief Draws the collider with the given color, without changing the collider. */
+        void render(sf::RenderTarget& target, sf::RenderStates states, const sf::Color& color) const;
+
         void setColor(const sf::Color& color);
 
     private:
@@ -109,6 +164,8 @@ namespace ungod
     friend class LightSystem;
     friend class LightFlickering;
     friend class RandomizedFlickering;
+    friend class LightFlickerSystem;
+    friend class LightRasterizer;
     public:
         PointLight(const std::string& texturePath = DEFAULT_TEXTURE_PATH);
 
@@ -121,17 +178,78 @@ namespace ungod
                     const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
                     sf::Shader& unshadowShader,
                     sf::Shader& lightOverShapeShader,
-                    const Transform& transf) const;
+                    const Transform& transf,
+                    bool mergeUmbras = false) const;
+
+        /** \brief Renders the light like render, but with shadow geometry that was computed by computeShadowGeometry
+        * for the same colliders before, e.g. to render the light into several views. */
+        void renderShadows(const sf::View& view,
+                           sf::RenderTexture& lightTexture,
+                           sf::RenderTexture& emissionTexture,
+                           sf::RenderTexture& antumbraTexture,
+                           const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                           const std::vector<ShadowGeometry>& shadows,
+                           const std::vector<bool>& hidden,
+                           sf::Shader& unshadowShader,
+                           sf::Shader& lightOverShapeShader,
+                           const Transform& transf,
+                           bool mergeUmbras = false) const;
+
+        /** \brief Computes the umbras, penumbras and antumbras the given colliders cast for this light in world
+        * coordinates. Colliders that are completely inside of the umbra of closer colliders are marked in hidden
+        * and cast no shadow. This geometry is shared by the gpu and the software renderer. */
+        void computeShadowGeometry(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                                   const Transform& transf,
+                                   std::vector<ShadowGeometry>& shadows,
+                                   std::vector<bool>& hidden) const;
+
+        /** \brief Returns the length shadow geometry is extruded by, which is well beyond the bounds of the light. */
+        float getShadowExtension() const;
+
+        /** \brief Renders the light by computing its visibility polygon in a single angular sweep over
+        * all collider edges. The light is drawn as one triangle fan, soft edges are added only at the
+        * silhouette vertices of the colliders. */
+        void renderVisibility(const sf::View& view,
+                              sf::RenderTexture& lightTexture,
+                              const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                              sf::Shader& unshadowShader,
+                              sf::Shader& lightOverShapeShader,
+                              const Transform& transf) const;
+
+        /** \brief Computes the 1d polar shadow map of the light. For each of the resolution angular bins the
+        * distance to the closest collider edge is written as 16 bit value (red = high byte, green = low byte)
+        * into row, which has to hold 4 * resolution bytes. Distances are normalized by the returned radius. */
+        float computeShadowMap(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                               const Transform& transf,
+                               sf::Uint8* row,
+                               unsigned resolution) const;
+
+        /** \brief Returns true if the source point of the light lies inside of one of the given colliders.
+        * Such a light is blocked completely and does not have to be rendered. */
+        bool isSourceBlocked(const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                             const Transform& transf) const;
 
         /** \brief Loads a texture for the light source. Replaces the default texture. */
         void loadTexture(const std::string& path = DEFAULT_TEXTURE_PATH);
 
+        /** \brief Returns the path of the texture of the light source. */
+        const std::string& getTexturePath() const;
+
         /** \brief Returns the current color of the light. */
         sf::Color getColor() const;
 
         /** \brief Sets the color of the light. */
         void setColor(const sf::Color& color);
 
+        /** \brief Sets the animation of the light. Replaces animating the scale or color on the cpu. */
+        void setAnimation(const LightAnimation& animation);
+
+        /** \brief Returns the animation of the light. */
+        const LightAnimation& getAnimation() const;
+
+        /** \brief Returns true if the light has an animation that changes anything. */
+        bool isAnimated() const;
+
         /** \brief Sets the size of the light. */
         sf::Vector2f getScale() const;
 
@@ -165,6 +283,8 @@ namespace ungod
         float mRadius;
         float mShadowOverExtendMultiplier;
         Image mTexture;
+        std::string mTexturePath;
+        LightAnimation mAnimation;
 
         static const std::string DEFAULT_TEXTURE_PATH;
     };
@@ -180,12 +300,23 @@ namespace ungod
         float distance;
     };
 
+    /** \brief The shadow a single collider casts for a light, in world coordinates. */
+    struct ShadowGeometry
+    {
+        std::size_t collider;               ///<index of the collider the shadow was computed for
+        bool antumbra;                      ///<true if the umbra ends behind the collider
+        std::vector<sf::Vector2f> mask;     ///<the umbra, in case of an antumbra the fully shadowed region behind the collider
+        std::vector<Penumbra> penumbras;
+        sf::Vector2f as, bs, ad, bd;        ///<start points and directions of the outer shadow boundary
+    };
+
 
     /** \brief A component for entities that should have the ability to block light and
     * cast shadows. */
     class ShadowEmitter
     {
     friend class LightSystem;
+    friend class ShadowDistanceField;
     private:
         LightCollider mLightCollider;
     };
@@ -203,6 +334,7 @@ namespace ungod
     friend class RandomizedFlickering;
     private:
         PointLight mLight;
+        unsigned mVisibleFrame = 0; ///<the last frame the light was rendered in
     public:
         PointLight& getLight() { return mLight; }
         const PointLight& getLight() const { return mLight; }
@@ -212,6 +344,14 @@ namespace ungod
     using MultiLightEmitter = dom::MultiComponent<LightEmitter>;
 
 
+    /** \brief Defines when a LightAffector is updated, depending on the visibility of its light in the last rendered frame. */
+    enum class AffectorPolicy
+    {
+        Always,         ///< every update
+        VisibleOnly,    ///< only while the light is on screen, time off screen is skipped
+        ReducedRate     ///< every update on screen, in intervals off screen, the remaining time is caught up when the light gets visible
+    };
+
     /** \brief A component that can be attached to an entity in addition to a LightEmitter. This component
     * will apply effects to the light that are defined in a callback function, that are updated each frame.
     * For example flickering. This file also provides templates for those callback functions. */
@@ -222,6 +362,10 @@ namespace ungod
         std::function<void(float, LightEmitter&)> mCallback;
         LightEmitter* mEmitter;
         bool mActive;
+        AffectorPolicy mPolicy;
+        float mInterval;
+        float mPendingDelta;
+        bool mThreadSafe;
 
     public:
         LightAffector();
@@ -229,6 +373,21 @@ namespace ungod
         void setActive(bool active);
 
         bool isActive() const;
+
+        /** \brief Sets when the affector is updated. For ReducedRate, interval is the time in milliseconds between
+        * two updates while the light is off screen. The time that was skipped is passed to the callback in steps
+        * of at most the frame delta. */
+        void setPolicy(AffectorPolicy policy, float interval = 250.0f);
+
+        /** \brief Returns when the affector is updated. */
+        AffectorPolicy getPolicy() const;
+
+        /** \brief Marks the callback as safe to run in parallel with the callbacks of other lights. Callbacks that
+        * use shared state, like the global NumberGenerator of RandomizedFlickering, must not be marked. */
+        void setThreadSafe(bool threadSafe);
+
+        /** \brief Returns true if the callback may run in parallel. False by default. */
+        bool isThreadSafe() const;
     };
 
     /** \brief A LightAffector that can affect multiple lights. Only meaningful, if used in combination with a
@@ -236,6 +395,84 @@ namespace ungod
     using MultiLightAffector = dom::MultiComponent<LightAffector>;
 
 
+    /** \brief The interpolation between the keys of LightTracks. */
+    enum class TrackInterpolation
+    {
+        Linear,
+        Cubic       ///< catmull-rom spline through the keys
+    };
+
+    /** \brief A component that animates the color, scale and local position of a light with keyframes. Can be
+    * attached to an entity in addition to a LightEmitter or a MultiLightEmitter. The tracks of all entities are
+    * evaluated by the light system in one pass per update and applied with the batch setters. */
+    class LightTracks
+    {
+    friend class LightSystem;
+    friend struct SerialBehavior<LightTracks>;
+    friend struct DeserialBehavior<LightTracks>;
+    private:
+        struct Track
+        {
+            std::vector<float> times;
+            std::vector<float> values; ///<components values per key, stored contiguously
+            unsigned components;
+
+            bool evaluate(float time, TrackInterpolation interpolation, float* out) const;
+            void insert(float time, const float* value);
+        };
+
+        Track mColor;
+        Track mScale;
+        Track mPosition;
+        TrackInterpolation mInterpolation;
+        std::size_t mLightIndex;
+        float mTime;
+        bool mLooping;
+        bool mFinished;
+
+    public:
+        LightTracks();
+
+        /** \brief Adds a color key at the given time in milliseconds. A key at the same time is replaced. */
+        void addColorKey(float time, const sf::Color& color);
+
+        /** \brief Adds a scale key at the given time in milliseconds. */
+        void addScaleKey(float time, const sf::Vector2f& scale);
+
+        /** \brief Adds a local position key at the given time in milliseconds. */
+        void addPositionKey(float time, const sf::Vector2f& position);
+
+        /** \brief Removes all keys. */
+        void clear();
+
+        void setInterpolation(TrackInterpolation interpolation);
+
+        TrackInterpolation getInterpolation() const;
+
+        /** \brief Sets whether the tracks start over after the last key. */
+        void setLooping(bool looping);
+
+        bool isLooping() const;
+
+        /** \brief Sets the light of a MultiLightEmitter that is animated. Ignored for a LightEmitter. Tracks whose
+        * index is out of the range of the MultiLightEmitter are not evaluated. */
+        void setLightIndex(std::size_t index);
+
+        std::size_t getLightIndex() const;
+
+        /** \brief Jumps to the given time of the tracks. */
+        void setTime(float time);
+
+        float getTime() const;
+
+        /** \brief Returns the time of the last key of all tracks. */
+        float getDuration() const;
+    };
+
+    /** \brief Multiple LightTracks, e.g. to animate several lights of a MultiLightEmitter. */
+    using MultiLightTracks = dom::MultiComponent<LightTracks>;
+
+
     /** \brief A callable object, that can be used as a callback for LightAffector.
     * LightFlickering will make a light object flicker, randomly or continously.
     * Note that you can also use this template in your own callbacks.
@@ -271,6 +508,714 @@ namespace ungod
     };
 
 
+    /** \brief An entry of a batch update that sets a value of a light. The index refers to a light of a
+    * MultiLightEmitter, NO_INDEX to the light of a LightEmitter. */
+    template<typename T>
+    struct LightUpdate
+    {
+        static constexpr std::size_t NO_INDEX = static_cast<std::size_t>(-1);
+
+        Entity entity;
+        T value;
+        std::size_t index = NO_INDEX;
+    };
+
+    /** \brief Lets many lights flicker at once. Parameters and state of all flickering lights are kept in flat
+    * arrays and advanced with the frame delta instead of a clock per light. Behaves like LightFlickering and
+    * RandomizedFlickering, but without an affector and a callback per light. */
+    class LightFlickerSystem
+    {
+    public:
+        /** \brief Lets the light of the entity flicker with the given period in milliseconds and strength. The index
+        * refers to a light of a MultiLightEmitter, NO_INDEX to the light of a LightEmitter. A randomized flicker
+        * picks a new period between 0.5 and 1 times the given one after every change of direction. A light
+        * that already flickers gets the new parameters. */
+        void add(Entity e, float period, float strength, bool randomized = false,
+                 std::size_t index = LightUpdate<sf::Vector2f>::NO_INDEX);
+
+        /** \brief Stops the flickering of the light, its scale is left as it is. */
+        void remove(Entity e, std::size_t index = LightUpdate<sf::Vector2f>::NO_INDEX);
+
+        /** \brief Stops the flickering of all lights. */
+        void clear();
+
+        /** \brief Returns the number of flickering lights. */
+        std::size_t getCount() const;
+
+        /** \brief Advances all flickering lights by delta milliseconds and writes their new scales directly. The
+        * lights are looked up once in their entities, lights that no longer exist are dropped. Lights whose bounds
+        * outgrow the bounds they were last reported with are written to outgrown, static lights to statics, both
+        * with the union of all bounds since they were added. Other lights need no invalidation. */
+        void update(float delta, std::vector< LightUpdate<sf::FloatRect> >& outgrown,
+                    std::vector< LightUpdate<sf::FloatRect> >& statics);
+
+    private:
+        std::vector<Entity> mEntities;
+        std::vector<std::size_t> mIndices; ///<index of the light in a MultiLightEmitter or NO_INDEX
+        std::vector<float> mPeriods;
+        std::vector<float> mBasePeriods;
+        std::vector<float> mStrengths;
+        std::vector<float> mDirections; ///<1 while the light grows, -1 while it shrinks
+        std::vector<float> mElapsed; ///<milliseconds since the last change of direction
+        std::vector<float> mOffsets; ///<accumulated change of scale, bounds randomized flickers
+        std::vector<unsigned char> mRandomized;
+        std::vector<sf::FloatRect> mBounds; ///<bounds of the light that were last reported
+        std::vector< std::pair<const void*, std::size_t> > mKeys;
+        std::map< std::pair<const void*, std::size_t>, std::size_t > mSlots; ///<component address and index to slot
+        std::vector<float> mSteps;
+        std::vector<PointLight*> mLights;
+
+        std::size_t find(Entity e, std::size_t index) const;
+        void removeAt(std::size_t i);
+        void rekey(std::size_t i, const std::pair<const void*, std::size_t>& key);
+        static PointLight* resolve(Entity e, std::size_t index, std::pair<const void*, std::size_t>& key);
+    };
+
+
+    /** \brief A signed distance field of all static light colliders in world space. The field is split
+    * into chunks, that are computed on demand on the cpu and cached until a collider inside of them changes.
+    * Used by the DistanceField shadow technique. */
+    class ShadowDistanceField
+    {
+    public:
+        ShadowDistanceField();
+
+        /** \brief Sets the size of a chunk in world units, the number of texels per chunk side and the
+        * maximum distance that is stored. Discards all computed chunks. */
+        void setup(float chunkSize, unsigned resolution, float maxDistance);
+
+        /** \brief Marks all chunks that are within range of the given world rect as outdated. */
+        void invalidate(const sf::FloatRect& rect);
+
+        /** \brief Discards all computed chunks. */
+        void clear();
+
+        /** \brief Returns true if setup was called. */
+        bool isSetup() const;
+
+        /** \brief Computes missing or outdated chunks that overlap the given world rect. At most
+        * budget chunks are computed per call, remaining chunks are treated as empty until then. */
+        void update(const sf::FloatRect& rect, quad::QuadTree<Entity>& quadtree, unsigned budget);
+
+        /** \brief Draws the computed chunks that overlap rect. The target is expected to be cleared
+        * with white (the maximum distance). */
+        void render(sf::RenderTarget& target, const sf::FloatRect& rect) const;
+
+        float getMaxDistance() const;
+
+    private:
+        struct Chunk
+        {
+            sf::Texture texture;
+            bool valid = false;
+        };
+
+        std::map<std::pair<int, int>, Chunk> mChunks;
+        float mChunkSize;
+        unsigned mResolution;
+        float mMaxDistance;
+        bool mSetup;
+
+        void compute(Chunk& chunk, const sf::FloatRect& chunkRect, quad::QuadTree<Entity>& quadtree) const;
+    };
+
+    /** \brief Texel formats of light map files. */
+    enum class LightMapFormat
+    {
+        RGBA,   ///< 4 bytes per texel, keeps colored light
+        Gray,   ///< 1 byte per texel, stores the brightest channel, suited for shadow masks and white lights
+        BC4     ///< 4x4 blocks of 8 bytes (half a byte per texel) with two gray endpoints and 3 bit indices
+    };
+
+    /** \brief Read access to a light map file, that holds a table of chunks followed by their texels. The file is
+    * memory mapped, chunks are decoded on a worker thread on request and can be fetched afterwards without
+    * blocking. */
+    class LightMapStream : sf::NonCopyable
+    {
+    public:
+        LightMapStream();
+        ~LightMapStream();
+
+        /** \brief Maps the file and reads its chunk table. Closes a previously opened file. */
+        bool open(const std::string& path);
+
+        /** \brief Unmaps the file and stops the worker thread. */
+        void close();
+
+        bool isOpen() const;
+
+        /** \brief Returns true if the file holds the chunk. */
+        bool contains(int x, int y) const;
+
+        /** \brief Queues the chunk for decoding, if the file holds it and it is not queued already. */
+        void request(int x, int y);
+
+        /** \brief Drops queued and decoded chunks outside of the given rect of chunk coordinates. A chunk that is
+        * decoded right now is still delivered. */
+        void cancel(const sf::IntRect& keep);
+
+        /** \brief Takes one decoded chunk, whose texels are rgba. Returns false if none is ready. */
+        bool fetch(std::pair<int, int>& chunk, std::vector<sf::Uint8>& pixels);
+
+        float getChunkSize() const;
+
+        unsigned getResolution() const;
+
+        /** \brief Writes chunks (each an image of resolution x resolution texels) into a light map file. */
+        static bool write(const std::string& path, float chunkSize, unsigned resolution, LightMapFormat format,
+                          const std::map<std::pair<int, int>, sf::Image>& chunks);
+
+    private:
+        struct Entry
+        {
+            std::uint64_t offset;
+            std::uint64_t size;
+        };
+
+        std::map<std::pair<int, int>, Entry> mEntries;
+        const sf::Uint8* mData;
+        std::size_t mSize;
+        void* mMapping;         ///<platform handle of the mapping
+        std::intptr_t mFile;    ///<platform handle of the file
+        LightMapFormat mFormat;
+        float mChunkSize;
+        unsigned mResolution;
+
+        std::thread mWorker;
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        std::deque< std::pair<int, int> > mRequests;
+        std::set< std::pair<int, int> > mQueued;
+        std::deque< std::pair< std::pair<int, int>, std::vector<sf::Uint8> > > mDecoded;
+        bool mStop;
+
+        void work();
+        void decode(const Entry& entry, std::vector<sf::Uint8>& pixels) const;
+
+        static const char MAGIC[4];
+        static constexpr unsigned MAX_RESOLUTION = 4096; ///<larger chunks are rejected as corrupt, a chunk decodes to 4 * res² bytes
+    };
+
+    /** \brief World space light maps of all static lights and their shadows, stored in chunks. Every chunk is
+    * composited with a single draw, which replaces rendering the static lights each frame. */
+    class StaticLightMap
+    {
+    public:
+        StaticLightMap();
+
+        /** \brief Sets the size of a chunk in world units and the number of texels per chunk side.
+        * Discards all baked chunks. */
+        void setup(float chunkSize, unsigned resolution);
+
+        /** \brief Discards all baked chunks. */
+        void clear();
+
+        /** \brief Returns true if the light map was set up. */
+        bool isSetup() const;
+
+        /** \brief Returns true if every chunk that overlaps rect is baked or resident, so that drawing the light
+        * map covers all static lights inside of rect. Outdated regions of baked chunks count as baked. */
+        bool isBaked(const sf::FloatRect& rect) const;
+
+        /** \brief Marks the texels of all baked chunks inside of the world rect as outdated. Only these texels
+        * are baked again, the rest of the chunks is kept. */
+        void invalidate(const sf::FloatRect& rect);
+
+        /** \brief Bakes missing chunks and the outdated regions of baked chunks that overlap rect, at most budget
+        * chunks per call. bake receives a world rect and has to render the static lights of that rect into the
+        * render texture, whose view is already set up. */
+        void update(const sf::FloatRect& rect, unsigned budget,
+                    const std::function<void(const sf::FloatRect&, sf::RenderTexture&)>& bake);
+
+        /** \brief Draws the baked chunks that overlap rect additively. The view of the target has to map world
+        * coordinates. */
+        void render(sf::RenderTarget& target, const sf::FloatRect& rect) const;
+
+        /** \brief Writes all baked chunks as images together with an index file into directory. */
+        bool save(const std::string& directory) const;
+
+        /** \brief Replaces the light map with the one stored in directory. */
+        bool load(const std::string& directory);
+
+        /** \brief Writes all baked chunks into a single light map file that can be streamed. */
+        bool write(const std::string& path, LightMapFormat format) const;
+
+        /** \brief Streams the light map from a file instead of baking it. Chunks around the rect passed to update
+        * are decoded in the background and uploaded, at most residentChunks chunks are kept in memory. The chunks
+        * around the rect are never evicted, so the budget grows to them if it is too small.
+        * Chunks that are not resident are not drawn. */
+        bool stream(const std::string& path, unsigned residentChunks);
+
+        float getChunkSize() const;
+
+        unsigned getResolution() const;
+
+    private:
+        struct Chunk
+        {
+            std::unique_ptr<sf::RenderTexture> texture;
+            bool valid = false;
+            bool dirty = false;
+            sf::FloatRect dirtyRect;    ///<world rect that has to be baked again
+        };
+
+        std::map<std::pair<int, int>, Chunk> mChunks;
+        float mChunkSize;
+        unsigned mResolution;
+        sf::RenderTexture mBakeTexture;
+        std::unique_ptr<LightMapStream> mStream;
+        unsigned mResidentChunks;
+        sf::Texture mUploadTexture;
+
+        void updateStream(const sf::FloatRect& rect);
+
+        void bakeRegion(Chunk& chunk, int x, int y, const sf::FloatRect& region,
+                        const std::function<void(const sf::FloatRect&, sf::RenderTexture&)>& bake);
+        void createTexture(Chunk& chunk) const;
+
+        static const std::string INDEX_FILE;
+        static constexpr unsigned STREAM_UPLOADS = 2; ///<max number of streamed chunks uploaded per update
+    };
+
+    /** \brief A coarse world space grid of light probes. Every probe stores the light of all static lights at
+    * its position, occluded by static colliders. Probes are computed in chunks on demand and sampled with
+    * a bilinear lookup, e.g. to tint sprites and particles that are rendered in separate passes. */
+    class LightProbeGrid
+    {
+    public:
+        LightProbeGrid();
+
+        /** \brief Sets the distance between neighboring probes in world units and the number of probes per chunk
+        * side. Discards all computed probes. */
+        void setup(float cellSize, unsigned chunkCells);
+
+        /** \brief Marks all chunks with probes inside of the given world rect as outdated. Outdated probes
+        * are still sampled until they are recomputed. */
+        void invalidate(const sf::FloatRect& rect);
+
+        /** \brief Discards all computed probes. */
+        void clear();
+
+        /** \brief Computes missing or outdated chunks that overlap the given world rect, at most budget chunks
+        * per call. evaluate receives the world rect of a chunk and the positions of its probes and has to
+        * write the light at these positions. */
+        void update(const sf::FloatRect& rect, unsigned budget,
+                    const std::function<void(const sf::FloatRect&, const std::vector<sf::Vector2f>&, std::vector<sf::Color>&)>& evaluate);
+
+        /** \brief Returns the bilinearly interpolated light at the position. Probes that were never computed
+        * contribute black. */
+        sf::Color sample(const sf::Vector2f& position) const;
+
+        /** \brief Returns true if the grid was set up. */
+        bool isSetup() const;
+
+    private:
+        struct Chunk
+        {
+            std::vector<sf::Color> probes;
+            bool valid = false;
+        };
+
+        std::map<std::pair<int, int>, Chunk> mChunks;
+        float mCellSize;
+        int mChunkCells;
+    };
+
+    /** \brief Renders a light map on the cpu from the same shadow geometry the gpu path uses. Requires no render
+    * target and, after LightSystem::initSoftware, no GL context, so lighting can be computed on servers, for
+    * offline baking and for pixel exact tests. The image is split into tiles that are rendered in parallel, the
+    * inner loops use SSE2 where it is available and yield the same values as their scalar fallback. Light
+    * textures are read from their image files, the penumbra texture is approximated with a linear ramp and light
+    * over shape colliders are left lit. */
+    class LightRasterizer
+    {
+    public:
+        LightRasterizer();
+
+        /** \brief Sets the number of threads the tiles are distributed to. 0 uses one thread per core. */
+        void setThreadCount(unsigned count);
+
+        /** \brief Discards all lights that were added since the last call to clear. */
+        void clear();
+
+        /** \brief Adds a light together with the colliders that may cast shadows for it. The shadow geometry
+        * is computed immediately, light and colliders may change afterwards. */
+        void addLight(const PointLight& light,
+                      const Transform& transf,
+                      const std::vector< std::pair<LightCollider*, Transform*> >& colliders);
+
+        /** \brief Adds a light with shadow geometry that was computed by PointLight::computeShadowGeometry
+        * for the given colliders before. */
+        void addLight(const PointLight& light,
+                      const Transform& transf,
+                      const std::vector< std::pair<LightCollider*, Transform*> >& colliders,
+                      const std::vector<ShadowGeometry>& shadows,
+                      const std::vector<bool>& hidden);
+
+        /** \brief Composes the ambient color and all added lights for the given world area into image,
+        * which is recreated with the given size. */
+        void render(sf::Image& image, const sf::Vector2u& size, const sf::FloatRect& area, const sf::Color& ambient) const;
+
+        /** \brief Evaluates the ambient color and all added lights at the given world points. The result for a
+        * point equals the pixel render would produce at that position. Points are bucketed per light through
+        * a grid over the light bounds and every light processes its points in one batch. */
+        void sample(const std::vector<sf::Vector2f>& points, std::vector<sf::Color>& colors, const sf::Color& ambient) const;
+
+    private:
+        struct RasterLight
+        {
+            const sf::Image* image;
+            sf::Transform toTexture;        ///<maps world coordinates to texel coordinates
+            sf::FloatRect textureRect;
+            sf::Vector3f color;
+            sf::FloatRect bounds;
+            float extension;
+            std::vector<ShadowGeometry> shadows;
+            std::vector< std::vector<sf::Vector2f> > masks;  ///<outlines of the colliders that are masked black
+        };
+
+        std::vector<RasterLight> mLights;
+        std::map<std::string, sf::Image> mImages;
+        unsigned mThreadCount;
+
+        void renderTile(std::vector<sf::Uint8>& pixels, const sf::Vector2u& size, const sf::IntRect& tile,
+                        const sf::FloatRect& area, const sf::Color& ambient) const;
+
+        void shadePoints(const RasterLight& light, const std::vector<float>& xs, const std::vector<float>& ys,
+                         std::vector<float>& shade, std::vector<float>& antumbra, std::vector<unsigned char>& inside) const;
+
+        static constexpr int TILE_SIZE = 64;
+        static constexpr int SAMPLE_GRID_SIZE = 16; ///<number of cells per side of the light grid used by sample
+    };
+
+    /** \brief Reads the contents of a render texture back to the cpu without stalling the pipeline. Every request
+    * copies the texture into the next pixel buffer object of a ring, the copy is mapped a few frames later
+    * when the gpu is done with it. Uses fences if available and falls back to a fixed latency otherwise. */
+    class LightMapReadback : sf::NonCopyable
+    {
+    public:
+        LightMapReadback();
+        ~LightMapReadback();
+
+        /** \brief Sets the number of buffers in the ring (at least 2), which is the maximum latency in frames,
+        * and the factor the texture is downsampled by before it is read. Discards pending reads. */
+        void setup(unsigned ringSize, unsigned downsample);
+
+        /** \brief Issues an asynchronous read of the texture. The request is dropped if all buffers of the
+        * ring are still in flight. */
+        void request(sf::RenderTexture& texture);
+
+        /** \brief Checks for finished reads without blocking. The most recent finished result is stored and
+        * passed to the callback. Returns true if a new result is available. */
+        bool poll();
+
+        /** \brief Sets a callback that is invoked with the pixels (rgba, top row first) and size of every finished read. */
+        void setCallback(const std::function<void(const std::vector<sf::Uint8>&, const sf::Vector2u&)>& callback);
+
+        /** \brief Returns the pixels of the most recent finished read, rgba with the top row first. */
+        const std::vector<sf::Uint8>& getPixels() const;
+
+        /** \brief Returns the size of the most recent finished read. */
+        sf::Vector2u getSize() const;
+
+    private:
+        struct Slot
+        {
+            unsigned buffer = 0;
+            void* fence = nullptr;
+            sf::Vector2u size;
+            bool pending = false;
+            unsigned frame = 0;
+        };
+
+        std::vector<Slot> mSlots;
+        std::size_t mNext;
+        unsigned mFrame;
+        unsigned mDownsample;
+        bool mLoaded;
+        bool mSupported;
+        sf::RenderTexture mDownsampleTexture;
+        std::vector<sf::Uint8> mPixels;
+        sf::Vector2u mSize;
+        std::function<void(const std::vector<sf::Uint8>&, const sf::Vector2u&)> mCallback;
+
+        bool isReady(Slot& slot) const;
+        void discard(Slot& slot);
+        void read(Slot& slot);
+        void release();
+    };
+
+    /** \brief Decides which lights are re-rendered in a frame. Every light keeps its last rendering as a mask in
+    * world space, lights that are not selected are composed from their mask. A mask is outdated if its light
+    * changed or a collider changed within the bounds of the light. Lights with outdated masks are prioritized by
+    * their coverage of the view, their distance to the camera and the age of their mask. Lights with unchanged
+    * inputs are refreshed round robin with the remaining budget. */
+    class ShadowScheduler
+    {
+    public:
+        ShadowScheduler();
+
+        /** \brief Re-renders at most budget lights per frame. Lights whose mask is outdated for maxStaleness frames
+        * and lights without a mask are always re-rendered and take precedence. A budget of 0 disables the scheduler. */
+        void setup(unsigned budget, unsigned maxStaleness);
+
+        /** \brief Returns true if a budget is set. */
+        bool isEnabled() const;
+
+        /** \brief Releases all masks. */
+        void clear();
+
+        /** \brief Outdates the masks that overlap a changed world region, e.g. the old and new bounds of a
+        * moved collider. Masks stay outdated until they are rendered again, even if their light is not visible. */
+        void invalidate(const sf::FloatRect& region);
+
+        /** \brief Outdates the mask of the light, e.g. after its color changed. */
+        void invalidate(const PointLight* light);
+
+        /** \brief Registers a visible light with its world bounds for the current frame. maskSize is the desired side
+        * length of the mask in pixels. Returns the index of the light in the current frame. */
+        std::size_t addLight(const PointLight* light, const sf::FloatRect& bounds, unsigned maskSize);
+
+        /** \brief Selects the registered lights that are re-rendered in this frame. */
+        void schedule(const sf::FloatRect& viewRect);
+
+        /** \brief Returns true if the light with the given frame index has to be rendered into its mask. */
+        bool isScheduled(std::size_t index) const;
+
+        /** \brief Returns the mask of the light with the given frame index. */
+        sf::RenderTexture& getMask(std::size_t index);
+
+        /** \brief Returns the world rect the mask of the light with the given frame index covers. */
+        const sf::FloatRect& getMaskBounds(std::size_t index) const;
+
+        /** \brief Returns a scratch texture of the given size, that is shared by all masks of that size. Masks that
+        * need several scratch textures at once select them by index. */
+        sf::RenderTexture& getScratch(unsigned size, unsigned index = 0);
+
+        /** \brief Ends the frame. Masks of lights that were not visible for maxStaleness frames are returned
+        * to the pool. */
+        void endFrame();
+
+        /** \brief Returns the side length of the mask for a light that covers the given number of pixels on screen. */
+        static unsigned getMaskSize(float pixels);
+
+    private:
+        struct Mask
+        {
+            std::unique_ptr<sf::RenderTexture> texture;
+            unsigned size = 0;
+            sf::FloatRect bounds;
+            unsigned renderedFrame = 0;
+            unsigned outdatedFrame = 0; ///<frame since which the mask is outdated
+            bool outdated = true;
+            unsigned seenFrame = 0;
+        };
+
+        struct Request
+        {
+            Mask* mask;
+            sf::FloatRect bounds;
+            unsigned size;
+            bool scheduled;
+        };
+
+        std::map<const PointLight*, Mask> mMasks;
+        std::vector<Request> mRequests;
+        std::map<unsigned, std::vector< std::unique_ptr<sf::RenderTexture> > > mPool; ///<unused masks by size class
+        std::map<std::pair<unsigned, unsigned>, sf::RenderTexture> mScratch;
+        unsigned mBudget;
+        unsigned mMaxStaleness;
+        unsigned mFrame;
+
+        std::unique_ptr<sf::RenderTexture> acquire(unsigned size);
+        void release(Mask& mask);
+        void outdate(Mask& mask);
+
+        static constexpr unsigned MIN_MASK_SIZE = 32;
+        static constexpr unsigned MAX_MASK_SIZE = 1024;
+    };
+
+    /** \brief A pool of persistent worker threads, that processes a range of indices in chunks. The calling thread
+    * takes part in the work and run returns when all chunks are done. */
+    class LightJobPool : sf::NonCopyable
+    {
+    public:
+        LightJobPool();
+        ~LightJobPool();
+
+        /** \brief Sets the number of threads including the calling one, 0 picks the number of hardware threads.
+        * With a single thread jobs run on the calling thread only. */
+        void setThreadCount(unsigned count);
+
+        /** \brief Returns the number of threads including the calling one. */
+        unsigned getThreadCount() const;
+
+        /** \brief Calls job(begin, end) for consecutive chunks of at most chunkSize indices of [0, count). Chunks
+        * run in parallel, so the job has to be safe to call concurrently for disjoint ranges. */
+        void run(std::size_t count, std::size_t chunkSize, const std::function<void(std::size_t, std::size_t)>& job);
+
+    private:
+        std::vector<std::thread> mWorkers;
+        std::mutex mMutex;
+        std::condition_variable mWake;
+        std::condition_variable mDone;
+        const std::function<void(std::size_t, std::size_t)>* mJob;
+        std::size_t mCount;
+        std::size_t mChunkSize;
+        std::atomic<std::size_t> mNext;
+        unsigned mBusy; ///<number of workers that did not finish the current run yet
+        unsigned mGeneration; ///<incremented for every run, so that each worker takes part in each run once
+        bool mStop;
+
+        void work(unsigned generation);
+        void runChunks();
+        void stop();
+    };
+
+    /** \brief The colliders and shadow geometry of the lights rendered in the current frame, shared by all views
+    * that show the same light. May be used from several render threads at once. Entries point to the colliders
+    * they were computed with, so colliders must not be destroyed while an entry of the frame is in use. */
+    class ShadowGeometryCache : sf::NonCopyable
+    {
+    public:
+        struct Entry
+        {
+            std::vector< std::pair<LightCollider*, Transform*> > colliders;
+            std::vector<ShadowGeometry> shadows;
+            std::vector<bool> hidden;
+            bool sourceBlocked = false;
+        };
+
+        /** \brief Returns the entry of the light at the given transform, the world transform of the entity combined
+        * with the transform of the light itself. The first view that requests the light calls compute to fill the
+        * entry, other views wait until it is done. An entry that was computed for another transform or before the
+        * last invalidation is computed anew. The returned entry stays valid as long as it is held, even if the cache
+        * is invalidated or cleared meanwhile. */
+        std::shared_ptr<const Entry> get(const PointLight* light, const sf::Transform& transform,
+                                         const std::function<void(Entry&)>& compute);
+
+        /** \brief Outdates all entries, e.g. after colliders changed. Entries that were not requested since the
+        * previous call are discarded. */
+        void invalidate();
+
+        /** \brief Discards all entries. */
+        void clear();
+
+    private:
+        struct Slot
+        {
+            std::once_flag computed;
+            Entry entry;
+            sf::Transform transform;
+            unsigned version;
+        };
+
+        std::map<const PointLight*, std::shared_ptr<Slot> > mSlots;
+        unsigned mVersion = 0;
+        std::mutex mMutex;
+    };
+
+    /** \brief The render textures and shaders a view is lit with. Views with their own context can be lit in the
+    * same frame, e.g. for split screen, minimaps or reflections. A context is prepared by
+    * LightSystem::initRenderContext. */
+    class LightRenderContext : sf::NonCopyable
+    {
+    friend class LightSystem;
+    public:
+        /** \brief Updates the size of the render textures (e.g. if the view was resized). */
+        void setImageSize(const sf::Vector2u& imageSize);
+
+        /** \brief Returns the light map composed by the last render with this context. */
+        const sf::Texture& getLightMap() const;
+
+    private:
+        sf::RenderTexture mLightTexture, mEmissionTexture, mAntumbraTexture, mCompositionTexture;
+        sf::Shader mUnshadowShader, mLightOverShapeShader, mLightAnimationShader;
+        sf::Sprite mDisplaySprite;
+    };
+
+    /** \brief A copy of the render relevant state of the lights and colliders of a set of entities, that can
+    * be rendered without accessing the entities. */
+    struct LightSnapshot
+    {
+        /** \brief The render parameters of an active light. The texture is only referenced by its path, the
+        * rendering thread keeps textures of its own. */
+        struct Light
+        {
+            std::string texturePath;
+            sf::IntRect textureRect;
+            sf::Vector2f origin;
+            sf::Vector2f position;
+            sf::Vector2f scale;
+            sf::Color color;
+            sf::Vector2f sourcePoint;
+            float radius;
+            float shadowOverExtendMultiplier;
+            LightAnimation animation;
+            Transform transform;
+            sf::FloatRect bounds; ///<world bounds of the light
+            std::vector<std::size_t> colliders; ///<indices of the colliders the quadtree returned for the light
+        };
+
+        struct Collider
+        {
+            LightCollider collider;
+            Transform transform;
+            sf::FloatRect bounds; ///<world bounds of the collider
+        };
+
+        std::vector<Light> lights;
+        std::vector<Collider> colliders;
+        sf::Color ambientColor = sf::Color::White;
+        double animationTime = 0.0;
+        ShadowTechnique technique = ShadowTechnique::Penumbras;
+        bool mergeUmbras = false;
+    };
+
+    /** \brief A triple buffer of light snapshots for one writing and one reading thread. The writer fills the
+    * back snapshot and publishes it, the reader acquires the most recently published one. Neither side waits
+    * for the other, the writer may publish several times between two acquires. */
+    class LightSnapshotBuffer : sf::NonCopyable
+    {
+    public:
+        LightSnapshotBuffer();
+
+        /** \brief Returns the snapshot the writer fills. It holds the state of an older publish. */
+        LightSnapshot& getBack();
+
+        /** \brief Hands the back snapshot over to the reader. A published snapshot that was not acquired yet
+        * becomes the new back snapshot. */
+        void publish();
+
+        /** \brief Switches to the most recently published snapshot, if there is a new one, and returns it.
+        * The snapshot stays valid until the next acquire. */
+        LightSnapshot& acquire();
+
+        /** \brief Returns true if publish was called at least once. */
+        bool hasPublished() const;
+
+    private:
+        LightSnapshot mSnapshots[3];
+        unsigned mBack; ///<only accessed by the writer
+        unsigned mFront; ///<only accessed by the reader
+        std::atomic<unsigned> mPending; ///<index of the snapshot in between, FRESH is set if it was not acquired yet
+        std::atomic<bool> mPublished;
+
+        static constexpr unsigned FRESH = 4;
+    };
+
+    /** \brief An entry of a batch update that sets a point of a collider. The collider index refers to a
+    * collider of a MultiShadowEmitter, NO_INDEX to the collider of a ShadowEmitter. */
+    struct ColliderPointUpdate
+    {
+        static constexpr std::size_t NO_INDEX = static_cast<std::size_t>(-1);
+
+        Entity entity;
+        sf::Vector2f point;
+        std::size_t pointIndex;
+        std::size_t colliderIndex = NO_INDEX;
+    };
+
     /** \brief The bring-it-all-together class. Handles all Lights and LightColliders and is responsible for
     * rendering them. */
     class LightSystem : sf::NonCopyable
@@ -288,13 +1233,137 @@ namespace ungod
                   const std::string& lightOverShapeFragment,
                   const std::string& penumbraTexture);
 
+        /** \brief Instantiates the light system for software rendering only. Loads no shaders and creates
+        * no render textures. Lights that are created afterwards only read the size of their image and create no
+        * texture, so no GL context is needed. Has to be called before the first light is created. Only
+        * renderSoftware and queryLight may be used afterwards. */
+        void initSoftware(quad::QuadTree<Entity>* quadtree);
+
         /** \brief Updates the size of the underlying render-textures (e.g. if the window was resized). */
         void setImageSize(const sf::Vector2u &imageSize);
 
-        /** \brief Renders lights and lightcolliders of a list of entities. */
+        /** \brief Renders lights and lightcolliders of a list of entities. Starts a new frame of the shadow
+        * geometry cache. */
         void render(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states);
 
-        /** \brief Updates LightAffectors. */
+        /** \brief Loads the shaders of the context and creates its render textures. Requires init. */
+        void initRenderContext(LightRenderContext& context, const sf::Vector2u& imageSize) const;
+
+        /** \brief Renders lights and lightcolliders of a list of entities with the targets of the given context.
+        * Changes neither the light system nor the entities, so several views may be rendered at once, each with its
+        * own context. The shadow geometry of a light is computed once and shared by all views that show it, until
+        * the light moves, a collider changes or the next update. Lights are rendered with the Penumbras or
+        * VisibilityPolygon technique, static lights are composed from the static light map if it is baked. Must not
+        * overlap update or any other call that modifies the light system, and the rendered colliders must not be
+        * destroyed before all views of the frame are rendered. */
+        void render(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states,
+                    LightRenderContext& context) const;
+
+        /** \brief Copies the active lights of the given entities, e.g. all entities around the camera, into the back
+        * snapshot, together with the colliders the quadtree returns for them. Called by the thread that modifies the
+        * lights, once its changes of a frame are done. The lights of the entities count as visible for the affector
+        * policies. */
+        void captureSnapshot(const std::list<Entity>& entities);
+
+        /** \brief Hands the captured snapshot over to renderSnapshot. */
+        void publishSnapshot();
+
+        /** \brief Renders the most recently published snapshot. Accesses neither the entities nor the quadtree,
+        * so it may run on a render thread while another thread updates, moves and modifies the lights. Lights are
+        * rendered with the Penumbras or VisibilityPolygon technique, static lights included. The render textures
+        * and the light textures are owned by this thread, so setImageSize has to be called from it as well. */
+        void renderSnapshot(sf::RenderTarget& target, sf::RenderStates states);
+
+        /** \brief Renders the light map of the given world area on the cpu into image, which is recreated
+        * with the given size. The result equals the composition texture of render, without the final multiply. */
+        void renderSoftware(const sf::FloatRect& area, const sf::Vector2u& size, sf::Image& image);
+
+        /** \brief Computes the light at a batch of world positions on the cpu, including ambient light and
+        * penumbras. Does not touch the gpu, so it is cheap to call every tick. Points are grouped into cells
+        * of QUERY_CELL_SIZE and only lights that reach the points of a cell are considered. Shadow geometry
+        * that was computed by the last render is reused. */
+        void queryLight(const std::vector<sf::Vector2f>& points, std::vector<sf::Color>& colors);
+
+        /** \brief Enables asynchronous readback of the composed light map. Every rendered frame is copied to a
+        * ring of ringSize pixel buffers after being downsampled by the given factor, results arrive
+        * ringSize - 1 frames later at most. */
+        void enableReadback(unsigned ringSize = 3, unsigned downsample = 1);
+
+        /** \brief Disables the readback of the light map. */
+        void disableReadback();
+
+        /** \brief Registers a callback that receives every light map read back (rgba pixels, top row first). */
+        void onReadback(const std::function<void(const std::vector<sf::Uint8>&, const sf::Vector2u&)>& callback);
+
+        /** \brief Returns the readback, that can be used to poll the most recent light map. */
+        const LightMapReadback& getReadback() const;
+
+        /** \brief Enables baking of static lights into a chunked world space light map with chunks of chunkSize
+        * world units and resolution texels per side. Static lights are no longer rendered each frame, their
+        * chunks are baked on demand and composited instead. Until every chunk of a view is baked, they are rendered
+        * like dynamic lights in that view. Only static colliders cast shadows for them. */
+        void initStaticLightMap(float chunkSize = 1024.0f, unsigned resolution = 256);
+
+        /** \brief Bakes all chunks of the static light map that overlap rect and are not baked yet. */
+        void bakeStaticLights(const sf::FloatRect& rect);
+
+        /** \brief Writes the baked static light map to a directory, e.g. from an offline tool that loads a
+        * world and bakes it up front. */
+        bool saveStaticLightMap(const std::string& directory) const;
+
+        /** \brief Loads a static light map that was written by saveStaticLightMap and enables baking. */
+        bool loadStaticLightMap(const std::string& directory);
+
+        /** \brief Writes the baked static light map into a single file that can be streamed. */
+        bool writeStaticLightMap(const std::string& path, LightMapFormat format = LightMapFormat::RGBA) const;
+
+        /** \brief Streams the static light map from a file written by writeStaticLightMap. Only chunks around the
+        * view are kept in memory, at most residentChunks of them. Missing chunks fall back to ambient light. */
+        bool streamStaticLightMap(const std::string& path, unsigned residentChunks = 64);
+
+        /** \brief Prepares the light probe grid with probes every cellSize world units, that are computed in
+        * chunks of chunkCells x chunkCells probes. Probes around the view are updated during render. */
+        void initLightProbes(float cellSize = 64.0f, unsigned chunkCells = 16);
+
+        /** \brief Computes missing or outdated light probes that overlap rect. Called by render for the view,
+        * but may also be used without rendering. */
+        void updateLightProbes(const sf::FloatRect& rect);
+
+        /** \brief Returns the ambient color plus the light of the static lights at the position, interpolated
+        * from the light probe grid. */
+        sf::Color sampleLightProbes(const sf::Vector2f& position) const;
+
+        /** \brief Limits the number of lights that are re-rendered per frame to budget. The other lights are composed
+        * from a cached mask of their last rendering, but no light shows outdated shadows for more than maxStaleness
+        * frames. Applies to the Penumbras and VisibilityPolygon techniques. */
+        void enableShadowScheduler(unsigned budget = 32, unsigned maxStaleness = 8);
+
+        /** \brief Renders all visible lights every frame again and releases the cached masks. */
+        void disableShadowScheduler();
+
+        /** \brief Returns the software renderer, e.g. to set its thread count. */
+        LightRasterizer& getRasterizer();
+
+        /** \brief If set, the umbras of all colliders of a light are merged into a set of non overlapping
+        * polygons before they are drawn. Reduces overdraw in scenes with many overlapping shadows. */
+        void setUmbraMerging(bool merge);
+
+        /** \brief Returns true if umbra merging is enabled. */
+        bool getUmbraMerging() const;
+
+        /** \brief Prepares the DistanceField shadow technique. The distance field of the static colliders is
+        * computed in chunks of chunkSize world units with resolution texels per side and stores distances
+        * up to maxDistance. Non static colliders are not considered by that technique. Until the field is
+        * prepared (or if its shader does not compile), lights are rendered with the Penumbras technique. */
+        void initDistanceField(float chunkSize = 512.0f, unsigned resolution = 128, float maxDistance = 64.0f);
+
+        /** \brief Sets the algorithm that is used to compute the shadows of the lights. */
+        void setShadowTechnique(ShadowTechnique technique);
+
+        /** \brief Returns the algorithm that is used to compute the shadows of the lights. */
+        ShadowTechnique getShadowTechnique() const;
+
+        /** \brief Updates LightAffectors. Outdates the shadow geometry shared by the views of the previous frame. */
         void update(const std::list<Entity>& entities, float delta);
 
         /** \brief Sets the color of the ambient light. */
@@ -340,6 +1409,64 @@ namespace ungod
         void setPoints(Entity e, const std::vector<sf::Vector2f>& points, std::size_t colliderIndex);
 
 
+        /** \brief Batch versions of the setters above. The updates are applied grouped by component type and
+        * emit a single ContentsChanged notification per entity. Consecutive updates of the points of the same
+        * collider are treated as one change. */
+        void setLocalLightPositions(const std::vector< LightUpdate<sf::Vector2f> >& updates);
+        void setLightScales(const std::vector< LightUpdate<sf::Vector2f> >& updates);
+        void setLightColors(const std::vector< LightUpdate<sf::Color> >& updates);
+        void setPoints(const std::vector<ColliderPointUpdate>& updates);
+
+
+        /** \brief Marks the LightCollider as static. Static colliders are cached by the light system.
+        * Requires ShadowEmitter component. */
+        void setColliderStatic(Entity e, bool isStatic);
+
+        /** \brief Marks the LightCollider with given index as static. Requires MultiShadowEmitter component. */
+        void setColliderStatic(Entity e, bool isStatic, std::size_t colliderIndex);
+
+
+        /** \brief Marks the light as static. Static lights are baked into the light probes and must not be
+        * animated by affectors. Requires LightEmitter component. */
+        void setLightStatic(Entity e, bool isStatic);
+
+        /** \brief Marks the light with given index as static. Requires MultiLightEmitter component. */
+        void setLightStatic(Entity e, bool isStatic, std::size_t index);
+
+
+        /** \brief Lets the light of entity e flicker, without the need for a LightAffector. Requires LightEmitter component.
+        * See LightFlickerSystem for the parameters. */
+        void setLightFlickering(Entity e, float period, float strength, bool randomized = false);
+
+        /** \brief Lets the light with given index of entity e flicker. Requires MultiLightEmitter component. */
+        void setLightFlickering(Entity e, float period, float strength, bool randomized, std::size_t index);
+
+        /** \brief Stops the flickering of the light of entity e. Requires LightEmitter component. */
+        void removeLightFlickering(Entity e);
+
+        /** \brief Stops the flickering of the light with given index of entity e. Requires MultiLightEmitter component. */
+        void removeLightFlickering(Entity e, std::size_t index);
+
+
+        /** \brief Sets the animation of the light of entity e, that is evaluated on the gpu. Applies to the Penumbras
+        * and VisibilityPolygon techniques. Requires LightEmitter component. */
+        void setLightAnimation(Entity e, const LightAnimation& animation);
+
+        /** \brief Sets the animation of the light with given index of entity e. Requires MultiLightEmitter component. */
+        void setLightAnimation(Entity e, const LightAnimation& animation, std::size_t index);
+
+        /** \brief Returns the time in milliseconds that drives light animations, advanced by update. */
+        float getAnimationTime() const;
+
+
+        /** \brief Sets the number of threads affectors are updated on, 0 picks the number of hardware threads. With
+        * more than one thread, the affectors of lights whose affectors are all thread safe are updated in parallel
+        * chunks, all affectors of the same light in the same chunk. The others run on the calling thread. A callback
+        * must then only touch the LightEmitter it is bound to. Lights that outgrew their bounds are notified
+        * afterwards in a serial step. One thread keeps the serial update. */
+        void setAffectorThreads(unsigned count);
+
+
         /** \brief Defines the callback for the affector. Is mandatory to get the
         * affector to work. Requires LightEmitter-component and a LightEffector-component. */
         void setAffectorCallback(Entity e, const std::function<void(float, LightEmitter&)>& callback);
@@ -354,25 +1481,119 @@ namespace ungod
         /** \brief Registers new callback for the ContentsChanged signal. */
         void onContentsChanged(const std::function<void(Entity, const sf::IntRect&)>& callback);
 
+        /** \brief If set, ContentsChanged notifications are collected instead of emitted immediately. Notifications
+        * of the same entity are merged into one with the union of their rects, all of them are emitted by
+        * flushContentsChanged at the end of update. Changes made between two updates reach the quadtree with the
+        * next update. Disabling flushes pending notifications. */
+        void setDeferredNotifications(bool deferred);
+
+        /** \brief Returns true if ContentsChanged notifications are deferred. */
+        bool getDeferredNotifications() const;
+
+        /** \brief Emits all pending ContentsChanged notifications. */
+        void flushContentsChanged();
+
         /** \brief Methods that move all lights/colliders attached to the given entity. Are usually only
-        * used internally by the transform-manager. */
+        * used internally by the transform-manager. Cached shadows and baked light are updated by them. */
         void moveLights(Entity e, const sf::Vector2f& vec);
         void moveLightColliders(Entity e, const sf::Vector2f& vec);
 
 
     private:
-        sf::RenderTexture mLightTexture, mEmissionTexture, mAntumbraTexture, mCompositionTexture;
-        sf::Shader mUnshadowShader, mLightOverShapeShader;
+        LightRenderContext mContext; ///<context of the main view
+        std::string mUnshadowVertex, mUnshadowFragment, mLightOverShapeVertex, mLightOverShapeFragment;
         quad::QuadTree<Entity>* mQuadTree;
         ungod::Image mPenumbraTexture;
         sf::Color mAmbientColor;
-        sf::Sprite mDisplaySprite;
         sf::Vector3f mColorShift;
         owls::Signal<Entity, const sf::IntRect&> mContentsChangedSignal;
+        bool mDeferNotifications;
+        std::vector< std::pair<Entity, sf::IntRect> > mPendingChanges;
+        std::map<const void*, std::size_t> mPendingIndices; ///<pending notification per component of an entity
+        bool mMergeUmbras;
+        ShadowTechnique mShadowTechnique;
+        ShadowDistanceField mDistanceField;
+        sf::RenderTexture mDistanceFieldTexture;
+        sf::Shader mDistanceFieldShader;
+
+        sf::Texture mShadowMapAtlas;
+        std::vector<sf::Uint8> mShadowMapPixels;
+        sf::Shader mShadowMapShader;
+        double mAnimationTime;
+        unsigned mRenderFrame;
+        LightRasterizer mRasterizer;
+        LightMapReadback mReadback;
+        bool mReadbackEnabled;
+        bool mStaticLightsComposed;  ///<true if the main view composed the static light map this frame
+        LightProbeGrid mLightProbes;
+        LightRasterizer mProbeRasterizer;
+        StaticLightMap mStaticLightMap;
+        sf::RenderTexture mBakeLightTexture, mBakeAntumbraTexture;
+        ShadowScheduler mShadowScheduler;
+        LightFlickerSystem mFlicker;
+        LightJobPool mAffectorJobs;
+        LightSnapshotBuffer mSnapshots;
+        std::map<std::string, std::unique_ptr<PointLight> > mSnapshotLights; ///<lights of the rendering thread, one per texture
+        mutable ShadowGeometryCache mGeometryCache;
+
+        static constexpr unsigned SHADOW_MAP_RESOLUTION = 512; ///<number of angular bins per light in the shadow map atlas
+        static constexpr unsigned DISTANCE_FIELD_LIGHTS = 32; ///<number of lights that are composed per distance field pass
+        static constexpr unsigned DISTANCE_FIELD_CHUNK_BUDGET = 4; ///<max number of chunks computed per frame
+        static constexpr unsigned LIGHT_PROBE_CHUNK_BUDGET = 2; ///<max number of light probe chunks computed per frame
+        static constexpr unsigned STATIC_LIGHT_MAP_CHUNK_BUDGET = 1; ///<max number of static light map chunks baked per frame
+        static constexpr std::size_t AFFECTOR_CHUNK_SIZE = 64; ///<number of affectors a job processes at once
+        static constexpr float LIGHT_CLUSTER_AREA_RATIO = 2.0f; ///<max ratio of the union bounds of clustered lights to their summed area
+        static constexpr float QUERY_CELL_SIZE = 256.0f; ///<side length of the cells queryLight groups its points into
 
     private:
+        /** \brief The colliders near a cluster of lights of the same entity, that are retrieved once for the union
+        * of the bounds of the lights and then filtered for each of them. */
+        struct ColliderCandidates
+        {
+            explicit ColliderCandidates(const sf::FloatRect& rect = sf::FloatRect()) : bounds(rect) {}
+
+            sf::FloatRect bounds;
+            std::vector< std::pair<LightCollider*, Transform*> > colliders;
+            std::vector<sf::FloatRect> colliderBounds; ///<world bounds of the colliders
+            bool gathered = false;
+        };
+
         void setAffectorCallback(const std::function<void(float, LightEmitter&)>& callback, LightAffector& affector, LightEmitter& emitter);
-        void renderLight(sf::RenderTarget& target, sf::RenderStates states, Entity e, Transform& lightTransf, LightEmitter& light);
+        void notifyContentsChanged(Entity e, const sf::IntRect& rect);
+        const void* getPendingKey(Entity e) const;
+        void batchNotifications(const std::function<void()>& apply);
+        void setAnimationUniforms(sf::Shader& shader, const PointLight& light, const sf::Vector2f& center, double time) const;
+        void updateAffector(LightAffector& affector, float delta);
+        void updateAffectors(const std::list<Entity>& entities, float delta);
+        void updateTracks(const std::list<Entity>& entities, float delta);
+        void renderLight(sf::RenderTarget& target, sf::RenderStates states, Transform& lightTransf, LightEmitter& light,
+                         ColliderCandidates& candidates);
+        void composeLight(LightRenderContext& context, sf::RenderTarget& target, sf::RenderStates states, const PointLight& light,
+                          const Transform& lightTransf, const ShadowGeometryCache::Entry& geometry, double time,
+                          ShadowTechnique technique, bool mergeUmbras) const;
+        void computeGeometry(const PointLight& light, const Transform& lightTransf, ShadowGeometryCache::Entry& geometry,
+                             ShadowTechnique technique) const;
+        std::shared_ptr<const ShadowGeometryCache::Entry> getGeometry(const Transform& lightTransf, const LightEmitter& light,
+                                                                      ColliderCandidates& candidates) const;
+        void renderDistanceField(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states);
+        void renderShadowMaps(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states);
+        void renderScheduled(const quad::PullResult<Entity>& pull, sf::RenderTarget& target, sf::RenderStates states);
+        void gatherColliders(const Transform& lightTransf, const LightEmitter& light,
+                             std::vector< std::pair<LightCollider*, Transform*> >& colliders) const;
+        void gatherColliders(const Transform& lightTransf, const LightEmitter& light, ColliderCandidates& candidates,
+                             std::vector< std::pair<LightCollider*, Transform*> >& colliders) const;
+        void gatherCandidates(ColliderCandidates& candidates) const;
+        void clusterLights(const Transform& lightTransf, const MultiLightEmitter& light,
+                           std::vector<ColliderCandidates>& clusters, std::vector<std::size_t>& clusterOf) const;
+        void visitLights(const std::list<Entity>& entities,
+                         const std::function<void(Transform&, LightEmitter&, ColliderCandidates&)>& visit) const;
+        void invalidateCollider(Entity e, const LightCollider& collider);
+        void invalidateLight(Entity e, const PointLight& light);
+        void invalidateLight(Entity e, const PointLight& light, sf::FloatRect bounds);
+        void bakeStaticChunk(const sf::FloatRect& rect, sf::RenderTexture& texture);
+        bool isBaked(const PointLight& light) const;
+        void computeLightProbes(const sf::FloatRect& rect, const std::vector<sf::Vector2f>& positions, std::vector<sf::Color>& colors);
+        void prepareRasterizer(const std::vector<sf::FloatRect>& areas);
     };
 
 
@@ -472,6 +1693,38 @@ namespace ungod
     {
         static void deserialize(MultiLightAffector& data, MetaNode deserializer, DeserializationContext& context);
     };
+
+    template <>
+    struct SerialIdentifier<LightTracks>
+    {
+        static std::string get()  { return "LightTracks"; }
+    };
+    template <>
+    struct SerialBehavior<LightTracks>
+    {
+        static void serialize(const LightTracks& data, MetaNode serializer, SerializationContext& context);
+    };
+    template <>
+    struct DeserialBehavior<LightTracks>
+    {
+        static void deserialize(LightTracks& data, MetaNode deserializer, DeserializationContext& context);
+    };
+
+    template <>
+    struct SerialIdentifier<MultiLightTracks>
+    {
+        static std::string get()  { return "MultiLightTracks"; }
+    };
+    template <>
+    struct SerialBehavior<MultiLightTracks>
+    {
+        static void serialize(const MultiLightTracks& data, MetaNode serializer, SerializationContext& context);
+    };
+    template <>
+    struct DeserialBehavior<MultiLightTracks>
+    {
+        static void deserialize(MultiLightTracks& data, MetaNode deserializer, DeserializationContext& context);
+    };
 }
 
 #endif //LIGHT_H